@@ -7,6 +7,15 @@
 
    Usage:
    sumpalarm [-v]
+   sumpalarm ratebench [-a percent] [-l limit] [-w warmup] [-d depth] [trace ...]
+   sumpalarm query [-d dir] [-s switch] [-H] from [to]
+   sumpalarm analyze [-c config] [-j threads] [-d journaldir ...] [logfile ...]
+   sumpalarm analyze -b [years] [-j threads]
+   sumpalarm replay [-a amt] [-l limit] [-o threshold] [-q quantile] [-f factor]
+                    [-j threads] [-r repeat] [-d journaldir ...] [-b years] [log ...]
+   sumpalarm simulate [-d days] [-i inflow] [-p pumprate] [-s seed] [-c]
+   sumpalarm spawnbench [-n count] [-m MB] [action ...]
+   sumpalarm selftest [test ...]
 
    If used without the -v option, the application is run as a daemon and
    will produce no output.
@@ -14,6 +23,101 @@
    Using -v will execute the application in the console and write to stdout
    as opposed to a log file.
 
+   ratebench replays Switch0 interval traces through the RateChange detector
+   and the fixed-percentage test it replaced, and prints the detection delay
+   and false alarm rate of each. A trace is a text file with one interval in
+   seconds per line, followed by 1 where the inflow really changed. With no
+   trace files a fixed set of synthetic traces is used.
+
+   query prints the switch transitions recorded in the journal (see
+   JournalDir, -d if it isn't /var/lib/sumpalarm) between two times, one per
+   line as time,switch,On/Off,seconds,rate in L/h. The seconds are the time
+   since the previous On for an On, and the time on for an Off. -s limits it
+   to one switch and -H prints hourly totals instead: cycles, seconds on,
+   mean interval and mean rate. Times are "now", -N followed by m, h, d or w,
+   or a local YYYY-MM-DD[ HH:MM[:SS]]; to defaults to now. For example, the
+   hourly totals of Switch2 over the last week:
+       sumpalarm query -s 2 -H -7d
+   Each journal segment has a sparse time index beside it, so a query reads
+   only the part of the history it covers.
+
+   analyze prints monthly totals of every switch for seasonal reports, from
+   journal directories (-d) and from log files, including ones written before
+   the journal existed. Each directory or log is reported separately, so the
+   history of several pits can be read in one go. A CSV row per month and
+   switch gives the days covered, cycles and cycles per day, the peak inflow
+   in L/h (Switch0, from its shortest interval and the pit dimensions in the
+   config, -c if it isn't /etc/sumpalarm.conf), the longest run in seconds
+   and the hours on; for Switch1 that is the time the water spent above it.
+   The input is cut into chunks shared out between -j threads (one per core
+   by default), and an idle thread takes work from a busy one. -b writes
+   years (default 10) of synthetic history to /tmp, reports the events per
+   second read with 1 thread and with -j threads, and deletes it again.
+
+   replay answers "what if RateChangeAmt had been 30?" from history instead of
+   waiting for the weather. The recorded edges (journal directories with -d,
+   logs, or traces with one "seconds switch 1|0" per line) are played through
+   the daemon's own switch handling and Overdue timers on a virtual clock,
+   once for every combination of the RateChangeAmt (-a), RateChangeLimit (-l),
+   OverdueThreshold (-o), OverdueQuantile (-q) and OverdueFactor (-f) values
+   given; anything not given, and the rest of the setup, comes from the config
+   file. Each takes a list such as 10,20 or a range such as 10:50:5. A CSV row
+   per combination counts the RateChange and Overdue actions it would have run,
+   in total and per year. Nothing is run, logged or exported while replaying.
+   -r plays the history that many times over, -b uses years of synthetic
+   history, and the simulated years per minute are printed at the end. For
+   example, against everything in the journal:
+       sumpalarm replay -d /var/lib/sumpalarm -a 10:50:10 -o 60,120,300
+
+   simulate runs the daemon's main loop against a model of the pit instead of
+   real GPIO, on a simulated clock, millions of times faster than real time.
+   The pit is a cylinder of SumpDiameter and SumpDepth with the switches at
+   their Levels. Water comes in at -i L/h on average (default 60), more in
+   spring and less in autumn, with a storm every few days, and the pump takes
+   it out at -p L/h (default 3000) from HighWater down to LowWater, apart from
+   the odd failure of a few hours. Everything else comes from the config file.
+   The same seed (-s) always gives the same run. Actions are counted rather
+   than run and nothing is logged, but their environment is still built. It
+   reports the CPU time, heap allocations and actions per simulated day, so a
+   change that slows down the scan loop or the edge path shows up; -c prints
+   every day as CSV. Allocations are only counted in a -DCOUNT_ALLOCS build.
+
+   spawnbench times starting an action (default "true", "true >/dev/null",
+   "echo $SASWITCH >>/dev/null" and "file:/dev/null Switch$SASWITCH") -n times
+   (default 1000) three ways: fork() then system(), as the daemon did before,
+   posix_spawn of /bin/sh -c, and compiled the way the daemon does it now. It
+   prints the microseconds the daemon is held up in the call, until the action
+   has exited, and of CPU per action. -m first grows the process by that many
+   MB, since the cost of fork() grows with the process. A file:, syslog:, unix:
+   or http:// action is only run the way the daemon does it; a webhook counts
+   as done when it has answered, and a message a socket drops because its
+   reader can't keep up with the back to back sends counts as failed.
+
+   selftest runs the built-in tests of the parts of the daemon that don't need
+   the hardware, or only the named ones, printing each case as ok or FAIL; the
+   exit status is the number of failures. The tests are:
+
+   scan        A scan whose pin levels can't be read is skipped rather than
+               taken as every switch Off
+   wheel       Timers armed, cancelled and re-armed in the timer wheel, on
+               level boundaries and beyond its top level, each fire once on
+               time
+   state       A state file is saved and reopened, then its newer copy is
+               corrupted and the older one has to be restored
+   journal     Journal records are written across several segments and read
+               back, and a torn block at the end is cut off on reopening
+   query       Ranges of a journal of many segments read through the segment
+               indexes have to match a full scan, also once old segments are
+               pruned and with an index or a segment missing
+   registers   The level and event detect registers of a simulated register
+               block in memory are driven and the edges reported checked
+   templates   A table of action lines is compiled and the words they are
+               filled in with checked, or that they are left to /bin/sh
+   sinks       A file, a datagram socket and a webhook on loopback are written
+               to, and the sockets restarted under them
+   gpiochip    Kernel line events are fed to the gpiochip backend through a
+               pipe standing in for its line request (INPUT_GPIOCHIP builds)
+
    The expected configuration includes two float switches.
    Switch0 to be placed between the low and high water mark in the sump pit
    so that it is tripped with the same frequency as the pump engages.
@@ -42,16 +146,70 @@
    RateChange  There's a sudden change in flow rate as per Switch0 toggle
 			   frequency. Could be a rain storm, overland flooding instead of
 			   ground water, or an exterior sump has failed and this one is
-			   running more frequently to catch up.
+			   running more frequently to catch up. Runs once when the first
+			   rate is known, then whenever a CUSUM test on the intervals
+			   between activations finds a lasting shift; a single odd interval
+			   doesn't trigger it.
 
    Overdue	   If Switch0 is active and has remained active for longer than
-			   expected, according to the running average frequency + the
+			   expected, according to the running average frequency (or a
+			   percentile of it, see OverdueQuantile) + the
 			   OverdueThreshold parameter, this script executes as a means of
 			   providing early warning that there may be a problem with power or
-			   pump.
-
-   Environment variables to be set for use in action scripts:
-
+			   pump. Every other switch with a known average frequency is
+			   watched the same way; SASWITCH tells the script which one is late.
+
+   Each action line is compiled when the config is read, and at each event the
+   daemon fills in the variables itself and starts the program directly with
+   posix_spawn, found on the PATH, without a copy of the daemon or a shell in
+   between. The daemon understands 'single' and "double" quotes, $NAME, ${NAME}
+   and $(date) (inside double quotes or not; an unquoted value is split into
+   words as the shell would), and one > or >> file at the end of the line. An
+   echo into a file is written by the daemon itself without starting anything.
+   A line with any other shell syntax (pipes, ;, &, globs, backslashes, other
+   $(...) and the like) or that starts with a shell builtin such as cd or
+   export is run by /bin/sh -c as before. The log notes which lines need the
+   shell, and an action that can't be started is logged as an error.
+
+   An action line can also start with one of these, and the daemon writes the
+   rest of the line there itself without starting anything, keeping the file
+   or connection open for the next event:
+
+   file:/path  Appends the message and a newline to the file
+   syslog:[facility.]level
+			   Sends it to syslog through /dev/log, tagged sumpalarm, by default
+			   as daemon.notice
+   unix:/path  Sends it as one datagram to the UNIX socket
+   http://localhost[:port][/path]
+			   POSTs it to a webhook on this host (localhost, 127.x.x.x or
+			   [::1]) over a kept-alive connection, as application/json if it
+			   starts with { or [ and text/plain otherwise, with the action's
+			   name in an X-SumpAlarm-Action header
+
+   The message is taken as written, quotes included, apart from $NAME, ${NAME}
+   and $(date). A socket whose server has restarted is reconnected, and a
+   webhook's answer is checked when the next message goes out, so one it
+   didn't accept is logged then. Its answers need a Content-Length (or no
+   body); one that is chunked or runs to the close ends the connection, and
+   the next message opens a new one. A socket or webhook that isn't taking
+   messages loses the message, which is logged, rather than holding up the
+   daemon. echo ... >> file actions share the open files, and SIGHUP reopens
+   them all, so logrotate's postrotate can send it.
+
+   All switch timing (bounce delays, intervals between activations, Overdue
+   deadlines) is measured on the monotonic clock in milliseconds, so a wall
+   clock step from NTP cannot produce a bogus Overdue or skew the averages.
+   The wall clock is only used to stamp the log.
+
+   Environment variables to be set for use in action scripts. Each event builds
+   them afresh into an environment of its own that is handed to its actions
+   along with the daemon's environment (less any of the variables below it was
+   started with), so actions that run at the same time, or one that waited in the
+   queue, see the values of the event that triggered them:
+
+   SASWITCH    The number of the switch that triggered the action.
+   SALEVEL     The SwitchXLevel of that switch in mm
+   SATIME      The local time of the event, e.g. "2024-03-09 14:05:30"
    SAVOLUME    An integer representing the current estimated volume of water in
 			   the sump pit at a given time. Calculated using SwitchXLevel and
 			   SumpDiameter
@@ -63,18 +221,57 @@
 			   sump pit. It may also mean that the necessary parameters are not
 			   provided.
    SAFREQ      An integer representing the number of seconds between Switch0 ON
-			   events, on a running average of FREQ_HISTORY instances.
-   SAFREQM	   An integer representing the number of minutes between Switch0 ON
-			   events, on a running average of FREQ_HISTORY instances
-   SATIMELEFT  An integer representing the estimated number of minutes before the
+			   events, on a running average of FreqHistory instances.
+   SAFREQF	   The same interval formatted as minutes and seconds, e.g. "4m 30s"
+   SATIMELEFT  An integer representing the estimated number of seconds before the
 			   available capacity of the sump pit is filled. This is a VERY rough
 			   estimate as weeping tile will add additional capacity and
 			   groundwater in-flow will slow as it gets nearer to the groundwater
-			   level surrounding the building
+			   level surrounding the building. Once a few switch crossings have
+			   been seen it follows the inflow trend (see SAINFLOW), so a storm
+			   that is ramping up shortens it, and it counts from the highest
+			   switch that is on. 0 if unknown or the trend doesn't fill the pit
+			   within 30 days.
    SATIMELEFTM Same as above but in minutes
+   SATIMELEFTLO, SATIMELEFTHI
+			   Seconds to flood at the pessimistic and optimistic edges of a 90%
+			   band around the inflow trend
+   SAINFLOW    Estimated inflow in litres per hour right now, from a weighted
+			   least squares line through every switch crossing: Switch0 cycles,
+			   and a higher switch tripping while a lower one is on. Older
+			   crossings fade over a few hours
+   SAINFLOWACCEL
+			   How fast that inflow is changing, in litres per hour per hour
+   SACHANGE    For the RateChange script: INITIAL for the first rate, FASTER if
+			   the pump has started cycling more often, SLOWER if less often
+
+   Running statistics of Switch0, in seconds with one decimal, kept since the
+   daemon started:
+   SAFREQMEAN, SAFREQSD         Mean and standard deviation of the time between
+                                Switch0 ON events
+   SAFREQMIN, SAFREQMAX         Shortest and longest time between ON events
+   SAFREQEWMA10M, SAFREQEWMA1H, SAFREQEWMA24H
+                                Exponentially weighted moving averages of the
+                                time between ON events, with 10 minute, 1 hour
+                                and 24 hour time constants
+   SAFREQP50, SAFREQP90, SAFREQP99
+                                Median, 90th and 99th percentile of the time
+                                between ON events, to within 12.5%
+   SAONMEAN, SAONSD, SAONMIN, SAONMAX, SAONEWMA10M, SAONEWMA1H, SAONEWMA24H
+                                The same for the time Switch0 stays on
+   SAONTIME    Seconds the pump ran in the most recent Switch0 On period
+   SARUNTIME   Total seconds Switch0 has been on
+   SACYCLES    Number of completed Switch0 On/Off cycles
+   SADUTY1H, SADUTY24H, SADUTY7D
+               Percentage of the last hour, day and week that Switch0 was on.
+               A rising duty cycle at a steady inflow points to a wearing pump
+               or a partly blocked discharge line.
 
    Relies on a config file being present at /etc/sumpalarm.conf
 
+   Changes to the config file are picked up as soon as it is saved. Sending
+   SIGHUP also reloads it. SIGINT and SIGTERM stop the daemon.
+
    Configuration file example:
 
    # SumpAlarm Sample Config File. Parameters here are case sensitive and will
@@ -90,6 +287,44 @@
    LogFile=/var/log/sumpalarm.log
    LogLevel=3
 
+   # Input backend settings. GpioChip is the GPIO character device used by an
+   # INPUT_GPIOCHIP build (a gpio-sim chip works for testing without a Pi).
+   # SysfsBase is the /sys/class/gpio number of pin 0 for an INPUT_SYSFS build.
+   # SimGpio is a file holding the simulated register block of an INPUT_SIM
+   # build, so another process can flip the switches. Leave it out to keep the
+   # simulated pins in private memory.
+   GpioChip=/dev/gpiochip0
+   SysfsBase=0
+   SimGpio=/dev/shm/sumpalarm.gpio
+
+   # Frequency history, statistics and last activation times are kept in
+   # StateFile so a restart carries on where it left off. It is written every
+   # StateSync seconds and on exit; 0 only saves on exit. Only pages that changed
+   # are written, which spares the SD card. Leave StateFile empty to keep nothing.
+   StateFile=/var/lib/sumpalarm.state
+   StateSync=600
+
+   # Every switch edge is also recorded in a binary journal under JournalDir,
+   # 32 bytes per edge: switch, On/Off, wall and monotonic time in ms, the time
+   # since the last On or the time it was on, and the inflow rate. Records are
+   # batched for JournalFlush seconds and written as one CRC checked block, and
+   # the journal is fsynced every JournalSync seconds, so a crash loses at most
+   # that much. A new segment file is started every JournalSegment KB and only
+   # the newest JournalKeep segments are kept (0 keeps them all). A typical pit
+   # fills well under 10 MB a year. Leave JournalDir empty to turn it off.
+   JournalDir=/var/lib/sumpalarm
+   JournalFlush=10
+   JournalSync=300
+   JournalSegment=1024
+   JournalKeep=0
+
+   # With the bcm2835 or simulated backend, EdgeLatch=1 arms the SoC's rising and
+   # falling edge detect registers for every switch pin. A float that bounces on
+   # and off between two scans is then still seen as a full On/Off cycle. On
+   # Raspbian add dtoverlay=gpio-no-irq to config.txt first, or the kernel's own
+   # GPIO interrupt handler can lock up when the detect registers are armed.
+   EdgeLatch=0
+
    # This section is used when an alarm is produced, to estimate the volume
    # of water that the sump is taking on at the time and how much time is
    # available before water will breach the sump measurements in cm, volume in L
@@ -101,12 +336,12 @@
    # This section defines the activation depth of the float switches, in cm from
    # the bottom of the sump, the GPIO Pin that is used as input, and
    # followed by the action scripts. Up to Switch99 is permitted so long as GPIO
-   # supports it.
+   # supports it. Bounce is in seconds and may be fractional (0.5).
    Switch0Level=200
    Switch0Pin=14
    Switch0Bounce=5
    Switch0On=echo $(date) Switch0On Flow Rate $SARATE L/H Frequency $SAFREQ >> SumpAlarm.log
-   Switch0Off=echo $(date) Switch0Off Flow Rate $SARATE L/H Frequency $SAFREQ >> SumpAlarm.log
+   Switch0Off=syslog:info Switch0Off Flow Rate $SARATE L/H Frequency $SAFREQ
 
    Switch1Level=300
    Switch1Pin=15
@@ -114,18 +349,64 @@
    Switch1On=echo SUMP FAILURE! $SATIMELEFTM Minutes before flooding! | mail omgomgomg@sumpalarm.com -s "Sump Failure"
    Switch1Off=echo SUMP Restored. Water level receding | mail omgomgomg@sumpalarm.com -s "Sump Restored"
 
+   # Number of intervals between activations kept for each switch's running
+   # average (1 to 1024, default 4). SwitchXFreqHistory overrides it per switch.
+   # Longer windows give a steadier baseline at no extra cost per activation.
+   FreqHistory=4
+   Switch0FreqHistory=16
+
    # This action script executes when the frequency of pump activations changes
-   # by more than a configured percentage
+   # by more than RateChangeAmt percent (default 20). 0 or less is taken as the
+   # default, since with no allowance the normal interval jitter alone sets it
+   # off. RateChangeLimit is how much evidence is needed, in standard deviations
+   # of that jitter: lower reports sooner but raises more false alarms (default
+   # 5). The first 8 to 32 activations (FreqHistory of Switch0) after startup or
+   # a change set the baseline.
    RateChangeAmt=20
+   RateChangeLimit=5
    RateChange=echo The rate of flow has changed by 20 percent since last notice. New rate $SARATE Litres per hour | mail info@sumpalarm.com -s "Sump Rate Changed"
 
    # This script executes if Switch0On is overdue by the 'OverdueThreshold' number of seconds beyond the running average
    OverdueThreshold=120
+   # Pump cycles are rarely evenly spread, so the average can be a poor guide to
+   # how late is too late. With OverdueQuantile set, the expected interval is that
+   # percentile of all the intervals seen so far times OverdueFactor, e.g. the
+   # 99th percentile plus half again. OverdueThreshold is still added on top.
+   OverdueQuantile=99
+   OverdueFactor=1.5
    Overdue=echo Warning: Sump evacuation is overdue. Possible power or pump failure | mail info@sumpalarm.com -s "Pump activation overdue"
 
+   # Actions run in the background, at most ActionLimit at once (up to 32). The
+   # Switch0 scripts can't take the last ActionReserve of those slots, so an alarm
+   # never waits behind them. Actions without a free slot wait in a queue of up to
+   # ActionQueue (256 at most), the most important first: the Switch0 scripts,
+   # then RateChange, Overdue, Switch1 and each switch above that. When the queue
+   # is full the oldest of the least important is dropped. An action still running
+   # after ActionTimeout seconds (0 for no limit) is sent SIGTERM, along with
+   # anything it started, and SIGKILL 5 seconds later. Every action's exit status
+   # and run time is logged, a failure as an error.
+   ActionLimit=4
+   ActionReserve=1
+   ActionQueue=32
+   ActionTimeout=300
+
 *******************************************************************************
 
-Compile: gcc SumpAlarm.cpp bcm2835.c bcm2835.h -o sumpalarm
+Compile: gcc SumpAlarm.cpp bcm2835.c bcm2835.h -lm -pthread -o sumpalarm
+
+The input backend is chosen at build time:
+
+         (default)          bcm2835 library, direct register access
+         -DINPUT_GPIOCHIP   Linux GPIO character device, no bcm2835 library needed
+         -DINPUT_SYSFS      legacy /sys/class/gpio interface
+         -DINPUT_SIM        in-memory register block, runs on any Linux box
+
+         gcc -DINPUT_GPIOCHIP SumpAlarm.cpp -lm -pthread -o sumpalarm
+
+The bcm2835 and simulated backends read the GPLEV0/GPLEV1 level registers once
+per scan and only visit the switches whose pins differ from their last known
+state. The gpiochip and sysfs backends sleep until the kernel reports an edge
+rather than scanning the pins once a second.
 
 Revision History
 Date				Author			Notes
@@ -144,40 +425,513 @@ June 20, 2017		Cory Whitesell  Added Overdue action script and OverdueThreshold
 #include <time.h>
 #include <unistd.h>
 #include <signal.h>
-#include "bcm2835.h"
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <math.h>
+#include <errno.h>
+#include <poll.h>
+#include <spawn.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <syslog.h>
+
+// Input backend, selected at build time with -DINPUT_GPIOCHIP, -DINPUT_SYSFS or
+// -DINPUT_SIM. The bcm2835 library is used when none is given
+#if defined(INPUT_GPIOCHIP)
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#elif !defined(INPUT_SYSFS)&&!defined(INPUT_SIM)
+#define INPUT_BCM2835
+#include "bcm2835.h"
+#endif
+
+#ifndef HIGH
+#define HIGH					1
+#define LOW						0
+#endif
+#ifndef BCM2835_GPLEV0
+#define BCM2835_GPLEV0			0x0034	// GPIO pin level registers, byte offsets into the GPIO block
+#define BCM2835_GPLEV1			0x0038
+#define BCM2835_GPEDS0			0x0040	// event detect status, write 1 to clear
+#define BCM2835_GPEDS1			0x0044
+#define BCM2835_GPREN0			0x004c	// rising edge detect enable
+#define BCM2835_GPREN1			0x0050
+#define BCM2835_GPFEN0			0x0058	// falling edge detect enable
+#define BCM2835_GPFEN1			0x005c
+#endif
 
 // Defaults
 #define CONFIGFILE				"/etc/sumpalarm.conf"
 #define LOGFILE					"/var/log/sumpalarm.log"
-#define FREQ_HISTORY			4
-#define BOUNCEDELAY				5
+#define STATEFILE				"/var/lib/sumpalarm.state"
+#define STATESYNC				600		// seconds between state file syncs
+#define STATE_MAGIC				0x54534153	// "SAST"
+#define STATE_VERSION			1
+#define JOURNALDIR				"/var/lib/sumpalarm"
+#define JOURNALSEGMENT			1024	// KB per journal segment before a new one is started
+#define JOURNALFLUSH			10		// seconds records are batched before they are written
+#define JOURNALSYNC				300		// seconds between fsyncs of the journal
+#define JOURNAL_MAGIC			0x4a4a4153	// "SAJJ", start of a segment
+#define JOURNAL_BLOCK_MAGIC		0x424a4153	// "SAJB", start of a block
+#define JOURNAL_VERSION			1
+#define JOURNAL_BLOCK			127		// records per block at most
+#define JOURNAL_INDEX_MAGIC		0x494a4153	// "SAJI", start of a segment index
+#define JOURNAL_STRIDE			4096	// bytes of journal between index entries
+#define ANALYZE_INDEX_STEP		16		// index entries per analyze chunk of a journal segment, about 64 KB
+#define ANALYZE_LOG_CHUNK		(1<<20)	// bytes per analyze chunk of a log file
+#define FREQ_HISTORY			4		// default number of intervals in the running average
+#define FREQ_HISTORY_MAX		1024
+#define EWMA_COUNT				3		// exponentially weighted averages kept per statistic
+#define DUTY_WINDOWS			3		// rolling duty cycle windows kept per switch
+#define DUTY_BUCKETS			60		// buckets per duty cycle window
+#define BOUNCEDELAY				5000	// ms
+#define GPIOCHIPDEV				"/dev/gpiochip0"
+#define SYSFSGPIO				"/sys/class/gpio"
+#define SCANINTERVAL			1000	// ms between scans for backends that must be polled
+#define ACTIONLIMIT				4		// actions running at once
+#define ACTIONRESERVE			1		// of those, slots the Switch0 actions can't take
+#define ACTIONQUEUE				32		// actions waiting for a slot
+#define ACTIONTIMEOUT			300		// seconds an action may run before it is stopped
+#define ACTION_SLOTS			32		// limit on ActionLimit
+#define ACTION_QUEUE_MAX		256		// limit on ActionQueue
+#define ACTION_KILLDELAY		5000	// ms from SIGTERM to SIGKILL for an action that timed out
+#define ACTION_ARGS				64		// words in an action once its variables are filled in
+#define ACTION_ARGBYTES			4096
+#define ENV_ENTRIES				256		// environment of an action, inherited variables included
+#define ENV_BYTES				4096	// for the NAME=value strings of the SA variables
+#define SINK_FDS				16		// files and sockets kept open for the actions the daemon writes itself
+#define SINK_ANSWER				1024	// longest header of a webhook's answer that is followed
+#define SYSLOG_SOCKET			"/dev/log"
+#define SYSLOG_DEFAULT			(LOG_DAEMON|LOG_NOTICE)
+#define SHELL_CHARS			"|&;<>()$`\\\"'*?[]{}#~!\n"	// an action line with any of these is run by /bin/sh
+#define CHANGE_AMT				20		// default RateChangeAmt, percent
+#define CHANGE_LIMIT			5.0		// default CUSUM decision limit, in standard deviations
+#define CHANGE_MINSD			0.05	// floor on the reference spread of ln(interval)
+#define CHANGE_WARMUP_MIN		8		// intervals used to set the reference after a change
+#define CHANGE_WARMUP_MAX		32
+#define SKETCH_SUB_BITS			3		// quantile sketch: 8 buckets per power of two, within 12.5%
+#define SKETCH_BUCKETS			288		// covers intervals up to 2^38 ms
+#define SKETCH_LIMIT			4096	// counts are halved when this many intervals are held
+#define TREND_TAU				10800000	// ms, time constant over which old inflow observations fade
+#define TREND_Z					1.645	// normal quantile of the 90% band around the time to flood
+#define FLOOD_HORIZON			2592000	// s, 30 days. A later time to flood is reported as none
+
+// Timer wheel geometry: 4 levels of 64 slots with 100 ms ticks covers about 19 days
+// before a timer has to be re-filed on its way down
+#define WHEEL_TICK				100		// ms
+#define WHEEL_BITS				6
+#define WHEEL_SLOTS				(1<<WHEEL_BITS)
+#define WHEEL_LEVELS			4
 
 #define BCM2708_PERI_BASE       0x20000000
 #define GPIO_BASE               BCM2708_PERI_BASE + 0x200000) /* GPIO controller */
+#define GPIO_PINS				54		// pins covered by the GPLEV0/GPLEV1 level registers
+
+typedef int64_t msec_t;	// milliseconds on the CLOCK_MONOTONIC timebase used by the switch state machine
 
 void trim(char *s);
 int sa_strcmp(char *s1, const char *s2);	// compare two strings. If the first non-matching character is a null terminator, strings are considered equal (return 0)
-void SetEnvironment(struct FloatSwitch s,struct ConfigData cd);
-int GetFrequency(struct FloatSwitch s); // get an average frequency at which the sump is running, in seconds
-void Action(char *action);
+void SetEnvironment(int ID,struct FloatSwitch &s,struct ConfigData &cd);
+msec_t GetFrequency(struct FloatSwitch &s); // get an average frequency at which the sump is running, in ms
+void HistoryAdd(struct FreqHistory &h, msec_t interval);
+void HistoryResize(struct FreqHistory &h, int depth);
+void StatsAdd(struct RunningStats &st, msec_t x, msec_t t);
+double StatsStdDev(struct RunningStats &st);
+void SetStatsEnvironment(struct ActionEnv &e, const char *prefix, struct RunningStats &st);
+void EnvBegin(struct ActionEnv &e);
+void EnvSet(struct ActionEnv &e, const char *name, const char *fmt, ...) __attribute__((format(printf,3,4)));
+void DutyAdd(struct DutyWindow &dw, msec_t length, msec_t from, msec_t to);
+double DutyCycle(struct FloatSwitch &s, int w, msec_t now);
+int ChangeAdd(struct ChangeDetector &cp, msec_t interval, int warmup, double shift, double limit);
+void SketchAdd(struct QuantileSketch &qs, msec_t x);
+msec_t SketchQuantile(struct QuantileSketch &qs, double q);
+void PitInit(struct ConfigData &cd);
+int64_t PitRate(struct PitGeometry &pit, msec_t interval);
+void TrendAdd(struct InflowTrend &tr, msec_t t, double q);
+bool TrendFit(struct InflowTrend &tr, msec_t now, double &q, double &accel, double &qsd, double &accelsd);
+double FloodSeconds(double q, double accel, double litres);
+int FloodForecast(double secs);
+uint32_t Crc32(const void *data, size_t len);
+bool StateOpen(struct ConfigData &cd);
+void StateSave(struct ConfigData &cd);
+void StateExpired(struct ConfigData &cd, struct Timer *tm);
+void StateClose(struct ConfigData &cd);
+bool JournalOpen(struct ConfigData &cd);
+void JournalAdd(struct ConfigData &cd, int ID, int edge, msec_t t, msec_t duration);
+void JournalFlush(struct ConfigData &cd, bool sync);
+void JournalExpired(struct ConfigData &cd, struct Timer *tm);
+void JournalClose(struct ConfigData &cd);
+int RateBench(int argc, char **argv);
+int Query(int argc, char **argv);
+int Analyze(int argc, char **argv);
+int Replay(int argc, char **argv);
+int Simulate(int argc, char **argv);
+void Action(struct ConfigData &cd, struct ActionCmd &a);
+pid_t ActionSpawn(struct ActionJob &j);
+bool ActionExpand(struct ActionCmd &a, char **envp, struct ActionArgs &x, struct ActionJob &j);
+pid_t ActionLaunch(struct SinkCache &sc, struct ActionCmd &a, struct ActionJob &j);
+bool SinkWrite(struct SinkCache &sc, struct ActionCmd &a, struct ActionJob &j);
+void SinksClose(struct SinkCache &sc);
+const char *ActionHow(struct ActionCmd &a);
+void ActionInit(struct ActionCmd &a, const char *name, int priority);
+bool ActionSet(struct ActionCmd &a, const char *line);
+void ActionFree(struct ActionCmd &a);
+void ActionReaped(struct ConfigData &cd, pid_t pid, int status);
+void ActionDrain(struct ConfigData &cd);
+void ActionExpired(struct ConfigData &cd, struct Timer *tm);
+void ActionExecClose(struct ConfigData &cd);
+int SpawnBench(int argc, char **argv);
+int SelfTest(int argc, char **argv);
+void ConfigInit(struct ConfigData &cd);
 void RefreshConfig(struct ConfigData &cd, bool initial);
 void WriteLog(const char *entry,int level);
+bool LogWanted(int level);
+bool SwitchChanged(struct ConfigData &cd, int ID, int state, msec_t t);
+msec_t NextDeadline(struct ConfigData &cd, msec_t t, bool pending, bool polled);
+msec_t MonoMs();
+void WheelInit(struct TimerWheel &w, msec_t now);
+void TimerArm(struct TimerWheel &w, struct Timer *tm, msec_t expires);
+void TimerCancel(struct TimerWheel &w, struct Timer *tm);
+void WheelAdvance(struct TimerWheel &w, struct ConfigData &cd, msec_t now);
+msec_t WheelNext(struct TimerWheel &w);
+void OverdueExpired(struct ConfigData &cd, struct Timer *tm);
+bool LoopOpen(struct EventLoop &el, int inputfd);
+void LoopArm(struct EventLoop &el, msec_t due);
+void LoopSignals(struct EventLoop &el, struct ConfigData &cd);
+bool LoopConfigChanged(struct EventLoop &el);
+void LoopClose(struct EventLoop &el);
+
+// A deadline filed in the timer wheel. Arm and cancel are O(1); the timer only
+// needs to be linked into the slot that covers its expiry
+struct Timer
+{
+	struct Timer *next;
+	struct Timer **pprev;	// link that points at this timer, NULL when not armed
+	msec_t expires;			// monotonic ms
+	void (*fire)(struct ConfigData &cd, struct Timer *tm);
+	int id;					// switch ID the timer belongs to, -1 for none
+};
+
+// Hierarchical timer wheel. Level 0 slots are one tick wide, each level above is 64
+// times coarser, and a slot is cascaded down a level when the wheel reaches it
+struct TimerWheel
+{
+	struct Timer *slot[WHEEL_LEVELS][WHEEL_SLOTS];
+	uint64_t occupied[WHEEL_LEVELS];	// bit set for every slot holding at least one timer
+	uint64_t now;			// last tick processed
+	int count;				// armed timers
+};
+
+// Ring buffer of the intervals between activations. The running sum is maintained on
+// insert so both adding an interval and taking the average are O(1) at any depth
+struct FreqHistory
+{
+	msec_t *buf;
+	int depth;				// capacity, set by FreqHistory=
+	int head;				// slot the next interval is written to
+	int count;				// intervals recorded, up to depth
+	msec_t sum;				// total of the recorded intervals
+};
+
+// Streaming statistics of a series of durations, all updated in O(1) per sample.
+// Mean and variance use Welford's method. The EWMAs are weighted by elapsed time,
+// with the time constants in EwmaTau, so irregular sampling doesn't skew them
+struct RunningStats
+{
+	int64_t n;
+	double mean;			// ms
+	double m2;				// sum of squared differences from the mean
+	msec_t min;
+	msec_t max;
+	double ewma[EWMA_COUNT];	// ms
+	msec_t ewmat;			// time of the last sample folded into the EWMAs
+};
+
+const msec_t EwmaTau[EWMA_COUNT]={600000,3600000,86400000};	// 10 minutes, 1 hour, 24 hours
+const char *EwmaName[EWMA_COUNT]={"10M","1H","24H"};
+
+// On-time over a rolling window, kept in a fixed ring of buckets. Each bucket holds
+// the ms the switch was on during one slice of the window and is recycled once the
+// window has moved past it, so memory stays constant however long the daemon runs
+struct DutyWindow
+{
+	int32_t on[DUTY_BUCKETS];		// ms on within the bucket
+	int32_t stamp[DUTY_BUCKETS];	// absolute bucket number (time / width) the slot holds
+};
+
+// Two-sided CUSUM change-point detector on ln(interval between activations). The
+// first warmup intervals after startup or a detected change set the reference mean
+// and spread; after that each interval is standardized against the reference and
+// accumulated into hi (intervals lengthening) and lo (shortening), less an allowance
+// of half the smallest shift worth reporting. A sum past the limit is a change.
+// Working in logs makes a 20% speed up weigh the same at any pump frequency
+struct ChangeDetector
+{
+	int n;					// intervals in the reference so far
+	double mean;			// reference mean of ln(interval in ms)
+	double m2;				// sum of squared differences from the mean
+	double sd;				// reference standard deviation, fixed once warm-up ends
+	double hi;
+	double lo;
+};
+
+enum { CHANGE_NONE, CHANGE_READY, CHANGE_SLOWER, CHANGE_FASTER };
+
+// Log-bucketed histogram of intervals for percentile queries. Values below 8 ms get a
+// bucket each; above that every power of two is split into 8 equal buckets, so a
+// quantile is known to within 12.5% whatever the scale. Inserting is a shift and an
+// increment. Once SKETCH_LIMIT intervals are held all counts are halved, which keeps
+// the memory fixed and lets the distribution follow slow seasonal changes
+struct QuantileSketch
+{
+	uint32_t count[SKETCH_BUCKETS];
+	uint32_t total;
+};
+
+// Weighted least squares line through the inflow observations, q = a + b*x with x in
+// hours since the latest one. Each switch crossing adds an observation and older ones
+// fade with time constant TREND_TAU. The sums are re-centred on the newest observation
+// as it is added, so an update is O(1) and the fit is a handful of divisions
+struct InflowTrend
+{
+	msec_t at;				// time of the latest observation, 0 if there is none
+	double s0, s1, s2;		// sums of w, w*x, w*x*x
+	double sy, sxy, syy;	// sums of w*q, w*x*q, w*q*q, q in L/h
+	double sw2;				// sum of w*w, for the effective number of observations
+};
+
+const msec_t DutyLength[DUTY_WINDOWS]={3600000,86400000,604800000};	// 1 hour, 24 hours, 7 days
+const char *DutyName[DUTY_WINDOWS]={"1H","24H","7D"};
+
+// A piece of a compiled action line: literal text, a variable from the event's
+// environment or the time
+enum { CHUNK_TEXT, CHUNK_VAR, CHUNK_DATE };
+#define CHUNK_WORD				1		// starts a word
+#define CHUNK_QUOTED			2		// in quotes, so a value isn't split into words
+#define CHUNK_TARGET			4		// part of the file after > or >>
+
+struct ActionChunk
+{
+	const char *text;		// the literal text or the variable name
+	uint8_t kind;
+	uint8_t flags;
+};
+
+// Where an action the daemon writes itself goes, instead of starting a process
+enum { SINK_NONE, SINK_FILE, SINK_SYSLOG, SINK_UNIX, SINK_HTTP, SINK_BAD };
+
+// An action line from the config, compiled when the config is read into the chunks of
+// its words so that running it takes filling them in and a single posix_spawn, or for
+// echo into a file, just a write. A line that uses other shell syntax, or starts with
+// a shell builtin, is left to /bin/sh -c
+struct ActionCmd
+{
+	char *line;			// as written in the config, NULL if there is no action
+	char *words;		// the texts of the chunks, NUL terminated
+	struct ActionChunk *chunk;	// the line compiled, NULL if /bin/sh runs it
+	int chunks;
+	int redirect;		// O_TRUNC or O_APPEND for a > or >> file at the end, 0 for none
+	bool shell;			// run by /bin/sh -c line
+	bool append;		// echo ... > file, written by the daemon without a process
+	int sink;			// SINK_FILE... for file:, syslog:, unix: and http:// lines, whose message is one word
+	char *sinkpath;		// the file or socket, or host:port of the webhook
+	char *sinkhead;		// sent before each message: <priority> for syslog, the request line for a webhook
+	char name[16];		// Switch1On, RateChange... for the log
+	int priority;		// 0 for the informational Switch0 actions, higher runs first
+};
+
+// The environment of the actions for one event, built in place without touching the
+// daemon's own. envp holds the daemon's inherited variables (apart from any it sets),
+// followed by the SA variables whose strings are formatted into buf. posix_spawn copies
+// it into the child, so it can be rebuilt for the next event as soon as the action starts
+struct ActionEnv
+{
+	char *envp[ENV_ENTRIES];	// NULL terminated
+	int count;
+	char buf[ENV_BYTES];
+	int used;				// bytes of buf taken
+};
+
+// An action with its words filled in for an event, ready to run. A queued one has its
+// own copies of the words and environment, each in one allocation
+struct ActionJob
+{
+	char name[16];
+	int priority;
+	char **argv;
+	char **envp;
+	char *target;			// file for stdout, NULL for none
+	int redirect;
+};
+
+// Where an action's words are filled in, so an event allocates nothing
+struct ActionArgs
+{
+	char *argv[ACTION_ARGS];
+	char *target;
+	char buf[ACTION_ARGBYTES];
+};
+
+// A running action
+struct ActionChild
+{
+	pid_t pid;				// 0 if the slot is free
+	char name[16];
+	int priority;
+	msec_t started;
+	int stage;				// 0 running, 1 sent SIGTERM, 2 sent SIGKILL
+	struct Timer timer;		// the timeout, then the SIGKILL that follows SIGTERM
+};
+
+// Actions run in the background, at most ActionLimit at once, with the rest queued by
+// priority. Switch0 actions may only take ActionLimit-ActionReserve of the slots, so an
+// alarm never waits behind them
+struct ActionExec
+{
+	struct ActionChild child[ACTION_SLOTS];
+	int running;
+	int informational;		// running Switch0 actions
+	struct ActionJob queue[ACTION_QUEUE_MAX];	// in order of arrival
+	int queued;
+};
+
+// A file or socket kept open between events for the actions that write to it
+struct SinkFd
+{
+	int kind;				// SINK_FILE, SINK_SYSLOG, SINK_UNIX or SINK_HTTP
+	int fd;
+	char path[256];			// the file or socket, or host:port
+	char answer[SINK_ANSWER];	// header of the webhook's answer read so far
+	int answerlen;
+	int64_t body;			// bytes of the answer's body still to be skipped, -1 once they can't be followed
+	int status;				// of the webhook's last answer, 0 before the first
+};
+
+// The files and sockets of the sink actions and of echo >> file, opened the first time
+// they are written. SIGHUP closes them so a rotated log is reopened
+struct SinkCache
+{
+	struct SinkFd fd[SINK_FDS];
+	int count;
+};
 
 struct FloatSwitch
 {
 	int initialized;		// 1=true
 	int level;
 	int pin;                // GPIO PIN associated with this switch
-	char *OnAction;		    // Action string to execute when turned on
-	char *OffAction;		// Action string to execute when turned off
-	int freq[FREQ_HISTORY];	// history of seconds between activations
-	int lastfreq;           // the last frequency that was reported
+	struct ActionCmd OnAction;	// Action to execute when turned on
+	struct ActionCmd OffAction;	// Action to execute when turned off
+	struct FreqHistory freq;	// history of ms between activations
+	int freqhistory;		// configured depth of freq, 0 to use the FreqHistory default
+	struct RunningStats interval;	// time between activations
+	struct RunningStats onduration;	// time from On to Off
+	struct QuantileSketch sketch;	// distribution of the time between activations
+	struct DutyWindow duty[DUTY_WINDOWS];	// on-time over the windows in DutyLength
+	msec_t runtime;			// total time on since the daemon started
+	int64_t cycles;			// completed On/Off cycles
+	msec_t lastduration;	// length of the most recent On period
+	struct ChangeDetector change;	// watches the intervals for a shift in the inflow rate
+	msec_t lastfreq;        // the last frequency that was reported
 	int state; 				// 1 on, 0 off
-	time_t LastOn;          // the last time the pump switch activated
-	time_t LastOff;
-	int bouncedelay;		//  time to wait before recognizing a switch toggle
+	msec_t LastOn;          // the last time the pump switch activated (monotonic)
+	msec_t LastOff;
+	msec_t bouncedelay;		// time to wait before recognizing a switch toggle, in ms
+	struct Timer overduetimer;	// armed while the switch is on and an average frequency is known
+	bool overduenotice;		// the Overdue script has run for this switch and it hasn't turned off since
+};
+
+// The journal is a series of segment files, journal.00000001 and up, each a
+// JournalSegment header followed by blocks. A block is a JournalBlock header and count
+// fixed-size records, and its CRC lets a reader skip a block torn by a crash
+struct JournalSegment
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t recsize;		// sizeof(struct JournalRecord)
+	uint32_t seq;			// segment number
+	uint32_t reserved;
+	int64_t created;		// wall clock ms
+};
+
+struct JournalRecord
+{
+	int64_t wall;			// wall clock ms since the epoch
+	msec_t mono;			// daemon monotonic ms, for exact intervals
+	int32_t duration;		// ms since the last On (On edge) or how long it was on (Off edge), 0 if unknown
+	int32_t rate;			// inflow in mL/h from the Switch0 average at the time
+	uint16_t id;			// switch
+	uint8_t edge;			// 1 On, 0 Off
+	uint8_t reserved[5];
+};
+
+struct JournalBlock
+{
+	uint32_t magic;
+	uint16_t count;			// records in the block
+	uint16_t reserved;
+	uint32_t crc;			// CRC-32 of the records
+	uint32_t reserved2;
+	struct JournalRecord rec[JOURNAL_BLOCK];
+};
+
+// Sparse time index of a segment, kept beside it as journal.NNNNNNNN.idx: a header then
+// an entry for the first block after every JOURNAL_STRIDE bytes of the segment. The
+// entries are in time order, so a reader can binary search to the block a time range
+// starts in. A missing index only means the segment is scanned from the start
+struct JournalIndexHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint32_t seq;			// segment the index belongs to
+	uint32_t stride;
+};
+
+struct JournalIndexEntry
+{
+	int64_t wall;			// wall clock ms of the block's first record
+	int64_t offset;			// of the block in the segment
+};
+
+// Open journal segment and the records waiting to be written to it
+struct Journal
+{
+	int fd;					// -1 if the journal is off
+	int idxfd;				// index of the open segment, -1 if it couldn't be written
+	off_t indexed;			// offset of the last block entered in the index, -1 for none
+	uint32_t seq;			// current segment
+	off_t size;				// bytes in the current segment
+	int64_t walloffset;		// wall clock minus monotonic ms, sampled when the segment was opened
+	struct JournalBlock blk;	// records batched for the next write
+	bool unsynced;			// written since the last fsync
+	msec_t lastsync;
+	struct Timer timer;		// armed while records are waiting or a sync is due
+};
+
+// Pit geometry, worked out once when the config is loaded so that the event path only
+// needs integer multiplies and divides. The cross-section in mm^2 is also the number of
+// microlitres in each mm of depth, so volumes come out exactly in mL
+struct PitGeometry
+{
+	int64_t area;			// mm^2
+	int64_t capacity;		// mL up to SumpDepth
+	int64_t pumpout;		// mL the pump takes out between HighWater and LowWater
+	int64_t switchvol[100];	// mL below each switch's level
 };
 
 struct ConfigData {
@@ -185,56 +939,608 @@ struct ConfigData {
 	int sumpdiameter;
 	int lowwater;
 	int highwater;
-	int capacity;
-	int vol;
-	int rate;
-	int freq;
+	struct PitGeometry pit;
+	int vol;				// L, at Switch0
+	int rate;				// L/h
+	msec_t freq;
 	int ratechangeamt;
-	char *ratechange;
+	double ratechangelimit;	// CUSUM decision limit for RateChange, in standard deviations
+	struct ActionCmd ratechange;
 	struct FloatSwitch switchlist[100];
 	int overduethreshold;
-	char *overdue;
+	double overduequantile;	// percentile of the interval Overdue is measured from, 0 to use the average
+	double overduefactor;	// multiplier applied to that percentile
+	struct ActionCmd overdue;
+	int actionlimit;		// actions running at once
+	int actionreserve;		// slots kept free of Switch0 actions
+	int actionqueue;		// actions waiting for a slot at most
+	int actiontimeout;		// seconds before a running action is stopped, 0 for never
+	struct ActionExec exec;
+	struct ActionEnv env;	// for the actions of the current event
+	struct ActionArgs args;	// the words of the action being started
+	struct SinkCache sinks;	// open files and sockets of the actions the daemon writes itself
+	struct TimerWheel wheel;	// deadlines for every switch
+	int freqhistory;		// default depth of the frequency history
+	char gpiochip[256];		// GPIO character device the switch pins are requested from
+	int sysfsbase;			// number of GPIO pin 0 under /sys/class/gpio
+	char simgpio[256];		// file backing the simulated GPIO register block, empty for private memory
+	int edgelatch;			// 1=arm the SoC edge detect registers so toggles between scans are latched
+	uint64_t pinmask;		// bit set for every pin with an initialized switch
+	uint64_t statebits;		// bit set for every pin whose switch is currently On
+	int pinswitch[64];		// switch ID attached to each pin
+	struct InflowTrend inflow;	// inflow rate and its trend from the switch crossings
+	char statefile[256];	// file the runtime state is kept in across restarts, empty for none
+	int statesync;			// seconds between syncs of the state file, 0 to only save on exit
+	struct Timer statetimer;
+	struct StateFile *state;	// mapping of statefile, NULL if it couldn't be opened
+	char journaldir[256];	// directory for the event journal, empty for none
+	int journalsegment;		// KB per segment
+	int journalkeep;		// segments to keep, 0 to keep them all
+	int journalflush;		// seconds records are batched
+	int journalsync;		// seconds between fsyncs
+	struct Journal journal;
+};
+
+// Runtime state of one switch as kept in the state file. Timestamps are on the daemon's
+// monotonic timebase, which carries on from the saved one after a restart (see MonoOffset),
+// apart from laston/lastoff which are wall clock for anything reading the file
+struct StateSwitch
+{
+	int32_t initialized;
+	int32_t depth, head, count;	// the frequency history ring, as in FreqHistory
+	msec_t freqsum;
+	msec_t freqbuf[FREQ_HISTORY_MAX];
+	struct RunningStats interval;
+	struct RunningStats onduration;
+	struct QuantileSketch sketch;
+	struct ChangeDetector change;
+	struct DutyWindow duty[DUTY_WINDOWS];
+	msec_t runtime;
+	int64_t cycles;
+	msec_t lastduration;
+	msec_t lastfreq;
+	msec_t LastOn, LastOff;
+	int64_t laston, lastoff;	// wall clock ms since the epoch, 0 if never
+};
+
+// One complete copy of the state. The file holds two and each sync overwrites the older
+// one, so a crash or power cut part way through a sync leaves the other intact
+struct StateSlot
+{
+	uint32_t crc;			// of everything in the slot after this field
+	uint32_t size;
+	uint64_t generation;	// the valid slot with the higher generation is current
+	int64_t savedwall;		// wall clock ms when the slot was written
+	msec_t savedmono;		// monotonic ms when the slot was written
+	struct InflowTrend inflow;
+	struct StateSwitch sw[100];
+};
+
+struct StateFile
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;			// of the whole file, so a change of layout is noticed
+	uint32_t reserved;
+	struct StateSlot slot[2];
+};
+
+// Descriptors multiplexed by the main loop. The epoll set holds the input backend's
+// fd (if it has one), a timerfd armed for the next deadline, a signalfd for the
+// signals the daemon reacts to, and an inotify watch on the config file's directory
+enum { EV_INPUT, EV_TIMER, EV_SIGNAL, EV_CONFIG };
+
+struct EventLoop
+{
+	int epfd;
+	int timerfd;
+	int sigfd;
+	int inotifyfd;			// -1 if inotify isn't available, in which case the config is polled
+	msec_t armed;			// deadline the timerfd is set for, -1 if disarmed
+};
+
+// Actions a replay would have run. While a thread's Replaying points at one, its actions
+// are counted here instead of run, and nothing is logged or put in their environment
+struct ReplayTally
+{
+	const char *ratechange;	// the actions the replay tells apart
+	const char *overdue;
+	int64_t ratechanges;
+	int64_t overdues;
+	int64_t actions;		// every action, the switch ones included
+	bool environment;		// SetEnvironment still runs, for runs that measure it
 };
 
 bool Terminated=false;
+sigset_t OrigSigMask;		// signal mask to restore in action scripts
+msec_t MonoOffset=0;		// added to CLOCK_MONOTONIC so time carries on from the state file
 bool verbose=false;
 int LogLevel=3;		// default to log everything
 char LogFileName[1000]=LOGFILE;
 
-char logme[960];
+thread_local char logme[960];
+thread_local struct ReplayTally *Replaying=NULL;
+thread_local const msec_t *VirtualClock=NULL;	// when set, MonoMs() reads the simulated time from here
+
+#ifdef COUNT_ALLOCS
+// Build with -DCOUNT_ALLOCS for simulate to report heap allocations per simulated day.
+// Every allocation in the process goes through these, libc's own included
+int64_t AllocCount=0;
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+extern "C" void *malloc(size_t size) noexcept
+{
+	__sync_fetch_and_add(&AllocCount,1);
+	return __libc_malloc(size);
+}
+extern "C" void *calloc(size_t n, size_t size) noexcept
+{
+	__sync_fetch_and_add(&AllocCount,1);
+	return __libc_calloc(n,size);
+}
+extern "C" void *realloc(void *p, size_t size) noexcept
+{
+	__sync_fetch_and_add(&AllocCount,1);
+	return __libc_realloc(p,size);
+}
+#endif
+
+// Input backends. Each one provides the same members and is picked by the
+// InputSource typedef at build time, so the scan path is resolved statically:
+//   Open(cd)     prepare every initialized switch pin as an input
+//   Levels(l)    current level of every pin into l as a bitmap indexed by pin number;
+//                false if the pins couldn't be read
+//   Latched()    pins that saw an edge since the last call, as latched by the hardware (0 if not supported)
+//   Fd()         descriptor that becomes readable when a switch toggles, -1 if the pins must be polled
+//   Events(cd)   drain the pending toggles into the switch state machine
+//   Close()      release the hardware
+
+// Level of every pin from a BCM2835 style GPIO register block
+static inline uint64_t RegisterLevels(volatile uint32_t *regs)
+{
+	uint32_t lev0, lev1;
+
+	__sync_synchronize();
+	lev0=regs[BCM2835_GPLEV0/4];
+	lev1=regs[BCM2835_GPLEV1/4];
+	__sync_synchronize();
+	return (uint64_t)lev0|((uint64_t)lev1<<32);
+}
 
-// Handler for signals from OS so that the application can exit gracefully if terminated
-void INTHandler(int sig)
+// Arm (or disarm) rising and falling edge detection for the pins in mask and clear
+// anything already latched for them
+static inline void RegisterArm(volatile uint32_t *regs, uint64_t mask, bool arm)
 {
-	char  c;
+	int bank, ren, fen;
 
-	signal(sig, SIG_IGN);
+	for (bank=0;bank<2;bank++)
+	{
+		uint32_t m=(uint32_t)(mask>>(bank*32));
+		ren=BCM2835_GPREN0/4+bank;
+		fen=BCM2835_GPFEN0/4+bank;
+		__sync_synchronize();
+		regs[ren]=arm?(regs[ren]|m):(regs[ren]&~m);
+		regs[fen]=arm?(regs[fen]|m):(regs[fen]&~m);
+		regs[BCM2835_GPEDS0/4+bank]=m;
+		__sync_synchronize();
+	}
+}
 
-	// ctrl-c
-	if (sig==SIGINT)
+// Read and clear the event detect status of the pins in mask
+static inline uint64_t RegisterLatched(volatile uint32_t *regs, uint64_t mask)
+{
+	uint32_t eds0, eds1;
+
+	__sync_synchronize();
+	eds0=regs[BCM2835_GPEDS0/4]&(uint32_t)mask;
+	eds1=regs[BCM2835_GPEDS1/4]&(uint32_t)(mask>>32);
+	if (eds0) regs[BCM2835_GPEDS0/4]=eds0;
+	if (eds1) regs[BCM2835_GPEDS1/4]=eds1;
+	__sync_synchronize();
+	return (uint64_t)eds0|((uint64_t)eds1<<32);
+}
+
+#ifdef INPUT_BCM2835
+// Direct register access through the bcm2835 library. One read of GPLEV0/GPLEV1 covers every pin
+struct Bcm2835Input
+{
+	volatile uint32_t *regs;
+	uint64_t latchmask;		// pins armed for edge detection
+
+	bool Open(struct ConfigData &cd)
 	{
-		WriteLog("Process terminated by user.",1);
-		Terminated=true;
-		return;
+		if (!bcm2835_init())
+		{
+			WriteLog("Unable to initialize GPIO. Use sudo.",1);
+			return false;
+		}
+		regs=bcm2835_gpio;
+		for (int ID=0;ID<100;ID++)
+			if (cd.switchlist[ID].initialized)
+				bcm2835_gpio_fsel(cd.switchlist[ID].pin, BCM2835_GPIO_FSEL_INPT);
+
+		latchmask=cd.edgelatch?cd.pinmask:0;
+		if (latchmask) RegisterArm(regs,latchmask,true);
+		return true;
+	}
+	bool Levels(uint64_t &l) { l=RegisterLevels(regs); return true; }
+	uint64_t Latched() { return latchmask?RegisterLatched(regs,latchmask):0; }
+	int Fd() { return -1; }
+	void Events(struct ConfigData &) {}
+	void Close()
+	{
+		if (latchmask) RegisterArm(regs,latchmask,false);
+		bcm2835_close();
 	}
+};
+#endif
+
+#ifdef INPUT_GPIOCHIP
+// Linux GPIO character device (v2 uAPI). All switch pins share one line request
+// with both edges enabled, and the kernel queues timestamped edge events on its fd
+struct GpioChipInput
+{
+	int fd;
+	int numlines;
+	int linepin[64];		// pin (line offset) of each line in the request
 
-	// system shutdown or session terminated
-	if (sig==SIGTERM)
+	bool Open(struct ConfigData &cd)
 	{
-		WriteLog("Process terminated by system.",1);
-		Terminated=true;
-		return;
+		struct gpio_v2_line_request req;
+		int ID, chipfd;
+
+		memset(&req,0,sizeof(req));
+		for (ID=0;ID<100;ID++)
+		{
+			if (!cd.switchlist[ID].initialized) continue;
+			if (req.num_lines>=GPIO_V2_LINES_MAX)
+			{
+				WriteLog("Too many switches for one GPIO line request",1);
+				return false;
+			}
+			linepin[req.num_lines]=cd.switchlist[ID].pin;
+			req.offsets[req.num_lines++]=cd.switchlist[ID].pin;
+		}
+		numlines=req.num_lines;
+
+		// kernel timestamps default to CLOCK_MONOTONIC
+		req.config.flags=GPIO_V2_LINE_FLAG_INPUT|GPIO_V2_LINE_FLAG_EDGE_RISING|GPIO_V2_LINE_FLAG_EDGE_FALLING;
+		strncpy(req.consumer,"sumpalarm",GPIO_MAX_NAME_SIZE-1);
+		req.event_buffer_size=GPIO_V2_LINES_MAX*16;
+
+		chipfd=open(cd.gpiochip,O_RDONLY|O_CLOEXEC);
+		if (chipfd<0)
+		{
+			snprintf(logme,939,"Unable to open %s",cd.gpiochip);
+			WriteLog(logme,1);
+			return false;
+		}
+
+		if (ioctl(chipfd,GPIO_V2_GET_LINE_IOCTL,&req)<0)
+		{
+			snprintf(logme,939,"Unable to request GPIO lines from %s: %s",cd.gpiochip,strerror(errno));
+			WriteLog(logme,1);
+			close(chipfd);
+			return false;
+		}
+
+		// the line request holds its own reference to the chip
+		close(chipfd);
+		fd=req.fd;
+		fcntl(fd,F_SETFD,FD_CLOEXEC);
+		fcntl(fd,F_SETFL,O_NONBLOCK);
+		return true;
 	}
 
-	// process killed with pskill
-	if (sig==SIGKILL||sig==SIGHUP)
+	bool Levels(uint64_t &levels)
 	{
-		WriteLog("Process killed by system.",1);
-		Terminated=true;
-		return;
+		struct gpio_v2_line_values vals;
+
+		vals.bits=0;
+		vals.mask=(numlines>=64)?~(uint64_t)0:(((uint64_t)1<<numlines)-1);
+		if (ioctl(fd,GPIO_V2_LINE_GET_VALUES_IOCTL,&vals)<0) return false;
+		levels=0;
+		for (int line=0;line<numlines;line++)
+			if ((vals.bits>>line)&1) levels|=(uint64_t)1<<linepin[line];
+		return true;
+	}
+
+	// every edge is already queued as an event
+	uint64_t Latched() { return 0; }
+
+	int Fd() { return fd; }
+
+	// feed queued edges through the switch state machine, stamped with the time the kernel saw them
+	void Events(struct ConfigData &cd)
+	{
+		struct gpio_v2_line_event ev[16];
+		ssize_t n;
+		int i, ID, state;
+
+		for (;;)
+		{
+			n=read(fd,ev,sizeof(ev));
+			if (n<(ssize_t)sizeof(ev[0])) return;
+
+			for (i=0;i<n/(ssize_t)sizeof(ev[0]);i++)
+			{
+				if (ev[i].offset>=64||(cd.pinmask&((uint64_t)1<<ev[i].offset))==0) continue;
+				ID=cd.pinswitch[ev[i].offset];
+
+				state=(ev[i].id==GPIO_V2_LINE_EVENT_RISING_EDGE)?HIGH:LOW;
+				if (state==cd.switchlist[ID].state) continue;
+
+				// the kernel stamps edges on CLOCK_MONOTONIC, the same timebase as the state machine
+				SwitchChanged(cd,ID,state,(msec_t)(ev[i].timestamp_ns/1000000ULL)+MonoOffset);
+			}
+
+			if (n<(ssize_t)sizeof(ev)) return;
+		}
+	}
+
+	void Close() { close(fd); }
+};
+#endif
+
+#ifdef INPUT_SYSFS
+// Legacy /sys/class/gpio interface for kernels without the character device. Each pin is
+// exported with edge reporting on, and its value file is watched through an epoll set
+struct SysfsInput
+{
+	int epfd;
+	int valuefd[64];
+	int base;
+
+	// write a string to a file under /sys/class/gpio
+	static bool SysfsWrite(const char *path, const char *value)
+	{
+		int f=open(path,O_WRONLY);
+		if (f<0) return false;
+		bool ok=write(f,value,strlen(value))==(ssize_t)strlen(value);
+		close(f);
+		return ok;
+	}
+
+	bool Open(struct ConfigData &cd)
+	{
+		char path[300], num[16];
+		struct epoll_event ev;
+		int ID, pin;
+
+		base=cd.sysfsbase;
+		epfd=epoll_create1(EPOLL_CLOEXEC);
+		if (epfd<0) return false;
+
+		for (ID=0;ID<100;ID++)
+		{
+			if (!cd.switchlist[ID].initialized) continue;
+			pin=cd.switchlist[ID].pin;
+
+			snprintf(num,15,"%d",base+pin);
+			snprintf(path,299,SYSFSGPIO "/gpio%d",base+pin);
+			if (access(path,F_OK)!=0) SysfsWrite(SYSFSGPIO "/export",num);
+
+			snprintf(path,299,SYSFSGPIO "/gpio%d/direction",base+pin);
+			SysfsWrite(path,"in");
+			snprintf(path,299,SYSFSGPIO "/gpio%d/edge",base+pin);
+			SysfsWrite(path,"both");
+
+			snprintf(path,299,SYSFSGPIO "/gpio%d/value",base+pin);
+			valuefd[pin]=open(path,O_RDONLY|O_CLOEXEC);
+			if (valuefd[pin]<0)
+			{
+				snprintf(logme,939,"Unable to open %s",path);
+				WriteLog(logme,1);
+				return false;
+			}
+
+			// sysfs reports an edge as an exceptional condition on the value file
+			ev.events=EPOLLPRI|EPOLLERR;
+			ev.data.u32=pin;
+			epoll_ctl(epfd,EPOLL_CTL_ADD,valuefd[pin],&ev);
+		}
+		return true;
+	}
+
+	// HIGH, LOW or -1 if the value file can't be read
+	int Level(int pin)
+	{
+		char c='0';
+		if (pread(valuefd[pin],&c,1,0)!=1) return -1;
+		return c=='1'?HIGH:LOW;
 	}
 
-	// Program caused a segmentation fault. Best to catch it than to inexplicably terminate
+	bool Levels(uint64_t &levels)
+	{
+		levels=0;
+		for (int pin=0;pin<64;pin++)
+		{
+			if (valuefd[pin]<0) continue;
+			int level=Level(pin);
+			if (level<0) return false;
+			if (level==HIGH) levels|=(uint64_t)1<<pin;
+		}
+		return true;
+	}
+
+	uint64_t Latched() { return 0; }
+
+	int Fd() { return epfd; }
+
+	void Events(struct ConfigData &cd)
+	{
+		struct epoll_event ev[16];
+		int n, i, pin, state;
+
+		n=epoll_wait(epfd,ev,16,0);
+		msec_t t=MonoMs();
+		for (i=0;i<n;i++)
+		{
+			pin=ev[i].data.u32;
+			state=Level(pin);
+			if (state>=0&&state!=cd.switchlist[cd.pinswitch[pin]].state)
+				SwitchChanged(cd,cd.pinswitch[pin],state,t);
+		}
+	}
+
+	void Close()
+	{
+		for (int pin=0;pin<64;pin++)
+			if (valuefd[pin]>=0) close(valuefd[pin]);
+		close(epfd);
+	}
+
+	SysfsInput() { for (int pin=0;pin<64;pin++) valuefd[pin]=-1; }
+};
+#endif
+
+// Simulated input. The pins live in an in-memory copy of the BCM2835 GPIO register
+// block, optionally backed by a shared file (SimGpio=) so another process can flip
+// the switches. Always built, so the monitor can be tested and benchmarked on any Linux box
+struct SimInput
+{
+	uint32_t block[64];
+	volatile uint32_t *regs;
+	uint64_t latchmask;
+
+	bool Open(struct ConfigData &cd)
+	{
+		memset(block,0,sizeof(block));
+		regs=block;
+		latchmask=cd.edgelatch?cd.pinmask:0;
+		if (cd.simgpio[0]==0)
+		{
+			if (latchmask) Arm();
+			return true;
+		}
+
+		int f=open(cd.simgpio,O_RDWR|O_CREAT|O_CLOEXEC,0644);
+		if (f<0||ftruncate(f,sizeof(block))<0)
+		{
+			snprintf(logme,939,"Unable to open %s",cd.simgpio);
+			WriteLog(logme,1);
+			if (f>=0) close(f);
+			return false;
+		}
+		void *m=mmap(NULL,sizeof(block),PROT_READ|PROT_WRITE,MAP_SHARED,f,0);
+		close(f);
+		if (m==MAP_FAILED) return false;
+		regs=(volatile uint32_t *)m;
+		if (latchmask) Arm();
+		return true;
+	}
+	bool Levels(uint64_t &l) { l=RegisterLevels(regs); return true; }
+	int Fd() { return -1; }
+	void Events(struct ConfigData &) {}
+	void Close() { if (regs!=block) munmap((void *)regs,sizeof(block)); }
+
+	// The SoC clears a GPEDS bit when 1 is written to it, but memory keeps the 1 that
+	// RegisterArm and RegisterLatched write, so the simulated block clears them itself
+	void ClearEvents(uint64_t mask)
+	{
+		regs[BCM2835_GPEDS0/4]&=~(uint32_t)mask;
+		regs[BCM2835_GPEDS1/4]&=~(uint32_t)(mask>>32);
+	}
+	void Arm()
+	{
+		RegisterArm(regs,latchmask,true);
+		ClearEvents(latchmask);
+	}
+	uint64_t Latched()
+	{
+		if (!latchmask) return 0;
+		uint64_t l=RegisterLatched(regs,latchmask);
+		ClearEvents(l);
+		return l;
+	}
+
+	// drive a pin as the float switch would, latching the edge the way the SoC does
+	void SetPin(int pin, int level)
+	{
+		uint32_t bit=1u<<(pin%32);
+		int bank=pin/32;
+		uint32_t was=regs[BCM2835_GPLEV0/4+bank]&bit;
+
+		if (level==HIGH) regs[BCM2835_GPLEV0/4+bank]|=bit;
+		else regs[BCM2835_GPLEV0/4+bank]&=~bit;
+
+		if (level==HIGH&&!was&&(regs[BCM2835_GPREN0/4+bank]&bit)) regs[BCM2835_GPEDS0/4+bank]|=bit;
+		if (level!=HIGH&&was&&(regs[BCM2835_GPFEN0/4+bank]&bit)) regs[BCM2835_GPEDS0/4+bank]|=bit;
+	}
+};
+
+#if defined(INPUT_GPIOCHIP)
+typedef GpioChipInput InputSource;
+#elif defined(INPUT_SYSFS)
+typedef SysfsInput InputSource;
+#elif defined(INPUT_SIM)
+typedef SimInput InputSource;
+#else
+typedef Bcm2835Input InputSource;
+#endif
+
+// Compare a snapshot of the pin levels with the last accepted switch states and visit
+// only the switches whose pins differ. Returns true if a toggle is being held back by
+// the bounce delay; its bit stays set so it is retried on the next scan. The same goes
+// for a scan whose levels couldn't be read
+template <class Input> bool ScanSwitches(Input &in, struct ConfigData &cd, msec_t t)
+{
+	static bool unreadable=false;
+	uint64_t levels;
+	bool pending=false;
+	int pin, ID;
+
+	// a failed read says nothing about the switches, so rather than take every pin for
+	// Off and run the Off actions, skip this pass and try again
+	if (!in.Levels(levels))
+	{
+		if (!unreadable)
+		{
+			snprintf(logme,939,"Error: unable to read the switch pins: %s",strerror(errno));
+			WriteLog(logme,1);
+		}
+		unreadable=true;
+		return true;
+	}
+	if (unreadable) WriteLog("Switch pins readable again",1);
+	unreadable=false;
+
+	uint64_t changed=(levels^cd.statebits)&cd.pinmask;
+
+	// A pin that latched an edge but reads back in its accepted state toggled and
+	// returned between scans. Replay both halves so the pump cycle is still counted.
+	// The level is read first so an edge landing between the two reads is at worst
+	// reported as a short pulse and picked up again on the next scan
+	uint64_t pulses=in.Latched()&cd.pinmask&~changed;
+	while (pulses)
+	{
+		pin=__builtin_ctzll(pulses);
+		pulses&=pulses-1;
+		ID=cd.pinswitch[pin];
+
+		int state=cd.switchlist[ID].state;
+		if (SwitchChanged(cd,ID,state==HIGH?LOW:HIGH,t))
+			SwitchChanged(cd,ID,state,t);
+	}
+
+	while (changed)
+	{
+		pin=__builtin_ctzll(changed);
+		changed&=changed-1;
+
+		if (!SwitchChanged(cd,cd.pinswitch[pin],(levels>>pin)&1?HIGH:LOW,t))
+			pending=true;
+	}
+	return pending;
+}
+
+// Handler for a segmentation fault. Best to catch it than to inexplicably terminate.
+// Every other signal the daemon cares about arrives synchronously through the signalfd
+void INTHandler(int sig)
+{
+	signal(sig, SIG_IGN);
+
 	if (sig==SIGSEGV)
 	{
 		WriteLog("Segmentation fault.",1);
@@ -248,6 +1554,13 @@ int main(int argc, char **argv)
 	// check for a -v switch. By default this will run as a daemon and does not
 	// produce output to stdout or stderr. But if -v is specified it will run
 	// in the terminal
+	if (argc>=2&&strcmp(argv[1],"ratebench")==0) return RateBench(argc-2,argv+2);
+	if (argc>=2&&strcmp(argv[1],"query")==0) return Query(argc-2,argv+2);
+	if (argc>=2&&strcmp(argv[1],"analyze")==0) return Analyze(argc-2,argv+2);
+	if (argc>=2&&strcmp(argv[1],"replay")==0) return Replay(argc-2,argv+2);
+	if (argc>=2&&strcmp(argv[1],"simulate")==0) return Simulate(argc-2,argv+2);
+	if (argc>=2&&strcmp(argv[1],"spawnbench")==0) return SpawnBench(argc-2,argv+2);
+	if (argc>=2&&strcmp(argv[1],"selftest")==0) return SelfTest(argc-2,argv+2);
 	if (argc>=2)
 	{
 		if (strcmp(argv[1],"-v")==0)
@@ -280,66 +1593,28 @@ int main(int argc, char **argv)
 		close(STDERR_FILENO);
 	}
 
-	// since we will be in an infinite loop, monitor signals to detect interruptions such as ctrl-c
-	signal(SIGINT,INTHandler);
-	signal(SIGTERM,INTHandler);
-	signal(SIGKILL,INTHandler);
 	signal(SIGSEGV,INTHandler);
 
-	// Since we will be forking system calls, we will tell the OS that we're a terrible parent
-	// and don't care about the welfare of our children. This prevents <defunct>
-	// processes resulting from forks
-	signal(SIGCHLD, SIG_IGN);
-
-	// initialize the GPIO
-	if (!bcm2835_init())
-	{
-		WriteLog("Unable to initialize GPIO. Use sudo.",1);
-		return 2;
-	}
+	// ctrl-c, termination, reload requests and finished action scripts are all read from a
+	// signalfd by the main loop, so block their asynchronous delivery here. Forked action
+	// scripts get the original mask back
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask,SIGINT);
+	sigaddset(&sigmask,SIGTERM);
+	sigaddset(&sigmask,SIGHUP);
+	sigaddset(&sigmask,SIGCHLD);
+	sigprocmask(SIG_BLOCK,&sigmask,&OrigSigMask);
 
 	// Declare and initialize non-switch related variables
 	int ID, i;
-	char cline[65536];
-
-	// temp variables
-	int state=0;
-	int freqtemp=0;
-	bool overduenotice=false;
 
 	struct ConfigData cd;
-	// sump dimensions
-	cd.sumpdepth=0;
-	cd.sumpdiameter=0;
-	cd.lowwater=0;
-	cd.highwater=0;
-
-	cd.ratechange=NULL;
-	cd.ratechangeamt=0;
-	cd.overduethreshold=0;
-	cd.overdue=NULL;
-
-	time_t t;
-	time_t LastConfigCheck;
-	time(&LastConfigCheck);
-
-	// set all switches to uninitialized and initialize other variables to zero/NULL
-	for (ID=0;ID<100;ID++)
-	{
-		cd.switchlist[ID].initialized=0;
-		cd.switchlist[ID].OnAction=NULL;
-		cd.switchlist[ID].OffAction=NULL;
-		cd.switchlist[ID].level=0;
-		cd.switchlist[ID].pin=0;
-		for (i=0;i<FREQ_HISTORY;i++)
-			cd.switchlist[ID].freq[i]=0;
-		cd.switchlist[ID].lastfreq=0;
-		cd.switchlist[ID].state=0;
-		cd.switchlist[ID].LastOn=(time_t)0;
-		cd.switchlist[ID].LastOff=(time_t)0;
-		cd.switchlist[ID].bouncedelay=BOUNCEDELAY;
-	}
+	msec_t t;
+	msec_t LastConfigCheck=MonoMs();
+	struct EventLoop el;
 
+	ConfigInit(cd);
 	RefreshConfig(cd,true);
 
 	if (cd.switchlist[0].initialized==0)
@@ -348,13 +1623,38 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	// pick up the history saved by the last run. This moves the monotonic timebase on
+	// from the saved one, so it has to happen before anything is timed
+	StateOpen(cd);
+	LastConfigCheck=MonoMs();
+	WheelInit(cd.wheel,LastConfigCheck);
+	if (cd.state!=NULL&&cd.statesync>0) TimerArm(cd.wheel,&cd.statetimer,LastConfigCheck+(msec_t)cd.statesync*1000);
+	JournalOpen(cd);
+
 	// configure input pins and read initial state
+	InputSource in;
+	uint64_t levels;
+	bool pending=false;
+	if (!in.Open(cd)) return 2;
+	if (!in.Levels(levels))
+	{
+		snprintf(logme,939,"Unable to read the switch pins: %s",strerror(errno));
+		WriteLog(logme,1);
+		return 2;
+	}
+
+	if (!LoopOpen(el,in.Fd()))
+	{
+		WriteLog("Unable to set up the event loop",1);
+		return 2;
+	}
+
 	for (ID=0;ID<100;ID++)
 	{
 		if (cd.switchlist[ID].initialized)
 		{
-			bcm2835_gpio_fsel(cd.switchlist[ID].pin, BCM2835_GPIO_FSEL_INPT);
-			cd.switchlist[ID].state=bcm2835_gpio_lev(cd.switchlist[ID].pin);
+			cd.switchlist[ID].state=(levels>>cd.switchlist[ID].pin)&1?HIGH:LOW;
+			if (cd.switchlist[ID].state==HIGH) cd.statebits|=(uint64_t)1<<cd.switchlist[ID].pin;
 			snprintf(logme,939,"Switch%d Initial state: ",ID);
 			if (cd.switchlist[ID].state==HIGH) strcat(logme,"On");
 			else strcat(logme,"Off");
@@ -362,129 +1662,534 @@ int main(int argc, char **argv)
 		}
 	}
 
-	char envstr[1000];
-
 	if (verbose) WriteLog("Application started",3);
 	else WriteLog("Daemon started",3);
 
 	while (!Terminated)
 	{
-		time(&t);
+		t=MonoMs();
 
-		// Run the "Overdue" script is the conditions are met. Should Only run once until the situation is resolved rather than every few seconds
-		if (cd.switchlist[0].state==HIGH&&overduenotice==false) // improve the performance by splitting conditionals so that the difficult ones aren't evaluated unless necessary
-		{
-			freqtemp=GetFrequency(cd.switchlist[0]);
-			if (t-cd.switchlist[0].LastOff>=freqtemp+cd.overduethreshold&&freqtemp!=0)
-			{
-				overduenotice=true;
-				Action(cd.overdue);
-			}
-		}
+		// fire any Overdue deadline that has passed
+		WheelAdvance(cd.wheel,cd,t);
 
-		// check to see if the configuration file has been changed and needs to be reloaded
-		if (t-LastConfigCheck>180) // 3 minutes
+		// without inotify, fall back to checking the configuration file every 3 minutes
+		if (el.inotifyfd<0&&t-LastConfigCheck>180000)
 		{
 			LastConfigCheck=t;
 			RefreshConfig(cd,false);
 		}
 
-		// loop through the initialized switches to see if the state has changed on any of them
-		for (ID=0;ID<100;ID++)
+		// check all switches against a single snapshot of the pin levels. This also picks up
+		// any toggle that was held back by the bounce delay
+		pending=ScanSwitches(in,cd,t);
+
+		// sleep until a switch toggles, a signal arrives, the config changes or the next deadline is due
+		msec_t due=NextDeadline(cd,t,pending,in.Fd()<0);
+		if (el.inotifyfd<0&&(due<0||due>LastConfigCheck+180001)) due=LastConfigCheck+180001;
+		LoopArm(el,due);
+
+		struct epoll_event ev[4];
+		int n=epoll_wait(el.epfd,ev,4,-1);
+		for (i=0;i<n;i++)
 		{
-			if (cd.switchlist[ID].initialized)
+			switch (ev[i].data.u32)
 			{
-				state=bcm2835_gpio_lev(cd.switchlist[ID].pin);
+				case EV_INPUT:
+					in.Events(cd);
+					break;
+				case EV_TIMER:
+					uint64_t expirations;
+					if (read(el.timerfd,&expirations,sizeof(expirations))<0) {}
+					el.armed=-1;
+					break;
+				case EV_SIGNAL:
+					LoopSignals(el,cd);
+					break;
+				case EV_CONFIG:
+					if (LoopConfigChanged(el)) RefreshConfig(cd,false);
+					break;
+			}
+		}
+	}
 
-				if (state!=cd.switchlist[ID].state)
-				{
+	LoopClose(el);
+	in.Close();
+	StateClose(cd);
+	JournalClose(cd);
 
-					// switch has changed to 'On'
-					if (state==HIGH)
-					{
-						// don't react if the bounce delay hasn't expired
-						if (t-cd.switchlist[ID].LastOff<cd.switchlist[ID].bouncedelay) continue;
+	// free allocated space
+	for (ID=0;ID<100;ID++)
+	{
+		if (cd.switchlist[ID].freq.buf!=NULL) free(cd.switchlist[ID].freq.buf);
+		ActionFree(cd.switchlist[ID].OnAction);
+		ActionFree(cd.switchlist[ID].OffAction);
+	}
+
+	ActionFree(cd.ratechange);
+	ActionFree(cd.overdue);
+	ActionExecClose(cd);
+	SinksClose(cd.sinks);
 
-						cd.switchlist[ID].state=HIGH;
+	return 0;
+}
 
-						snprintf(logme,939,"Switch%d On",ID);
-						WriteLog(logme,2);
 
-						for (i=0;i<FREQ_HISTORY-1;i++)
-							cd.switchlist[ID].freq[i]=cd.switchlist[ID].freq[i+1];
-						if (cd.switchlist[ID].LastOn!=0) // prevent logging if this is the first entry since startup
-							cd.switchlist[ID].freq[FREQ_HISTORY-1]=t-cd.switchlist[ID].LastOn;
-						cd.switchlist[ID].LastOn=t;
+// React to a switch that has been seen in a new state at time t. Returns false if the
+// toggle was ignored because the bounce delay hasn't expired
+bool SwitchChanged(struct ConfigData &cd, int ID, int state, msec_t t)
+{
+	int i, change=CHANGE_NONE;
+	msec_t interval=0;
 
-						cd.freq=GetFrequency(cd.switchlist[0]);
+	// switch has changed to 'On'
+	if (state==HIGH)
+	{
+		// don't react if the bounce delay hasn't expired
+		if (t-cd.switchlist[ID].LastOff<cd.switchlist[ID].bouncedelay) return false;
 
-						SetEnvironment(cd.switchlist[0],cd);
+		cd.switchlist[ID].state=HIGH;
+		cd.statebits|=(uint64_t)1<<cd.switchlist[ID].pin;
 
-						Action(cd.switchlist[ID].OnAction);
+		snprintf(logme,939,"Switch%d On",ID);
+		WriteLog(logme,2);
 
-						if (ID==0&&cd.freq!=0&&cd.ratechange!=NULL)
-						{
-							if (cd.switchlist[0].lastfreq==0)
-							{
-								int z=0;
-								// only send rate if we've seen FREQ_HISTORY cycles so far
-								for (i=0;i<FREQ_HISTORY;i++)
-									if (cd.switchlist[0].freq[i]==0) z++;
-								if (z==0)
-								{
-									Action(cd.ratechange);
-									cd.switchlist[0].lastfreq=cd.freq;
-								}
-							}
-							else
-							{
-								double rat=(double)cd.switchlist[0].lastfreq/(double)cd.freq;
-								if (rat>(1.0+(double)cd.ratechangeamt/100)||rat<(1.0-(double)cd.ratechangeamt/100))
-								{
-									Action(cd.ratechange);
-									cd.switchlist[ID].lastfreq=cd.freq;
-								}
-							}
-						}
-					}
-					else // switch has changed to 'Off'
-					{
-						// don't react if the bounce delay hasn't expired
-						if (t-cd.switchlist[ID].LastOff<cd.switchlist[ID].bouncedelay) continue;
+		if (cd.switchlist[ID].LastOn!=0) // prevent logging if this is the first entry since startup
+		{
+			interval=t-cd.switchlist[ID].LastOn;
+			HistoryAdd(cd.switchlist[ID].freq,interval);
+			StatsAdd(cd.switchlist[ID].interval,interval,t);
+			SketchAdd(cd.switchlist[ID].sketch,interval);
+			if (ID==0)
+			{
+				int warmup=cd.switchlist[0].freq.depth;
+				if (warmup<CHANGE_WARMUP_MIN) warmup=CHANGE_WARMUP_MIN;
+				if (warmup>CHANGE_WARMUP_MAX) warmup=CHANGE_WARMUP_MAX;
+				change=ChangeAdd(cd.switchlist[0].change,interval,warmup,
+					log(1.0+cd.ratechangeamt/100.0),cd.ratechangelimit);
+			}
+		}
 
-						if (ID==0) overduenotice=false;
+		// Inflow observations. A Switch0 cycle lets in what the pump takes out between
+		// HighWater and LowWater; a higher switch turning on while a lower one is still on
+		// measures the rise between the two directly
+		if (ID==0&&interval>0)
+			TrendAdd(cd.inflow,t,cd.pit.pumpout*3600.0/interval);
+		else if (ID>0)
+		{
+			int below=-1;
+			for (i=0;i<100;i++)
+				if (cd.switchlist[i].initialized&&cd.switchlist[i].state==HIGH&&cd.switchlist[i].level<cd.switchlist[ID].level&&
+					(below<0||cd.switchlist[i].level>cd.switchlist[below].level)) below=i;
+			if (below>=0&&t>cd.switchlist[below].LastOn)
+				TrendAdd(cd.inflow,t,(cd.pit.switchvol[ID]-cd.pit.switchvol[below])*3600.0/(t-cd.switchlist[below].LastOn));
+		}
+		cd.switchlist[ID].LastOn=t;
 
-						snprintf(logme,939,"Switch%d Off",ID);
-						WriteLog(logme,2);
-						cd.switchlist[ID].state=state;
-						cd.switchlist[ID].LastOff=t;
+		cd.freq=GetFrequency(cd.switchlist[0]);
+		JournalAdd(cd,ID,1,t,interval);
 
-						SetEnvironment(cd.switchlist[0],cd);
+		// Overdue if the switch is still on once its average interval (or the configured
+		// percentile of its intervals times OverdueFactor) plus the threshold has passed
+		// since it last turned off
+		msec_t f=GetFrequency(cd.switchlist[ID]);
+		if (f!=0&&cd.overduequantile>0)
+			f=(msec_t)(SketchQuantile(cd.switchlist[ID].sketch,cd.overduequantile/100.0)*cd.overduefactor);
+		if (f!=0&&cd.overdue.line!=NULL&&!cd.switchlist[ID].overduenotice)
+			TimerArm(cd.wheel,&cd.switchlist[ID].overduetimer,cd.switchlist[ID].LastOff+f+(msec_t)cd.overduethreshold*1000);
 
-						Action(cd.switchlist[ID].OffAction);
+		SetEnvironment(ID,cd.switchlist[0],cd);
 
-					}
+		Action(cd,cd.switchlist[ID].OnAction);
+
+		if (ID==0&&cd.freq!=0&&cd.ratechange.line!=NULL)
+		{
+			// the first rate is sent once the reference is established, after that only
+			// when the change detector sees the inflow shift
+			if ((change==CHANGE_READY&&cd.switchlist[0].lastfreq==0)||change==CHANGE_SLOWER||change==CHANGE_FASTER)
+			{
+				if (change!=CHANGE_READY)
+				{
+					snprintf(logme,939,"Rate change: Switch0 activations %s, last interval %llds, average was %llds",
+						change==CHANGE_FASTER?"more frequent":"less frequent",(long long)(interval/1000),(long long)(cd.switchlist[0].lastfreq/1000));
+					WriteLog(logme,2);
 				}
+				if (Replaying==NULL||Replaying->environment) EnvSet(cd.env,"SACHANGE","%s",change==CHANGE_FASTER?"FASTER":change==CHANGE_SLOWER?"SLOWER":"INITIAL");
+				Action(cd,cd.ratechange);
+				cd.switchlist[0].lastfreq=cd.freq;
 			}
 		}
+	}
+	else // switch has changed to 'Off'
+	{
+		// don't react if the bounce delay hasn't expired
+		if (t-cd.switchlist[ID].LastOff<cd.switchlist[ID].bouncedelay) return false;
+
+		TimerCancel(cd.wheel,&cd.switchlist[ID].overduetimer);
+		cd.switchlist[ID].overduenotice=false;
+
+		cd.switchlist[ID].state=state;
+		cd.statebits&=~((uint64_t)1<<cd.switchlist[ID].pin);
+		cd.switchlist[ID].LastOff=t;
+		if (cd.switchlist[ID].LastOn!=0)
+		{
+			msec_t on=t-cd.switchlist[ID].LastOn;
+
+			StatsAdd(cd.switchlist[ID].onduration,on,t);
+			for (i=0;i<DUTY_WINDOWS;i++)
+				DutyAdd(cd.switchlist[ID].duty[i],DutyLength[i],cd.switchlist[ID].LastOn,t);
+			cd.switchlist[ID].runtime+=on;
+			cd.switchlist[ID].cycles++;
+			cd.switchlist[ID].lastduration=on;
+
+			// the duty cycles cost more than the rest of the edge, so only when they'll be seen
+			if (LogWanted(2))
+				snprintf(logme,939,"Switch%d Off after %.1fs, duty 1h %.1f%% 24h %.1f%% 7d %.1f%%",ID,on/1000.0,
+					DutyCycle(cd.switchlist[ID],0,t),DutyCycle(cd.switchlist[ID],1,t),DutyCycle(cd.switchlist[ID],2,t));
+		}
+		else snprintf(logme,939,"Switch%d Off",ID);
+		if (LogWanted(2)) WriteLog(logme,2);
+		JournalAdd(cd,ID,0,t,cd.switchlist[ID].LastOn?t-cd.switchlist[ID].LastOn:0);
 
-		// release the processor for a second before scanning again
-		sleep(1);
+		SetEnvironment(ID,cd.switchlist[0],cd);
+
+		Action(cd,cd.switchlist[ID].OffAction);
 	}
 
-	// free allocated space
-	for (ID=0;ID<100;ID++)
+	return true;
+}
+
+// The next time the main loop must wake up when no switch toggles, or -1 if there is nothing to wait for
+msec_t NextDeadline(struct ConfigData &cd, msec_t t, bool pending, bool polled)
+{
+	// the earliest timer in the wheel
+	msec_t due=WheelNext(cd.wheel);
+
+	// backends without an event fd are scanned once a second, and a toggle held back by the
+	// bounce delay is retried on the same schedule
+	if ((polled||pending)&&(due<0||due>t+SCANINTERVAL)) due=t+SCANINTERVAL;
+
+	return due;
+}
+
+// Build the epoll set for the main loop
+bool LoopOpen(struct EventLoop &el, int inputfd)
+{
+	struct epoll_event ev;
+	sigset_t sigmask;
+	char dir[1000];
+
+	el.armed=-1;
+	el.epfd=epoll_create1(EPOLL_CLOEXEC);
+	if (el.epfd<0) return false;
+
+	el.timerfd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+	if (el.timerfd<0) return false;
+	ev.events=EPOLLIN;
+	ev.data.u32=EV_TIMER;
+	epoll_ctl(el.epfd,EPOLL_CTL_ADD,el.timerfd,&ev);
+
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask,SIGINT);
+	sigaddset(&sigmask,SIGTERM);
+	sigaddset(&sigmask,SIGHUP);
+	sigaddset(&sigmask,SIGCHLD);
+	el.sigfd=signalfd(-1,&sigmask,SFD_NONBLOCK|SFD_CLOEXEC);
+	if (el.sigfd<0) return false;
+	ev.events=EPOLLIN;
+	ev.data.u32=EV_SIGNAL;
+	epoll_ctl(el.epfd,EPOLL_CTL_ADD,el.sigfd,&ev);
+
+	if (inputfd>=0)
+	{
+		ev.events=EPOLLIN|EPOLLPRI;
+		ev.data.u32=EV_INPUT;
+		if (epoll_ctl(el.epfd,EPOLL_CTL_ADD,inputfd,&ev)<0) return false;
+	}
+
+	// Watch the directory rather than the file itself, since editors usually save by
+	// writing a new file and renaming it over the old one
+	strncpy(dir,CONFIGFILE,999);
+	dir[999]=0;
+	*strrchr(dir,'/')=0;
+	el.inotifyfd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (el.inotifyfd>=0&&inotify_add_watch(el.inotifyfd,dir,IN_CLOSE_WRITE|IN_MOVED_TO)<0)
 	{
-		if (cd.switchlist[ID].OnAction!=NULL) free(cd.switchlist[ID].OnAction);
-		if (cd.switchlist[ID].OffAction!=NULL) free(cd.switchlist[ID].OffAction);
+		close(el.inotifyfd);
+		el.inotifyfd=-1;
 	}
+	if (el.inotifyfd>=0)
+	{
+		ev.events=EPOLLIN;
+		ev.data.u32=EV_CONFIG;
+		epoll_ctl(el.epfd,EPOLL_CTL_ADD,el.inotifyfd,&ev);
+	}
+	else WriteLog("inotify unavailable, checking the config file every 3 minutes",2);
 
-	if (cd.ratechange!=NULL) free(cd.ratechange);
-	if (cd.overdue!=NULL) free(cd.overdue);
+	return true;
+}
 
-	return 0;
+// Set the timerfd for an absolute deadline on the monotonic clock, or disarm it if due is -1
+void LoopArm(struct EventLoop &el, msec_t due)
+{
+	struct itimerspec its;
+
+	if (due==el.armed) return;
+	memset(&its,0,sizeof(its));
+	if (due>=0)
+	{
+		// the timerfd runs on the raw monotonic clock
+		msec_t raw=due-MonoOffset;
+		if (raw<0) raw=0;
+		its.it_value.tv_sec=raw/1000;
+		its.it_value.tv_nsec=(raw%1000)*1000000;
+		// an all-zero it_value would disarm the timer instead of firing it
+		if (raw==0) its.it_value.tv_nsec=1;
+	}
+	timerfd_settime(el.timerfd,TFD_TIMER_ABSTIME,&its,NULL);
+	el.armed=due;
+}
+
+// Act on the signals queued on the signalfd
+void LoopSignals(struct EventLoop &el, struct ConfigData &cd)
+{
+	struct signalfd_siginfo si;
+
+	while (read(el.sigfd,&si,sizeof(si))==sizeof(si))
+	{
+		switch (si.ssi_signo)
+		{
+			// ctrl-c
+			case SIGINT:
+				WriteLog("Process terminated by user.",1);
+				Terminated=true;
+				break;
+
+			// system shutdown or session terminated
+			case SIGTERM:
+				WriteLog("Process terminated by system.",1);
+				Terminated=true;
+				break;
+
+			// reload the configuration on request
+			case SIGHUP:
+				WriteLog("Reload requested.",2);
+				// and reopen the action files, after logrotate has moved them
+				SinksClose(cd.sinks);
+				RefreshConfig(cd,false);
+				break;
+
+			// an action script finished. Several exits can share one signal, so reap them all,
+			// then start whatever was waiting for their slots
+			case SIGCHLD:
+				pid_t pid;
+				int status;
+				while ((pid=waitpid(-1,&status,WNOHANG))>0) ActionReaped(cd,pid,status);
+				ActionDrain(cd);
+				break;
+		}
+	}
+}
+
+// Drain the inotify queue. Returns true if the config file was among the files written
+bool LoopConfigChanged(struct EventLoop &el)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char *name=strrchr(CONFIGFILE,'/')+1;
+	bool changed=false;
+	ssize_t n, off;
+
+	while ((n=read(el.inotifyfd,buf,sizeof(buf)))>0)
+	{
+		for (off=0;off<n;off+=sizeof(struct inotify_event)+((struct inotify_event *)(buf+off))->len)
+		{
+			struct inotify_event *ie=(struct inotify_event *)(buf+off);
+			if (ie->len>0&&strcmp(ie->name,name)==0) changed=true;
+		}
+	}
+	return changed;
+}
+
+void LoopClose(struct EventLoop &el)
+{
+	if (el.inotifyfd>=0) close(el.inotifyfd);
+	close(el.sigfd);
+	close(el.timerfd);
+	close(el.epfd);
+}
+
+// Switch ID's Overdue deadline has passed while it is still on. Runs once until the switch turns off
+void OverdueExpired(struct ConfigData &cd, struct Timer *tm)
+{
+	int ID=tm->id;
+
+	if (cd.switchlist[ID].state!=HIGH||cd.switchlist[ID].overduenotice) return;
+	cd.switchlist[ID].overduenotice=true;
+
+	snprintf(logme,939,"Switch%d Overdue",ID);
+	WriteLog(logme,2);
+	SetEnvironment(ID,cd.switchlist[0],cd);
+	Action(cd,cd.overdue);
+}
+
+void WheelInit(struct TimerWheel &w, msec_t now)
+{
+	memset(w.slot,0,sizeof(w.slot));
+	memset(w.occupied,0,sizeof(w.occupied));
+	w.now=(uint64_t)now/WHEEL_TICK;
+	w.count=0;
+}
+
+// Link a timer into the slot covering its expiry tick, relative to the wheel's current tick.
+// A timer cascading down on the tick it expires goes in the level 0 slot of that tick,
+// which is processed straight after the cascade
+static void WheelFile(struct TimerWheel &w, struct Timer *tm, bool cascade)
+{
+	// round up so a timer never fires early, and anything already due goes in the next tick
+	uint64_t tick=((uint64_t)tm->expires+WHEEL_TICK-1)/WHEEL_TICK;
+	if (tm->expires<0||tick<w.now||(tick==w.now&&!cascade)) tick=w.now+1;
+
+	uint64_t delta=tick-w.now;
+	int level=0;
+	while (level<WHEEL_LEVELS-1&&delta>=(uint64_t)1<<(WHEEL_BITS*(level+1))) level++;
+
+	// beyond the top level the timer is parked in the furthest slot and re-filed when it cascades
+	if (delta>=(uint64_t)1<<(WHEEL_BITS*WHEEL_LEVELS)) tick=w.now+((uint64_t)1<<(WHEEL_BITS*WHEEL_LEVELS))-1;
+
+	int idx=(tick>>(WHEEL_BITS*level))&(WHEEL_SLOTS-1);
+	struct Timer **head=&w.slot[level][idx];
+
+	tm->next=*head;
+	if (tm->next) tm->next->pprev=&tm->next;
+	tm->pprev=head;
+	*head=tm;
+	w.occupied[level]|=(uint64_t)1<<idx;
+}
+
+// Remove a timer from its slot, keeping the occupancy bitmap in step
+static void WheelUnlink(struct TimerWheel &w, struct Timer *tm)
+{
+	*tm->pprev=tm->next;
+	if (tm->next) tm->next->pprev=tm->pprev;
+
+	// a timer that was first in its slot points at the slot head, which tells us where it was
+	for (int level=0;level<WHEEL_LEVELS;level++)
+	{
+		if (tm->pprev>=&w.slot[level][0]&&tm->pprev<&w.slot[level][WHEEL_SLOTS])
+		{
+			int idx=tm->pprev-&w.slot[level][0];
+			if (w.slot[level][idx]==NULL) w.occupied[level]&=~((uint64_t)1<<idx);
+			break;
+		}
+	}
+	tm->pprev=NULL;
+	tm->next=NULL;
+}
+
+void TimerArm(struct TimerWheel &w, struct Timer *tm, msec_t expires)
+{
+	if (tm->pprev) WheelUnlink(w,tm);
+	else w.count++;
+	tm->expires=expires;
+	WheelFile(w,tm,false);
+}
+
+void TimerCancel(struct TimerWheel &w, struct Timer *tm)
+{
+	if (tm->pprev==NULL) return;
+	WheelUnlink(w,tm);
+	w.count--;
+}
+
+// Move every timer in a slot one level down (or into the level it now belongs in)
+static void WheelCascade(struct TimerWheel &w, int level, int idx)
+{
+	struct Timer *tm=w.slot[level][idx];
+
+	w.slot[level][idx]=NULL;
+	w.occupied[level]&=~((uint64_t)1<<idx);
+	while (tm)
+	{
+		struct Timer *next=tm->next;
+		WheelFile(w,tm,true);
+		tm=next;
+	}
+}
+
+// Process ticks up to the current time, firing every timer that has expired
+void WheelAdvance(struct TimerWheel &w, struct ConfigData &cd, msec_t now)
+{
+	uint64_t target=(uint64_t)now/WHEEL_TICK;
+
+	while (w.now<target)
+	{
+		if (w.count==0)
+		{
+			w.now=target;
+			break;
+		}
+
+		// nothing at level 0, so skip straight to the tick where the next slot cascades
+		if (w.occupied[0]==0&&(w.now|(WHEEL_SLOTS-1))<target)
+			w.now|=WHEEL_SLOTS-1;
+
+		w.now++;
+		int idx=w.now&(WHEEL_SLOTS-1);
+
+		// when a level wraps, pull the next slot of the level above down
+		for (int level=1;level<WHEEL_LEVELS&&(w.now&(((uint64_t)1<<(WHEEL_BITS*level))-1))==0;level++)
+			WheelCascade(w,level,(w.now>>(WHEEL_BITS*level))&(WHEEL_SLOTS-1));
+
+		while (w.slot[0][idx])
+		{
+			struct Timer *tm=w.slot[0][idx];
+			WheelUnlink(w,tm);
+			if ((uint64_t)tm->expires>w.now*WHEEL_TICK)
+			{
+				// parked beyond the top level; file it again now that it is closer
+				WheelFile(w,tm,false);
+				continue;
+			}
+			w.count--;
+			tm->fire(cd,tm);
+		}
+	}
+}
+
+// Time of the next tick that needs processing: the first occupied level 0 slot, or the
+// point where an occupied slot on a higher level cascades down. -1 if nothing is armed
+msec_t WheelNext(struct TimerWheel &w)
+{
+	uint64_t next=0;
+	int level;
+
+	if (w.count==0) return -1;
+
+	for (level=0;level<WHEEL_LEVELS;level++)
+	{
+		if (w.occupied[level]==0) continue;
+
+		int shift=WHEEL_BITS*level;
+		uint64_t base=(w.now>>shift)+1;		// first slot position that is still ahead
+		int start=base&(WHEEL_SLOTS-1);
+		uint64_t rot=(w.occupied[level]>>start)|(start?(w.occupied[level]<<(WHEEL_SLOTS-start)):0);
+		uint64_t tick=(base+__builtin_ctzll(rot))<<shift;
+
+		if (next==0||tick<next) next=tick;
+	}
+	return (msec_t)(next*WHEEL_TICK);
 }
 
+// Current time on the monotonic clock. Unlike the wall clock this never steps when NTP
+// corrects the time, so intervals measured with it are always real elapsed time.
+// MonoOffset continues the timeline of the run that wrote the state file. Under simulate
+// the clock is the simulated one
+msec_t MonoMs()
+{
+	struct timespec ts;
+	if (VirtualClock!=NULL) return *VirtualClock;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (msec_t)ts.tv_sec*1000+ts.tv_nsec/1000000+MonoOffset;
+}
 
 void trim(char *s)
 {
@@ -555,469 +2260,5707 @@ int sa_strcmp(char *s1, const char *s2)
 	}
 	return 0;
 }
-// write int to file
-int write_count_to_file(const char* filename, int Data){
-    FILE * file = fopen(filename, "w");
-    fprintf(file, "%d\n", Data);
-    fclose(file);
-    return 0;
-}
-
-// store an integer in a file
-int read_count_from_file(const char* filename){
-	if (access(filename, F_OK) == 0) {
-	    // file exists    
-		int Data[1];
-	    FILE * file = fopen(filename, "r"); // open file
-	    fscanf(file, "%d\n", &Data[0]); //store info in Data array
-	    fclose(file);
-	    int Nx; // store data in respective variables
-	    Nx = Data[0];
-	    // printf("Value of Nx is %d\n", Nx); // Print values to check
-	    return Nx;
-	}
-	return 0;
 
-}
-// Set environment variables in advance of running an action script
-void SetEnvironment(struct FloatSwitch s,struct ConfigData cd)
+// Build the environment for the action scripts of an event in cd.env
+void SetEnvironment(int ID,struct FloatSwitch &s,struct ConfigData &cd)
 {
-	char envstr[1000];
 	int timeleft;
-    // if switch hasn't been triggered before, read from file
-	if (cd.switchlist[0].LastOn!=0) {
-        snprintf(envstr,999, "%d", read_count_from_file("SAFREQ.txt"));
-    } else{
-	    snprintf(envstr,999,"%d",cd.freq);
-    }
-	setenv("SAFREQ",envstr,1);
-    write_count_to_file("SAFREQ.txt", atoi(envstr));
-
-    // if switch hasn't been triggered before, read from file
-	if (cd.switchlist[0].LastOn!=0) {
-        snprintf(envstr,999, "%d", read_count_from_file("SAFREQF.txt"));
-    } else{
-	    snprintf(envstr,999,"%dm %ds",cd.freq/60,cd.freq%60);
-    }
-	setenv("SAFREQF",envstr,1);
-    write_count_to_file("SAFREQF.txt", atoi(envstr));
-
-	cd.vol=((s.level/10.0)*(3.14159265*(cd.sumpdiameter/20.0)*(cd.sumpdiameter/20.0)))/1000.0;
-	snprintf(envstr,999,"%d",cd.vol);
-	setenv("SAVOLUME", envstr,1);
-	if (cd.freq!=0)
-		cd.rate=(((cd.highwater-cd.lowwater)/10.0*(3.14159265*(cd.sumpdiameter/20.0)*(cd.sumpdiameter/20.0)))/1000.0)*3600/cd.freq;
-	else cd.rate=0;
-	snprintf(envstr,999,"%d",cd.rate);
-	setenv("SARATE",envstr,1);
-	if (cd.rate==0) timeleft=0;
-	else timeleft=(cd.capacity-cd.vol)*3600/cd.rate;
-	snprintf(envstr,999,"%d",timeleft);
-	setenv("SATIMELEFT",envstr,1);
-	snprintf(envstr,999,"%d",timeleft/60);
-	setenv("SATIMELEFTM",envstr,1);
-}
-
-// determine the frequency of activations for the selected switch
-int GetFrequency(struct FloatSwitch s)
-{
-	int f=0;
-	int z=0;
 
-	for (int i=0;i<FREQ_HISTORY;i++)
+	if (Replaying!=NULL&&!Replaying->environment) return;	// nothing runs on the replay threads
+
+	EnvBegin(cd.env);
+
+	// the switch that triggered the action, its level and when
+	EnvSet(cd.env,"SASWITCH","%d",ID);
+	EnvSet(cd.env,"SALEVEL","%d",cd.switchlist[ID].level);
+	time_t wall=time(NULL);
+	struct tm tm;
+	char stamp[32];
+	strftime(stamp,sizeof(stamp),"%Y-%m-%d %T",localtime_r(&wall,&tm));
+	EnvSet(cd.env,"SATIME","%s",stamp);
+
+	// the average survives restarts through the state file
+	EnvSet(cd.env,"SAFREQ","%d",(int)(cd.freq/1000));
+	EnvSet(cd.env,"SAFREQF","%dm %ds",(int)(cd.freq/60000),(int)(cd.freq/1000%60));
+
+	// pumped volume per cycle over the cycle time; mL per ms is L per s
+	int64_t vol=cd.pit.area*s.level/1000, rate=PitRate(cd.pit,cd.freq);	// mL, mL/h
+	cd.vol=(int)(vol/1000);
+	EnvSet(cd.env,"SAVOLUME","%d",cd.vol);
+	cd.rate=(int)(rate/1000);
+	EnvSet(cd.env,"SARATE","%d",cd.rate);
+
+	// Time to flood from the inflow trend, counting from the highest switch that is on.
+	// The bounds take the inflow and its trend at either edge of their 90% band. Until
+	// the trend is known the current rate is assumed to hold
+	msec_t now=MonoMs();
+	double q, accel, qsd, accelsd, litres;
+	int timeleftlo, timelefthi;
+	int64_t below=vol;
+	for (int i=0;i<100;i++)
+		if (cd.switchlist[i].initialized&&cd.switchlist[i].state==HIGH&&cd.pit.switchvol[i]>below) below=cd.pit.switchvol[i];
+	litres=(cd.pit.capacity-below)/1000.0;
+	if (TrendFit(cd.inflow,now,q,accel,qsd,accelsd))
 	{
-		f+=s.freq[i];
-		if (s.freq[i]==0) z++;
+		timeleft=FloodForecast(FloodSeconds(q,accel,litres));
+		timeleftlo=FloodForecast(FloodSeconds(q+TREND_Z*qsd,accel+TREND_Z*accelsd,litres));
+		timelefthi=FloodForecast(FloodSeconds(q-TREND_Z*qsd,accel-TREND_Z*accelsd,litres));
+	}
+	else
+	{
+		q=cd.rate;
+		accel=0;
+		timeleft=rate>0?FloodForecast((cd.pit.capacity-below)*3600.0/rate):0;
+		timeleftlo=timeleft;
+		timelefthi=timeleft;
+	}
+	EnvSet(cd.env,"SATIMELEFT","%d",timeleft);
+	EnvSet(cd.env,"SATIMELEFTM","%d",timeleft/60);
+	EnvSet(cd.env,"SATIMELEFTLO","%d",timeleftlo);
+	EnvSet(cd.env,"SATIMELEFTHI","%d",timelefthi);
+	EnvSet(cd.env,"SAINFLOW","%.1f",q);
+	EnvSet(cd.env,"SAINFLOWACCEL","%.1f",accel);
+
+	// running statistics of the Switch0 cycle, in seconds
+	SetStatsEnvironment(cd.env,"SAFREQ",cd.switchlist[0].interval);
+	SetStatsEnvironment(cd.env,"SAON",cd.switchlist[0].onduration);
+	EnvSet(cd.env,"SAFREQP50","%.1f",SketchQuantile(cd.switchlist[0].sketch,0.5)/1000.0);
+	EnvSet(cd.env,"SAFREQP90","%.1f",SketchQuantile(cd.switchlist[0].sketch,0.9)/1000.0);
+	EnvSet(cd.env,"SAFREQP99","%.1f",SketchQuantile(cd.switchlist[0].sketch,0.99)/1000.0);
+
+	// pump run time of Switch0
+	EnvSet(cd.env,"SAONTIME","%.1f",cd.switchlist[0].lastduration/1000.0);
+	EnvSet(cd.env,"SARUNTIME","%lld",(long long)(cd.switchlist[0].runtime/1000));
+	EnvSet(cd.env,"SACYCLES","%lld",(long long)cd.switchlist[0].cycles);
+	for (int w=0;w<DUTY_WINDOWS;w++)
+	{
+		char name[20];
+		snprintf(name,19,"SADUTY%s",DutyName[w]);
+		EnvSet(cd.env,name,"%.1f",DutyCycle(cd.switchlist[0],w,now));
 	}
-
-	if (z!=FREQ_HISTORY) f=f/(FREQ_HISTORY-z);
-
-	return f;
 }
 
-// Execute an action script in a forked process to avoid slow scripts interfering with intended application behavior
-void Action(char *action)
+// Add the on period [from,to) to a duty cycle window of the given length, spreading it
+// over the buckets it covers. Anything older than the window is dropped
+void DutyAdd(struct DutyWindow &dw, msec_t length, msec_t from, msec_t to)
 {
-	if (action==NULL) return;
-	#ifdef DEBUG
-	snprintf(logme,939,"Executing Action \"%s\"",action);
-	WriteLog(logme,3);
-	#endif
+	msec_t width=length/DUTY_BUCKETS;
 
-	// fork and forget
-	pid_t pid=fork();
-
-	if (pid==0)
+	if (from<to-length) from=to-length;
+	while (from<to)
 	{
-		system(action);
-		exit(0);
+		int32_t b=(int32_t)(from/width);
+		int slot=b%DUTY_BUCKETS;
+		msec_t end=((msec_t)b+1)*width;
+		if (end>to) end=to;
+
+		// recycle a slot still holding a bucket from an earlier pass of the window
+		if (dw.stamp[slot]!=b)
+		{
+			dw.stamp[slot]=b;
+			dw.on[slot]=0;
+		}
+		dw.on[slot]+=(int32_t)(end-from);
+		from=end;
 	}
 }
 
-void RefreshConfig(struct ConfigData &cd, bool initial)
+// Percentage of window w that switch s has spent on, up to now, including an On period still in progress
+double DutyCycle(struct FloatSwitch &s, int w, msec_t now)
 {
-	static char hash[65]="";
+	msec_t length=DutyLength[w];
+	msec_t width=length/DUTY_BUCKETS;
+	int32_t oldest=(int32_t)(now/width)-DUTY_BUCKETS+1;	// first bucket still inside the window
+	msec_t on=0;
 
-	int ID;
-	char cline[65535];
+	for (int slot=0;slot<DUTY_BUCKETS;slot++)
+		if (s.duty[w].stamp[slot]>=oldest&&s.duty[w].on[slot]>0) on+=s.duty[w].on[slot];
 
-	if (!initial)
-	{
-		// decide whether the config has changed
-		system("sha256sum /etc/sumpalarm.conf > ./configsum");
-		FILE *check=fopen("./configsum","r");
-		if (check==NULL) return;
-		fgets(cline,64,check);
-		cline[64]=0;
-		fclose(check);
+	if (s.state==HIGH&&s.LastOn!=0)
+		on+=now-(s.LastOn>now-length?s.LastOn:now-length);
 
-		if (strcmp(hash,cline)==0) return; // no change to config
+	if (on>length) on=length;
+	return on*100.0/length;
+}
 
-		WriteLog("Config changed",2);
-		snprintf(logme,939,"Old: %s",hash);
-		WriteLog(logme,2);
-		snprintf(logme,939,"New: %s",hash,cline);
-		WriteLog(logme,2);
-		memcpy((void *)hash,(void *)cline,64);
-		hash[64]=0;
-	}
-	else
+// Export one set of running statistics as <prefix>MEAN, <prefix>SD, <prefix>MIN,
+// <prefix>MAX and <prefix>EWMA<tau>, in seconds. All are 0 until a sample is seen
+void SetStatsEnvironment(struct ActionEnv &e, const char *prefix, struct RunningStats &st)
+{
+	char name[40];
+
+	snprintf(name,39,"%sMEAN",prefix);
+	EnvSet(e,name,"%.1f",st.mean/1000.0);
+	snprintf(name,39,"%sSD",prefix);
+	EnvSet(e,name,"%.1f",StatsStdDev(st)/1000.0);
+	snprintf(name,39,"%sMIN",prefix);
+	EnvSet(e,name,"%.1f",st.min/1000.0);
+	snprintf(name,39,"%sMAX",prefix);
+	EnvSet(e,name,"%.1f",st.max/1000.0);
+	for (int i=0;i<EWMA_COUNT;i++)
 	{
-		// remember the checksum of the config file upon first load
-		system("sha256sum /etc/sumpalarm.conf > ./configsum");
-		FILE *check=fopen("./configsum","r");
-		if (check==NULL) return;
-		fgets(cline,64,check);
-		cline[64]=0;
-		fclose(check);
-		memcpy((void *)hash,(void *)cline,64);
-		hash[64]=0;
-		WriteLog("Reading Config...",3);
+		snprintf(name,39,"%sEWMA%s",prefix,EwmaName[i]);
+		EnvSet(e,name,"%.1f",st.ewma[i]/1000.0);
 	}
+}
 
-	FILE *conf=fopen(CONFIGFILE,"r");
-	if (conf==NULL)
+// Names SetEnvironment and SwitchChanged give the variables of an event, besides the
+// statistics and duty cycle families
+const char *EnvNames[]={"SASWITCH","SALEVEL","SATIME","SAFREQ","SAFREQF","SAVOLUME","SARATE",
+	"SATIMELEFT","SATIMELEFTM","SATIMELEFTLO","SATIMELEFTHI","SAINFLOW","SAINFLOWACCEL","SACHANGE",
+	"SAFREQP50","SAFREQP90","SAFREQP99","SAONTIME","SARUNTIME","SACYCLES",NULL};
+const char *EnvStats[]={"MEAN","SD","MIN","MAX",NULL};
+
+// true if the name of NAME=value (len characters) is prefix followed by suffix
+static bool EnvNameIs(const char *var, size_t len, const char *prefix, const char *suffix)
+{
+	size_t n=strlen(prefix);
+	return len==n+strlen(suffix)&&strncmp(var,prefix,n)==0&&strncmp(var+n,suffix,len-n)==0;
+}
+
+// true if NAME=value is one of the variables set for an event
+static bool EnvOwned(const char *var)
+{
+	const char *eq=strchr(var,'=');
+	size_t len=eq!=NULL?eq-var:strlen(var);
+
+	if (strncmp(var,"SA",2)!=0) return false;
+	for (int i=0;EnvNames[i]!=NULL;i++)
+		if (EnvNameIs(var,len,EnvNames[i],"")) return true;
+	for (int w=0;w<DUTY_WINDOWS;w++)
+		if (EnvNameIs(var,len,"SADUTY",DutyName[w])) return true;
+	for (int p=0;p<2;p++)
 	{
-		// if the file is locked or missing, it is a problem on startup but not during execution
-		if (initial)
+		const char *prefix=p==0?"SAFREQ":"SAON";
+		char name[40];
+		for (int i=0;EnvStats[i]!=NULL;i++)
+			if (EnvNameIs(var,len,prefix,EnvStats[i])) return true;
+		for (int i=0;i<EWMA_COUNT;i++)
 		{
-			WriteLog("Unable to open config file /etc/sumpalarm.conf",1);
-			exit(1);
+			snprintf(name,39,"EWMA%s",EwmaName[i]);
+			if (EnvNameIs(var,len,prefix,name)) return true;
 		}
-		else return;
 	}
+	return false;
+}
 
-	// read each line of configuration
-	while (fgets(cline,65534,conf)!=NULL)
-	{
-		trim(cline);	// remove leading or trailing whitespace from config line
+// Start the environment of a new event from the daemon's own, leaving out any of the
+// event's variables it was started with, since the ones set for the event would be
+// shadowed. Half of envp is kept for the event's own variables; inherited ones past
+// that are left out and logged once
+void EnvBegin(struct ActionEnv &e)
+{
+	static bool warned=false;
 
-		// if the line is blank or if the line is a comment, move to the next line
+	e.count=0;
+	e.used=0;
+	for (int i=0;environ[i]!=NULL;i++)
+	{
+		if (EnvOwned(environ[i])) continue;
+		if (e.count==ENV_ENTRIES/2)
+		{
+			if (!warned)
+			{
+				snprintf(logme,939,"More than %d inherited environment variables, the rest are not passed to actions",ENV_ENTRIES/2);
+				WriteLog(logme,1);
+				warned=true;
+			}
+			break;
+		}
+		e.envp[e.count++]=environ[i];
+	}
+	e.envp[e.count]=NULL;
+}
+
+// Add NAME=value to the event's environment. A variable that doesn't fit is left out
+void EnvSet(struct ActionEnv &e, const char *name, const char *fmt, ...)
+{
+	va_list ap;
+	int room=ENV_BYTES-e.used, n;
+
+	if (e.count>=ENV_ENTRIES-1) return;
+	n=snprintf(e.buf+e.used,room,"%s=",name);
+	if (n>=room) return;
+	va_start(ap,fmt);
+	n+=vsnprintf(e.buf+e.used+n,room-n,fmt,ap);
+	va_end(ap);
+	if (n>=room) return;
+
+	e.envp[e.count++]=e.buf+e.used;
+	e.envp[e.count]=NULL;
+	e.used+=n+1;
+}
+
+// determine the frequency of activations for the selected switch
+msec_t GetFrequency(struct FloatSwitch &s)
+{
+	if (s.freq.count==0) return 0;
+	return s.freq.sum/s.freq.count;
+}
+
+// Fold a sample x taken at time t into the running statistics
+void StatsAdd(struct RunningStats &st, msec_t x, msec_t t)
+{
+	double delta=x-st.mean;
+
+	st.n++;
+	st.mean+=delta/st.n;
+	st.m2+=delta*(x-st.mean);
+
+	if (st.n==1||x<st.min) st.min=x;
+	if (st.n==1||x>st.max) st.max=x;
+
+	for (int i=0;i<EWMA_COUNT;i++)
+	{
+		if (st.n==1) st.ewma[i]=x;
+		else st.ewma[i]+=(1.0-exp(-(double)(t-st.ewmat)/EwmaTau[i]))*(x-st.ewma[i]);
+	}
+	st.ewmat=t;
+}
+
+// Sample standard deviation in ms
+double StatsStdDev(struct RunningStats &st)
+{
+	if (st.n<2) return 0;
+	return sqrt(st.m2/(st.n-1));
+}
+
+// Record an interval, dropping the oldest once the history is full
+void HistoryAdd(struct FreqHistory &h, msec_t interval)
+{
+	if (h.count==h.depth) h.sum-=h.buf[h.head];
+	else h.count++;
+	h.buf[h.head]=interval;
+	h.sum+=interval;
+	if (++h.head==h.depth) h.head=0;
+}
+
+// Change the depth of the history, keeping the most recent intervals
+void HistoryResize(struct FreqHistory &h, int depth)
+{
+	if (depth==h.depth&&h.buf!=NULL) return;
+
+	msec_t *buf=(msec_t *)calloc(depth,sizeof(msec_t));
+	int keep=h.count<depth?h.count:depth;
+	msec_t sum=0;
+
+	// copy oldest to newest so the ring restarts at slot 0
+	for (int i=0;i<keep;i++)
+	{
+		buf[i]=h.buf[(h.head-keep+i+h.depth)%h.depth];
+		sum+=buf[i];
+	}
+
+	if (h.buf!=NULL) free(h.buf);
+	h.buf=buf;
+	h.depth=depth;
+	h.count=keep;
+	h.head=keep%depth;
+	h.sum=sum;
+}
+
+// Feed one interval to a change detector. shift is the smallest change in ln(interval)
+// worth reporting and limit the decision limit in standard deviations. Returns
+// CHANGE_READY when warm-up completes, CHANGE_SLOWER or CHANGE_FASTER when a shift is
+// detected (and warm-up restarts from this interval), otherwise CHANGE_NONE
+int ChangeAdd(struct ChangeDetector &cp, msec_t interval, int warmup, double shift, double limit)
+{
+	double x=log((double)(interval>1?interval:1));
+
+	if (cp.n<warmup)
+	{
+		double delta=x-cp.mean;
+		cp.n++;
+		cp.mean+=delta/cp.n;
+		cp.m2+=delta*(x-cp.mean);
+		if (cp.n<warmup) return CHANGE_NONE;
+
+		cp.sd=cp.n>1?sqrt(cp.m2/(cp.n-1)):0;
+		if (cp.sd<CHANGE_MINSD) cp.sd=CHANGE_MINSD;
+		cp.hi=0;
+		cp.lo=0;
+		return CHANGE_READY;
+	}
+
+	double z=(x-cp.mean)/cp.sd;
+	double k=shift/2/cp.sd;
+
+	cp.hi+=z-k;
+	if (cp.hi<0) cp.hi=0;
+	cp.lo-=z+k;
+	if (cp.lo<0) cp.lo=0;
+	if (cp.hi<=limit&&cp.lo<=limit) return CHANGE_NONE;
+
+	int change=cp.hi>limit?CHANGE_SLOWER:CHANGE_FASTER;
+
+	// the new regime has already started, so this interval seeds the next reference
+	cp.n=1;
+	cp.mean=x;
+	cp.m2=0;
+	return change;
+}
+
+// Bucket holding x
+static inline int SketchBucket(msec_t x)
+{
+	if (x<(1<<SKETCH_SUB_BITS)) return x<0?0:(int)x;
+
+	int e=63-__builtin_clzll((uint64_t)x);
+	int b=((e-SKETCH_SUB_BITS+1)<<SKETCH_SUB_BITS)+(int)((x>>(e-SKETCH_SUB_BITS))&((1<<SKETCH_SUB_BITS)-1));
+	return b<SKETCH_BUCKETS?b:SKETCH_BUCKETS-1;
+}
+
+// Record an interval in the sketch
+void SketchAdd(struct QuantileSketch &qs, msec_t x)
+{
+	if (qs.total>=SKETCH_LIMIT)
+	{
+		// halve, rounding up so a rare long interval isn't forgotten outright
+		qs.total=0;
+		for (int i=0;i<SKETCH_BUCKETS;i++)
+		{
+			qs.count[i]=(qs.count[i]+1)>>1;
+			qs.total+=qs.count[i];
+		}
+	}
+	qs.count[SketchBucket(x)]++;
+	qs.total++;
+}
+
+// The q quantile (0 to 1) of the recorded intervals, as the upper edge of the bucket it
+// falls in so it errs towards the longer interval. 0 if nothing is recorded
+msec_t SketchQuantile(struct QuantileSketch &qs, double q)
+{
+	if (qs.total==0) return 0;
+
+	uint32_t rank=(uint32_t)ceil(q*qs.total), seen=0;
+	if (rank<1) rank=1;
+
+	for (int i=0;i<SKETCH_BUCKETS;i++)
+	{
+		seen+=qs.count[i];
+		if (seen<rank) continue;
+		if (i<(1<<SKETCH_SUB_BITS)) return i;
+
+		int e=(i>>SKETCH_SUB_BITS)+SKETCH_SUB_BITS-1;
+		msec_t width=(msec_t)1<<(e-SKETCH_SUB_BITS);
+		return ((msec_t)((1<<SKETCH_SUB_BITS)+(i&((1<<SKETCH_SUB_BITS)-1)))<<(e-SKETCH_SUB_BITS))+width-1;
+	}
+	return 0;
+}
+
+// Work out the pit geometry from the configured dimensions (mm). pi/4 is taken as
+// 355/452, within a millionth, so no floating point is needed here either
+void PitInit(struct ConfigData &cd)
+{
+	int64_t d=cd.sumpdiameter;
+
+	cd.pit.area=(d*d*355+226)/452;
+	cd.pit.capacity=cd.pit.area*cd.sumpdepth/1000;
+	cd.pit.pumpout=cd.pit.area*(cd.highwater-cd.lowwater)/1000;
+	for (int ID=0;ID<100;ID++)
+		cd.pit.switchvol[ID]=cd.pit.area*cd.switchlist[ID].level/1000;
+}
+
+// Inflow in mL/h when Switch0 comes on every interval ms, 0 if the interval isn't known
+int64_t PitRate(struct PitGeometry &pit, msec_t interval)
+{
+	return interval>0?pit.pumpout*3600000/interval:0;
+}
+
+// Add an inflow observation q (L/h) made at time t
+void TrendAdd(struct InflowTrend &tr, msec_t t, double q)
+{
+	if (tr.at!=0)
+	{
+		// move the origin to t, then fade everything by the time that has passed
+		double d=(t-tr.at)/3600000.0;
+		double f=exp(-(double)(t-tr.at)/TREND_TAU);
+
+		tr.s2=(tr.s2-2*d*tr.s1+d*d*tr.s0)*f;
+		tr.s1=(tr.s1-d*tr.s0)*f;
+		tr.sxy=(tr.sxy-d*tr.sy)*f;
+		tr.s0*=f;
+		tr.sy*=f;
+		tr.syy*=f;
+		tr.sw2*=f*f;
+	}
+	tr.at=t;
+	tr.s0+=1;
+	tr.sy+=q;
+	tr.syy+=q*q;
+	tr.sw2+=1;
+}
+
+// Inflow (L/h) and its rate of change (L/h per hour) extrapolated to now, with their
+// standard errors. False until there are enough observations spread over time for a
+// line and a residual spread
+bool TrendFit(struct InflowTrend &tr, msec_t now, double &q, double &accel, double &qsd, double &accelsd)
+{
+	if (tr.at==0) return false;
+
+	double neff=tr.s0*tr.s0/tr.sw2;
+	double det=tr.s0*tr.s2-tr.s1*tr.s1;
+	if (neff<3||det<=1e-9*tr.s0*tr.s0) return false;
+
+	double b=(tr.s0*tr.sxy-tr.s1*tr.sy)/det;
+	double a=(tr.sy-b*tr.s1)/tr.s0;
+	double rss=tr.syy-a*tr.sy-b*tr.sxy;
+	double var=(rss>0?rss/tr.s0:0)*neff/(neff-2);	// residual variance of one observation
+	double h=(now-tr.at)/3600000.0;
+
+	q=a+b*h;
+	accel=b;
+	qsd=sqrt(var*(tr.s2-2*h*tr.s1+h*h*tr.s0)/det);
+	accelsd=sqrt(var*tr.s0/det);
+	return true;
+}
+
+// Seconds until litres more water has come in at inflow q (L/h) changing by accel L/h
+// per hour, or -1 if at that trend the inflow stops before it does
+double FloodSeconds(double q, double accel, double litres)
+{
+	double hours;
+
+	if (litres<=0) return 0;
+	if (fabs(accel)<1e-9)
+	{
+		if (q<=0) return -1;
+		hours=litres/q;
+	}
+	else
+	{
+		// solve q*h + accel*h*h/2 = litres for the first h > 0
+		double disc=q*q+2*accel*litres;
+		if (disc<0) return -1;
+		hours=(-q+sqrt(disc))/accel;
+		if (hours<=0) return -1;
+	}
+	return hours*3600;
+}
+
+// FloodSeconds as whole seconds for SATIMELEFT. An inflow near zero gives a forecast too
+// large for an int, so anything past FLOOD_HORIZON, like no flood at all, is 0
+int FloodForecast(double secs)
+{
+	if (!(secs>0&&secs<=FLOOD_HORIZON)) return 0;
+	return (int)secs;
+}
+
+// CRC-32 (IEEE) of a block of memory
+uint32_t Crc32(const void *data, size_t len)
+{
+	static uint32_t table[256];
+	const uint8_t *p=(const uint8_t *)data;
+	uint32_t crc=0xffffffff;
+
+	if (table[1]==0)
+	{
+		for (uint32_t i=0;i<256;i++)
+		{
+			uint32_t c=i;
+			for (int k=0;k<8;k++) c=c&1?0xedb88320^(c>>1):c>>1;
+			table[i]=c;
+		}
+	}
+	while (len--) crc=table[(crc^*p++)&0xff]^(crc>>8);
+	return ~crc;
+}
+
+static int64_t WallMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
+	return (int64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+static bool StateValid(struct StateSlot &sl)
+{
+	return sl.size==sizeof(sl)&&sl.crc==Crc32((uint8_t *)&sl+sizeof(sl.crc),sizeof(sl)-sizeof(sl.crc));
+}
+
+// Copy into the mapping only where the contents differ, so pages that haven't changed
+// aren't dirtied and written back to the card
+static void StatePut(void *dst, const void *src, size_t len)
+{
+	uint8_t *d=(uint8_t *)dst;
+	const uint8_t *s=(const uint8_t *)src;
+
+	for (size_t off=0;off<len;off+=256)
+	{
+		size_t n=len-off<256?len-off:256;
+		if (memcmp(d+off,s+off,n)!=0) memcpy(d+off,s+off,n);
+	}
+}
+
+// Map the state file, creating it if needed, and restore the newest valid copy of the
+// state into the switches. Returns false if there is no usable state file
+bool StateOpen(struct ConfigData &cd)
+{
+	struct stat st;
+	int ID, cur;
+
+	if (cd.statefile[0]==0) return false;
+
+	int fd=open(cd.statefile,O_RDWR|O_CREAT|O_CLOEXEC,0644);
+	if (fd<0||fstat(fd,&st)<0||(st.st_size!=sizeof(struct StateFile)&&ftruncate(fd,sizeof(struct StateFile))<0))
+	{
+		snprintf(logme,939,"Unable to open state file %s, history will not be kept",cd.statefile);
+		WriteLog(logme,1);
+		if (fd>=0) close(fd);
+		return false;
+	}
+	void *m=mmap(NULL,sizeof(struct StateFile),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if (m==MAP_FAILED)
+	{
+		snprintf(logme,939,"Unable to map state file %s, history will not be kept",cd.statefile);
+		WriteLog(logme,1);
+		return false;
+	}
+	cd.state=(struct StateFile *)m;
+
+	if (cd.state->magic!=STATE_MAGIC||cd.state->version!=STATE_VERSION||cd.state->size!=sizeof(struct StateFile))
+	{
+		if (st.st_size!=0) WriteLog("State file has a different layout, starting with a fresh history",2);
+		memset(cd.state,0,sizeof(struct StateFile));
+		cd.state->magic=STATE_MAGIC;
+		cd.state->version=STATE_VERSION;
+		cd.state->size=sizeof(struct StateFile);
+		return true;
+	}
+
+	// the newest copy that checks out
+	bool v0=StateValid(cd.state->slot[0]), v1=StateValid(cd.state->slot[1]);
+	if (!v0&&!v1)
+	{
+		WriteLog("State file is corrupt, starting with a fresh history",1);
+		return true;
+	}
+	cur=v0&&(!v1||cd.state->slot[0].generation>cd.state->slot[1].generation)?0:1;
+	struct StateSlot &sl=cd.state->slot[cur];
+
+	// Carry the monotonic timebase on from the saved one by the wall clock time that has
+	// passed, so saved timestamps stay comparable. A Pi without an RTC may boot with an
+	// old wall clock, in which case no time is assumed to have passed
+	int64_t gap=WallMs()-sl.savedwall;
+	if (gap<0) gap=0;
+	MonoOffset=0;
+	MonoOffset=sl.savedmono+gap-MonoMs();
+
+	cd.inflow=sl.inflow;
+	for (ID=0;ID<100;ID++)
+	{
+		struct StateSwitch &ss=sl.sw[ID];
+		struct FloatSwitch &s=cd.switchlist[ID];
+
+		if (!s.initialized||!ss.initialized||ss.depth<1||ss.depth>FREQ_HISTORY_MAX) continue;
+
+		// rebuild the history at its saved depth, then bring it to the configured one
+		int depth=s.freq.depth;
+		HistoryResize(s.freq,ss.depth);
+		memcpy(s.freq.buf,ss.freqbuf,ss.depth*sizeof(msec_t));
+		s.freq.head=ss.head;
+		s.freq.count=ss.count;
+		s.freq.sum=ss.freqsum;
+		HistoryResize(s.freq,depth);
+
+		s.interval=ss.interval;
+		s.onduration=ss.onduration;
+		s.sketch=ss.sketch;
+		s.change=ss.change;
+		memcpy(s.duty,ss.duty,sizeof(s.duty));
+		s.runtime=ss.runtime;
+		s.cycles=ss.cycles;
+		s.lastduration=ss.lastduration;
+		s.lastfreq=ss.lastfreq;
+
+		// the last activation only still counts if the daemon can't have missed one
+		// while it was down
+		if (gap<GetFrequency(s))
+		{
+			s.LastOn=ss.LastOn;
+			s.LastOff=ss.LastOff;
+		}
+	}
+	cd.freq=GetFrequency(cd.switchlist[0]);
+
+	snprintf(logme,939,"Restored state from %s, saved %llds ago with %d Switch0 intervals",cd.statefile,
+		(long long)(gap/1000),cd.switchlist[0].freq.count);
+	WriteLog(logme,3);
+	return true;
+}
+
+// Write the current state over the older copy in the state file and flush it to disk
+void StateSave(struct ConfigData &cd)
+{
+	if (cd.state==NULL) return;
+
+	int cur=cd.state->slot[0].generation>=cd.state->slot[1].generation?0:1;
+	struct StateSlot &sl=cd.state->slot[1-cur];
+	int64_t wall=WallMs();
+	msec_t now=MonoMs();
+	int ID;
+
+	StatePut(&sl.inflow,&cd.inflow,sizeof(sl.inflow));
+	for (ID=0;ID<100;ID++)
+	{
+		struct StateSwitch &ss=sl.sw[ID];
+		struct FloatSwitch &s=cd.switchlist[ID];
+		int32_t init=s.initialized&&s.freq.buf!=NULL;
+		int64_t laston=s.LastOn?wall-(now-s.LastOn):0, lastoff=s.LastOff?wall-(now-s.LastOff):0;
+
+		if (!init&&!ss.initialized) continue;
+		StatePut(&ss.initialized,&init,sizeof(init));
+		if (!init) continue;
+		StatePut(&ss.depth,&s.freq.depth,sizeof(ss.depth));
+		StatePut(&ss.head,&s.freq.head,sizeof(ss.head));
+		StatePut(&ss.count,&s.freq.count,sizeof(ss.count));
+		StatePut(&ss.freqsum,&s.freq.sum,sizeof(ss.freqsum));
+		StatePut(ss.freqbuf,s.freq.buf,s.freq.depth*sizeof(msec_t));
+		StatePut(&ss.interval,&s.interval,sizeof(ss.interval));
+		StatePut(&ss.onduration,&s.onduration,sizeof(ss.onduration));
+		StatePut(&ss.sketch,&s.sketch,sizeof(ss.sketch));
+		StatePut(&ss.change,&s.change,sizeof(ss.change));
+		StatePut(ss.duty,s.duty,sizeof(ss.duty));
+		StatePut(&ss.runtime,&s.runtime,sizeof(ss.runtime));
+		StatePut(&ss.cycles,&s.cycles,sizeof(ss.cycles));
+		StatePut(&ss.lastduration,&s.lastduration,sizeof(ss.lastduration));
+		StatePut(&ss.lastfreq,&s.lastfreq,sizeof(ss.lastfreq));
+		StatePut(&ss.LastOn,&s.LastOn,sizeof(ss.LastOn));
+		StatePut(&ss.LastOff,&s.LastOff,sizeof(ss.LastOff));
+		StatePut(&ss.laston,&laston,sizeof(ss.laston));
+		StatePut(&ss.lastoff,&lastoff,sizeof(ss.lastoff));
+	}
+	sl.savedwall=wall;
+	sl.savedmono=now;
+	sl.size=sizeof(sl);
+	sl.generation=cd.state->slot[cur].generation+1;
+	sl.crc=Crc32((uint8_t *)&sl+sizeof(sl.crc),sizeof(sl)-sizeof(sl.crc));
+
+	if (msync(cd.state,sizeof(struct StateFile),MS_SYNC)<0)
+	{
+		snprintf(logme,939,"Unable to sync state file %s",cd.statefile);
+		WriteLog(logme,1);
+	}
+}
+
+// Periodic state file sync
+void StateExpired(struct ConfigData &cd, struct Timer *tm)
+{
+	StateSave(cd);
+	if (cd.statesync>0) TimerArm(cd.wheel,tm,MonoMs()+(msec_t)cd.statesync*1000);
+}
+
+void StateClose(struct ConfigData &cd)
+{
+	if (cd.state==NULL) return;
+	StateSave(cd);
+	munmap(cd.state,sizeof(struct StateFile));
+	cd.state=NULL;
+}
+
+// Size of a block holding count records
+static inline size_t JournalBlockSize(int count)
+{
+	return offsetof(struct JournalBlock,rec)+count*sizeof(struct JournalRecord);
+}
+
+static void JournalPath(struct ConfigData &cd, uint32_t seq, char *path)
+{
+	snprintf(path,511,"%s/journal.%08u",cd.journaldir,seq);
+}
+
+// Start a fresh index for segment seq
+static void JournalIndexOpen(struct ConfigData &cd, uint32_t seq)
+{
+	struct JournalIndexHeader hdr;
+	char path[512];
+
+	if (cd.journal.idxfd>=0) close(cd.journal.idxfd);
+	cd.journal.indexed=-1;
+
+	snprintf(path,511,"%s/journal.%08u.idx",cd.journaldir,seq);
+	cd.journal.idxfd=open(path,O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC,0644);
+	memset(&hdr,0,sizeof(hdr));
+	hdr.magic=JOURNAL_INDEX_MAGIC;
+	hdr.version=JOURNAL_VERSION;
+	hdr.seq=seq;
+	hdr.stride=JOURNAL_STRIDE;
+	if (cd.journal.idxfd>=0&&write(cd.journal.idxfd,&hdr,sizeof(hdr))!=sizeof(hdr))
+	{
+		close(cd.journal.idxfd);
+		cd.journal.idxfd=-1;
+	}
+	if (cd.journal.idxfd<0)
+	{
+		snprintf(logme,939,"Unable to write journal index %s, queries will scan the segment",path);
+		WriteLog(logme,2);
+	}
+}
+
+// Enter the block at offset in the index if it is the first one past the stride
+static void JournalIndexAdd(struct ConfigData &cd, const struct JournalBlock *b, off_t offset)
+{
+	struct JournalIndexEntry e;
+
+	if (cd.journal.idxfd<0||b->count==0) return;
+	if (cd.journal.indexed>=0&&offset-cd.journal.indexed<JOURNAL_STRIDE) return;
+	e.wall=b->rec[0].wall;
+	e.offset=offset;
+	if (write(cd.journal.idxfd,&e,sizeof(e))==sizeof(e)) cd.journal.indexed=offset;
+}
+
+// Drop the segments that have fallen out of JournalKeep along with their indexes, and
+// any index whose segment is already gone
+static void JournalPrune(struct ConfigData &cd, uint32_t seq)
+{
+	uint32_t keep=cd.journalkeep>0&&seq>(uint32_t)cd.journalkeep?seq-cd.journalkeep:0;
+	char path[512];
+	struct dirent *de;
+	struct stat st;
+
+	DIR *dir=opendir(cd.journaldir);
+	if (dir==NULL) return;
+	while ((de=readdir(dir))!=NULL)
+	{
+		uint32_t n;
+		int len;
+		if (sscanf(de->d_name,"journal.%u%n",&n,&len)!=1) continue;
+		if (de->d_name[len]==0)
+		{
+			if (n>keep) continue;
+		}
+		else if (strcmp(de->d_name+len,".idx")==0)
+		{
+			JournalPath(cd,n,path);
+			if (n>keep&&stat(path,&st)==0) continue;
+		}
+		else continue;
+		unlinkat(dirfd(dir),de->d_name,0);
+	}
+	closedir(dir);
+}
+
+// Start segment seq and drop the ones that have fallen out of JournalKeep
+static bool JournalStart(struct ConfigData &cd, uint32_t seq)
+{
+	struct JournalSegment hdr;
+	char path[512];
+
+	JournalPath(cd,seq,path);
+	cd.journal.fd=open(path,O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC,0644);
+	memset(&hdr,0,sizeof(hdr));
+	hdr.magic=JOURNAL_MAGIC;
+	hdr.version=JOURNAL_VERSION;
+	hdr.recsize=sizeof(struct JournalRecord);
+	hdr.seq=seq;
+	hdr.created=WallMs();
+	cd.journal.walloffset=hdr.created-MonoMs();
+	if (cd.journal.fd<0||write(cd.journal.fd,&hdr,sizeof(hdr))!=sizeof(hdr))
+	{
+		snprintf(logme,939,"Unable to start journal segment %s, the journal is off",path);
+		WriteLog(logme,1);
+		if (cd.journal.fd>=0) close(cd.journal.fd);
+		cd.journal.fd=-1;
+		return false;
+	}
+	cd.journal.seq=seq;
+	cd.journal.size=sizeof(hdr);
+	JournalIndexOpen(cd,seq);
+	JournalPrune(cd,seq);
+	return true;
+}
+
+// Open the newest journal segment for appending, cutting off anything after its last
+// intact block, or start a new one
+bool JournalOpen(struct ConfigData &cd)
+{
+	char path[512];
+	uint32_t seq=0, n;
+	struct dirent *de;
+	struct stat st;
+
+	cd.journal.blk.count=0;
+	cd.journal.unsynced=false;
+	cd.journal.lastsync=MonoMs();
+	if (cd.journaldir[0]==0) return false;
+
+	mkdir(cd.journaldir,0755);
+	DIR *dir=opendir(cd.journaldir);
+	if (dir==NULL)
+	{
+		snprintf(logme,939,"Unable to open journal directory %s, the journal is off",cd.journaldir);
+		WriteLog(logme,1);
+		return false;
+	}
+	while ((de=readdir(dir))!=NULL)
+	{
+		int len;
+		if (sscanf(de->d_name,"journal.%u%n",&n,&len)==1&&de->d_name[len]==0&&n>seq) seq=n;
+	}
+	closedir(dir);
+
+	if (seq==0) return JournalStart(cd,1);
+
+	JournalPath(cd,seq,path);
+	int fd=open(path,O_RDWR|O_APPEND|O_CLOEXEC);
+	if (fd<0||fstat(fd,&st)<0)
+	{
+		if (fd>=0) close(fd);
+		return JournalStart(cd,seq+1);
+	}
+
+	// walk the blocks to the end of the last one that checks out
+	void *m=st.st_size>0?mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0):MAP_FAILED;
+	off_t end=0;
+	if (m!=MAP_FAILED)
+	{
+		const uint8_t *p=(const uint8_t *)m;
+		const struct JournalSegment *hdr=(const struct JournalSegment *)p;
+
+		if (st.st_size>=(off_t)sizeof(*hdr)&&hdr->magic==JOURNAL_MAGIC&&hdr->version==JOURNAL_VERSION&&hdr->recsize==sizeof(struct JournalRecord))
+		{
+			// the index is rebuilt along the way, in case the last run died before writing it
+			JournalIndexOpen(cd,seq);
+			end=sizeof(*hdr);
+			while (end+(off_t)JournalBlockSize(0)<=st.st_size)
+			{
+				const struct JournalBlock *b=(const struct JournalBlock *)(p+end);
+				if (b->magic!=JOURNAL_BLOCK_MAGIC||b->count>JOURNAL_BLOCK||end+(off_t)JournalBlockSize(b->count)>st.st_size||
+					b->crc!=Crc32(b->rec,b->count*sizeof(struct JournalRecord))) break;
+				JournalIndexAdd(cd,b,end);
+				end+=JournalBlockSize(b->count);
+			}
+		}
+		munmap(m,st.st_size);
+	}
+	if (end==0||end>=(off_t)cd.journalsegment*1024)
+	{
+		// not a segment that can be appended to, or already full
+		close(fd);
+		return JournalStart(cd,seq+1);
+	}
+	if (end<st.st_size)
+	{
+		snprintf(logme,939,"Journal segment %s cut back to its last intact block",path);
+		WriteLog(logme,2);
+		if (ftruncate(fd,end)<0) {}
+	}
+	cd.journal.fd=fd;
+	cd.journal.seq=seq;
+	cd.journal.size=end;
+	cd.journal.walloffset=WallMs()-MonoMs();
+	return true;
+}
+
+// Record a switch edge. Records are written in batches by JournalFlush
+void JournalAdd(struct ConfigData &cd, int ID, int edge, msec_t t, msec_t duration)
+{
+	if (cd.journal.fd<0) return;
+
+	struct JournalRecord &r=cd.journal.blk.rec[cd.journal.blk.count++];
+	memset(&r,0,sizeof(r));
+	r.wall=t+cd.journal.walloffset;
+	r.mono=t;
+	r.duration=duration<0x7fffffff?(int32_t)duration:0x7fffffff;
+	r.rate=(int32_t)PitRate(cd.pit,cd.freq);
+	r.id=ID;
+	r.edge=edge;
+
+	if (cd.journal.blk.count==JOURNAL_BLOCK||cd.journalflush==0) JournalFlush(cd,false);
+	else if (cd.journal.timer.pprev==NULL||cd.journal.timer.expires>t+(msec_t)cd.journalflush*1000)
+		TimerArm(cd.wheel,&cd.journal.timer,t+(msec_t)cd.journalflush*1000);
+}
+
+// Write the batched records as one block, starting a new segment first if this one is
+// full, and fsync if JournalSync has passed since the last one (or sync is set)
+void JournalFlush(struct ConfigData &cd, bool sync)
+{
+	msec_t now=MonoMs();
+
+	if (cd.journal.fd<0) return;
+	if (cd.journal.blk.count>0)
+	{
+		size_t len=JournalBlockSize(cd.journal.blk.count);
+
+		if (cd.journal.size+(off_t)len>(off_t)cd.journalsegment*1024)
+		{
+			fdatasync(cd.journal.fd);
+			close(cd.journal.fd);
+			if (cd.journal.idxfd>=0) fdatasync(cd.journal.idxfd);
+			cd.journal.unsynced=false;
+			if (!JournalStart(cd,cd.journal.seq+1))
+			{
+				TimerCancel(cd.wheel,&cd.journal.timer);
+				return;
+			}
+		}
+
+		cd.journal.blk.magic=JOURNAL_BLOCK_MAGIC;
+		cd.journal.blk.reserved=0;
+		cd.journal.blk.reserved2=0;
+		cd.journal.blk.crc=Crc32(cd.journal.blk.rec,cd.journal.blk.count*sizeof(struct JournalRecord));
+		if (write(cd.journal.fd,&cd.journal.blk,len)!=(ssize_t)len)
+		{
+			snprintf(logme,939,"Unable to write to journal segment %u",cd.journal.seq);
+			WriteLog(logme,1);
+		}
+		else
+		{
+			JournalIndexAdd(cd,&cd.journal.blk,cd.journal.size);
+			cd.journal.size+=len;
+		}
+		cd.journal.blk.count=0;
+		cd.journal.unsynced=true;
+	}
+
+	if (cd.journal.unsynced&&(sync||now-cd.journal.lastsync>=(msec_t)cd.journalsync*1000))
+	{
+		fdatasync(cd.journal.fd);
+		if (cd.journal.idxfd>=0) fdatasync(cd.journal.idxfd);
+		cd.journal.lastsync=now;
+		cd.journal.unsynced=false;
+	}
+	TimerCancel(cd.wheel,&cd.journal.timer);
+	if (cd.journal.unsynced) TimerArm(cd.wheel,&cd.journal.timer,cd.journal.lastsync+(msec_t)cd.journalsync*1000);
+}
+
+void JournalExpired(struct ConfigData &cd, struct Timer *)
+{
+	JournalFlush(cd,false);
+}
+
+void JournalClose(struct ConfigData &cd)
+{
+	if (cd.journal.fd<0) return;
+	JournalFlush(cd,true);
+	close(cd.journal.fd);
+	cd.journal.fd=-1;
+	if (cd.journal.idxfd>=0) close(cd.journal.idxfd);
+	cd.journal.idxfd=-1;
+}
+
+// Shell builtins and keywords with no program of the same name to run instead
+const char *ShellWords[]={".",":","alias","case","cd","eval","exec","exit","export","for","if","local",
+	"read","readonly","set","shift","source","trap","ulimit","umask","unset","until","wait","while",NULL};
+
+// Compile $NAME, ${NAME} or $(date) at c into w, moving both on. Returns false for any
+// other use of $
+static bool ActionVariable(const char *&c, char *&w, uint8_t &kind)
+{
+	const char *v=c+1;
+	bool brace=*v=='{';
+
+	if (strncmp(v,"(date)",6)==0)
+	{
+		c+=7;
+		*w++=0;
+		kind=CHUNK_DATE;
+		return true;
+	}
+	if (brace) v++;
+	if (!(*v=='_'||(*v>='A'&&*v<='Z')||(*v>='a'&&*v<='z'))) return false;
+	while (*v=='_'||(*v>='A'&&*v<='Z')||(*v>='a'&&*v<='z')||(*v>='0'&&*v<='9')) *w++=*v++;
+	*w++=0;
+	if (brace)
+	{
+		if (*v!='}') return false;
+		v++;
+	}
+	c=v;
+	kind=CHUNK_VAR;
+	return true;
+}
+
+// Compile a line into chunks of literal text and variables, with words marked the way
+// the shell would split them. Understands 'quotes', "quotes" with variables in them,
+// $NAME, ${NAME}, $(date) and one > or >> file at the end. Returns false if the line
+// uses anything else the shell would do differently, and then the shell gets it
+static bool ActionCompile(struct ActionCmd &a)
+{
+	const char *c=a.line;
+	size_t len=strlen(a.line);
+	char *w;
+	int words=0, target=0, i;	// target: 1 after > or >>, 2 in its word, 3 past it
+	bool newword=true;
+
+	// every chunk takes at least one character of the line and adds one NUL
+	a.words=(char *)malloc(len*2+2);
+	a.chunk=(struct ActionChunk *)malloc(sizeof(struct ActionChunk)*(len+1));
+	a.chunks=0;
+	a.redirect=0;
+	w=a.words;
+
+	while (*c)
+	{
+		uint8_t kind=CHUNK_TEXT, flags=0;
+		const char *text=w;
+
+		if (*c==' '||*c=='\t')
+		{
+			newword=true;
+			c++;
+			continue;
+		}
+		if (*c=='>')
+		{
+			if (!newword||words==0||target!=0) return false;
+			c++;
+			a.redirect=O_TRUNC;
+			if (*c=='>')
+			{
+				c++;
+				a.redirect=O_APPEND;
+			}
+			target=1;
+			continue;
+		}
+		if (newword)
+		{
+			if (target==2) target=3;
+			if (target==3) return false;
+			if (target==1) target=2;
+			else words++;
+			flags|=CHUNK_WORD;
+			newword=false;
+		}
+		if (target==2) flags|=CHUNK_TARGET|CHUNK_QUOTED;
+
+		if (*c=='\'')
+		{
+			const char *q=strchr(c+1,'\'');
+			if (q==NULL) return false;
+			memcpy(w,c+1,q-c-1);
+			w+=q-c-1;
+			*w++=0;
+			flags|=CHUNK_QUOTED;
+			c=q+1;
+		}
+		else if (*c=='"')
+		{
+			// a run of chunks, all quoted, the first of them starting the word if this does
+			for (c++;*c!='"';)
+			{
+				if (*c==0||*c=='`'||*c=='\\') return false;
+				if (*c=='$')
+				{
+					if (!ActionVariable(c,w,kind)) return false;
+				}
+				else
+				{
+					while (*c&&*c!='"'&&*c!='$'&&*c!='`'&&*c!='\\') *w++=*c++;
+					*w++=0;
+					kind=CHUNK_TEXT;
+				}
+				a.chunk[a.chunks].text=text;
+				a.chunk[a.chunks].kind=kind;
+				a.chunk[a.chunks].flags=flags|CHUNK_QUOTED;
+				a.chunks++;
+				flags&=~CHUNK_WORD;
+				text=w;
+			}
+			c++;
+			// "" on its own is still an empty word
+			if (!(flags&CHUNK_WORD)) continue;
+			*w++=0;
+			flags|=CHUNK_QUOTED;
+		}
+		else if (*c=='$')
+		{
+			if (!ActionVariable(c,w,kind)) return false;
+		}
+		else
+		{
+			while (*c&&*c!=' '&&*c!='\t'&&*c!='\''&&*c!='"'&&*c!='$'&&*c!='>')
+			{
+				if (strchr(SHELL_CHARS,*c)!=NULL) return false;
+				*w++=*c++;
+			}
+			*w++=0;
+		}
+		a.chunk[a.chunks].text=text;
+		a.chunk[a.chunks].kind=kind;
+		a.chunk[a.chunks].flags=flags;
+		a.chunks++;
+	}
+	if (words==0||target==1) return false;
+
+	// a leading VAR=value is an assignment, and builtins have no program to run
+	struct ActionChunk &first=a.chunk[0];
+	if (first.kind!=CHUNK_TEXT) return true;
+	if (strchr(first.text,'=')!=NULL) return false;
+	if (a.chunks==1||(a.chunk[1].flags&CHUNK_WORD))
+		for (i=0;ShellWords[i]!=NULL;i++)
+			if (strcmp(first.text,ShellWords[i])==0) return false;
+
+	// echo into a file needs no process at all, unless it is given options
+	if (a.redirect&&strcmp(first.text,"echo")==0&&(a.chunks==1||(a.chunk[1].flags&CHUNK_WORD)))
+		a.append=a.chunks==1||(a.chunk[1].flags&CHUNK_TARGET)||a.chunk[1].kind!=CHUNK_TEXT||a.chunk[1].text[0]!='-';
+	return true;
+}
+
+const char *SyslogFacility[]={"kern","user","mail","daemon","auth","syslog","lpr","news","uucp","cron","authpriv","ftp",NULL};
+const char *SyslogLevel[]={"emerg","alert","crit","err","warning","notice","info","debug",NULL};
+
+// The syslog priority of [facility.]level, SYSLOG_DEFAULT if spec is empty, or -1
+static int SyslogPriority(const char *spec)
+{
+	const char *dot=strchr(spec,'.');
+	int facility=SYSLOG_DEFAULT&LOG_FACMASK, i;
+
+	if (*spec==0) return SYSLOG_DEFAULT;
+	if (dot!=NULL)
+	{
+		for (i=0;SyslogFacility[i]!=NULL;i++)
+			if (strncmp(spec,SyslogFacility[i],dot-spec)==0&&SyslogFacility[i][dot-spec]==0) break;
+		if (SyslogFacility[i]!=NULL) facility=i<<3;
+		else if (dot-spec==6&&strncmp(spec,"local",5)==0&&spec[5]>='0'&&spec[5]<='7') facility=LOG_LOCAL0+((spec[5]-'0')<<3);
+		else return -1;
+		spec=dot+1;
+	}
+	for (i=0;SyslogLevel[i]!=NULL;i++)
+		if (strcmp(spec,SyslogLevel[i])==0) return facility|i;
+	return -1;
+}
+
+// Check where a sink line writes to and build what goes before each of its messages.
+// A webhook has to be on this host, since the daemon waits for the connection to it.
+// Returns false if the daemon can't write there
+static bool SinkTarget(struct ActionCmd &a)
+{
+	char head[600];
+	char *path, *port;
+	int pri;
+
+	switch (a.sink)
+	{
+		case SINK_FILE:
+			return a.sinkpath[0]=='/'&&strlen(a.sinkpath)<sizeof(((struct SinkFd *)0)->path);
+
+		case SINK_UNIX:
+			return a.sinkpath[0]=='/'&&strlen(a.sinkpath)<sizeof(((struct sockaddr_un *)0)->sun_path);
+
+		case SINK_SYSLOG:
+			pri=SyslogPriority(a.sinkpath);
+			if (pri<0) return false;
+			snprintf(head,sizeof(head),"<%d>",pri);
+			a.sinkpath=(char *)SYSLOG_SOCKET;
+			break;
+
+		case SINK_HTTP:
+			path=strchr(a.sinkpath,'/');
+			if (path==NULL) path=a.sinkpath+strlen(a.sinkpath);
+			if (path-a.sinkpath>=64||strlen(path)>=500) return false;
+			port=a.sinkpath[0]=='['?strchr(a.sinkpath,']'):a.sinkpath;
+			if (port==NULL||port>path) return false;
+			port=strchr(port,':');
+			if (port==NULL||port>path) port=path;
+			else if (atoi(port+1)<1||atoi(port+1)>65535) return false;
+			if (!((port-a.sinkpath==9&&strncmp(a.sinkpath,"localhost",9)==0)||
+				(port-a.sinkpath==5&&strncmp(a.sinkpath,"[::1]",5)==0)||
+				strncmp(a.sinkpath,"127.",4)==0)) return false;
+			snprintf(head,sizeof(head),"POST %s HTTP/1.1\r\nHost: %.*s\r\n",*path?path:"/",(int)(path-a.sinkpath),a.sinkpath);
+			*path=0;
+			break;
+	}
+	a.sinkhead=(char *)malloc(strlen(head)+1);
+	strcpy(a.sinkhead,head);
+	return true;
+}
+
+// Compile a line that starts with a sink: file:PATH, syslog:[FACILITY.]LEVEL, unix:PATH
+// or http://localhost[:PORT][/PATH], followed by the message. The message is taken as
+// written, quotes included, apart from $NAME, ${NAME} and $(date), and is filled in as
+// one word however many blanks it has. Returns false if the line doesn't start with one
+static bool SinkCompile(struct ActionCmd &a)
+{
+	const char *prefix[]={"file:","syslog:","unix:","http://",NULL};
+	const char *c=a.line, *end;
+	size_t len=strlen(a.line);
+	char *w;
+	int k;
+
+	for (k=0;prefix[k]!=NULL&&strncmp(c,prefix[k],strlen(prefix[k]))!=0;k++);
+	if (prefix[k]==NULL) return false;
+	c+=strlen(prefix[k]);
+	for (end=c;*end&&*end!=' '&&*end!='\t';end++);
+
+	// as in ActionCompile, every chunk takes at least one character and adds one NUL
+	a.words=(char *)malloc(len*2+2);
+	a.chunk=(struct ActionChunk *)malloc(sizeof(struct ActionChunk)*(len+1));
+	a.chunks=0;
+	w=a.words;
+	a.sinkpath=w;
+	memcpy(w,c,end-c);
+	w+=end-c;
+	*w++=0;
+	a.sink=SINK_FILE+k;
+	if (!SinkTarget(a)) a.sink=SINK_BAD;
+
+	for (c=end;*c==' '||*c=='\t';c++);
+	do
+	{
+		uint8_t kind=CHUNK_TEXT;
+		char *text=w;
+
+		// a $ that isn't a variable is just a $
+		if (*c!='$'||!ActionVariable(c,w,kind))
+		{
+			w=text;
+			kind=CHUNK_TEXT;
+			if (*c=='$') *w++=*c++;
+			while (*c&&*c!='$') *w++=*c++;
+			*w++=0;
+		}
+		a.chunk[a.chunks].text=text;
+		a.chunk[a.chunks].kind=kind;
+		a.chunk[a.chunks].flags=CHUNK_QUOTED|(a.chunks==0?CHUNK_WORD:0);
+		a.chunks++;
+	}
+	while (*c);
+	return true;
+}
+
+// Set an action from its config line and compile it. Returns false if the line hasn't
+// changed
+bool ActionSet(struct ActionCmd &a, const char *line)
+{
+	if (a.line!=NULL&&strcmp(a.line,line)==0) return false;
+	ActionFree(a);
+
+	a.line=(char *)malloc(strlen(line)+1);
+	strcpy(a.line,line);
+	if (SinkCompile(a)) return true;
+	if (!ActionCompile(a))
+	{
+		free(a.words);
+		free(a.chunk);
+		a.words=NULL;
+		a.chunk=NULL;
+		a.chunks=0;
+		a.redirect=0;
+		a.append=false;
+		a.shell=true;
+	}
+	return true;
+}
+
+// How an action line is run, for the log
+const char *ActionHow(struct ActionCmd &a)
+{
+	if (a.sink==SINK_BAD) return " (error: not a file, socket, syslog level or webhook on this host, ignored)";
+	if (a.shell) return " (run by /bin/sh)";
+	if (a.append||a.sink!=SINK_NONE) return " (written by the daemon)";
+	return "";
+}
+
+// An empty action with the name and priority it is logged and queued by
+void ActionInit(struct ActionCmd &a, const char *name, int priority)
+{
+	memset(&a,0,sizeof(a));
+	snprintf(a.name,sizeof(a.name),"%s",name);
+	a.priority=priority;
+}
+
+// Drop the line, keeping the name and priority
+void ActionFree(struct ActionCmd &a)
+{
+	if (a.line!=NULL) free(a.line);
+	if (a.words!=NULL) free(a.words);
+	if (a.chunk!=NULL) free(a.chunk);
+	if (a.sinkhead!=NULL) free(a.sinkhead);
+	a.line=a.words=NULL;
+	a.chunk=NULL;
+	a.chunks=0;
+	a.redirect=0;
+	a.shell=false;
+	a.append=false;
+	a.sink=SINK_NONE;
+	a.sinkpath=a.sinkhead=NULL;
+}
+
+// The value of name in envp, "" if it isn't there
+static const char *EnvGet(char **envp, const char *name)
+{
+	size_t len=strlen(name);
+
+	for (int i=0;envp[i]!=NULL;i++)
+		if (strncmp(envp[i],name,len)==0&&envp[i][len]=='=') return envp[i]+len+1;
+	return "";
+}
+
+// Fill in an action's words from the event's environment, in x, and point j at them.
+// Variables outside quotes are split into words on blanks, as the shell would. Nothing
+// is allocated. Returns false if it doesn't fit in x
+bool ActionExpand(struct ActionCmd &a, char **envp, struct ActionArgs &x, struct ActionJob &j)
+{
+	char *p=x.buf, *end=x.buf+sizeof(x.buf);
+	int argc=0;
+	bool open=false;
+
+	memset(&j,0,sizeof(j));
+	snprintf(j.name,sizeof(j.name),"%s",a.name);
+	j.priority=a.priority;
+	j.envp=envp;
+	j.redirect=a.redirect;
+	x.target=NULL;
+	if (a.shell)
+	{
+		x.argv[0]=(char *)"/bin/sh";
+		x.argv[1]=(char *)"-c";
+		x.argv[2]=a.line;
+		x.argv[3]=NULL;
+		j.argv=x.argv;
+		return true;
+	}
+
+	for (int i=0;i<a.chunks;i++)
+	{
+		struct ActionChunk &k=a.chunk[i];
+		const char *v=k.text;
+		char date[64];
+
+		if (k.flags&CHUNK_WORD&&open)
+		{
+			*p++=0;
+			open=false;
+		}
+		if (k.kind==CHUNK_VAR) v=EnvGet(envp,k.text);
+		else if (k.kind==CHUNK_DATE)
+		{
+			// date's own default format
+			time_t now=time(NULL);
+			struct tm tm;
+			strftime(date,sizeof(date),"%a %b %e %H:%M:%S %Z %Y",localtime_r(&now,&tm));
+			v=date;
+		}
+
+		for (;;)
+		{
+			bool blank=k.kind!=CHUNK_TEXT&&!(k.flags&CHUNK_QUOTED)&&(*v==' '||*v=='\t'||*v=='\n');
+
+			// a word starts with its first character, or with a quoted or literal chunk even if empty
+			if (!open&&!blank&&(*v||k.kind==CHUNK_TEXT||k.flags&CHUNK_QUOTED))
+			{
+				if (p>=end-1) return false;
+				if (k.flags&CHUNK_TARGET) x.target=p;
+				else
+				{
+					if (argc>=ACTION_ARGS-1) return false;
+					x.argv[argc++]=p;
+				}
+				open=true;
+			}
+			if (*v==0) break;
+			if (blank)
+			{
+				if (open)
+				{
+					if (p>=end-1) return false;
+					*p++=0;
+				}
+				open=false;
+			}
+			else
+			{
+				if (p>=end-1) return false;
+				*p++=*v;
+			}
+			v++;
+		}
+	}
+	if (open) *p=0;
+	x.argv[argc]=NULL;
+	if (argc==0||(a.redirect&&x.target==NULL)) return false;
+
+	j.argv=x.argv;
+	j.target=x.target;
+	return true;
+}
+
+// Connect to a webhook on this host at host:port. Connecting over loopback finishes or
+// fails at once, so it is done blocking; the socket is then made non-blocking so that a
+// webhook that stops reading can't hold up the daemon
+static int SinkConnect(const char *hostport)
+{
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+	struct sockaddr *sa;
+	socklen_t salen;
+	const char *port=strchr(hostport[0]=='['?strchr(hostport,']'):hostport,':');
+	char host[64];
+	int fd;
+
+	snprintf(host,sizeof(host),"%.*s",port!=NULL?(int)(port-hostport):63,hostport);
+	memset(&sin,0,sizeof(sin));
+	memset(&sin6,0,sizeof(sin6));
+	if (host[0]=='[')
+	{
+		sin6.sin6_family=AF_INET6;
+		sin6.sin6_addr=in6addr_loopback;
+		sin6.sin6_port=htons(port!=NULL?atoi(port+1):80);
+		sa=(struct sockaddr *)&sin6;
+		salen=sizeof(sin6);
+	}
+	else
+	{
+		sin.sin_family=AF_INET;
+		sin.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+		if (strcmp(host,"localhost")!=0&&inet_pton(AF_INET,host,&sin.sin_addr)!=1)
+		{
+			errno=EINVAL;
+			return -1;
+		}
+		sin.sin_port=htons(port!=NULL?atoi(port+1):80);
+		sa=(struct sockaddr *)&sin;
+		salen=sizeof(sin);
+	}
+
+	fd=socket(sa->sa_family,SOCK_STREAM|SOCK_CLOEXEC,0);
+	if (fd<0) return -1;
+	if (connect(fd,sa,salen)<0)
+	{
+		int err=errno;
+		close(fd);
+		errno=err;
+		return -1;
+	}
+	fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK);
+	return fd;
+}
+
+// The slot of the open file or socket of kind at path, opened now if it isn't already.
+// If all the slots are taken, the one opened first is closed. Returns -1 with errno set
+// if it can't be opened
+static int SinkOpen(struct SinkCache &sc, int kind, const char *path)
+{
+	struct sockaddr_un sun;
+	int s, fd;
+
+	for (s=0;s<sc.count;s++)
+		if (sc.fd[s].kind==kind&&strcmp(sc.fd[s].path,path)==0) return s;
+	if (strlen(path)>=sizeof(sc.fd[0].path))
+	{
+		errno=ENAMETOOLONG;
+		return -1;
+	}
+
+	if (kind==SINK_FILE) fd=open(path,O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,0644);
+	else if (kind==SINK_HTTP) fd=SinkConnect(path);
+	else
+	{
+		if (strlen(path)>=sizeof(sun.sun_path))
+		{
+			errno=ENAMETOOLONG;
+			return -1;
+		}
+		memset(&sun,0,sizeof(sun));
+		sun.sun_family=AF_UNIX;
+		memcpy(sun.sun_path,path,strlen(path)+1);
+		fd=socket(AF_UNIX,SOCK_DGRAM|SOCK_CLOEXEC,0);
+		if (fd>=0&&connect(fd,(struct sockaddr *)&sun,sizeof(sun))<0)
+		{
+			int err=errno;
+			close(fd);
+			errno=err;
+			fd=-1;
+		}
+	}
+	if (fd<0) return -1;
+
+	if (sc.count==SINK_FDS)
+	{
+		close(sc.fd[0].fd);
+		memmove(&sc.fd[0],&sc.fd[1],sizeof(sc.fd[0])*(SINK_FDS-1));
+		sc.count--;
+	}
+	s=sc.count++;
+	sc.fd[s].kind=kind;
+	sc.fd[s].fd=fd;
+	strcpy(sc.fd[s].path,path);
+	sc.fd[s].answerlen=0;
+	sc.fd[s].body=0;
+	sc.fd[s].status=0;
+	return s;
+}
+
+// Close the file or socket in slot s
+static void SinkDrop(struct SinkCache &sc, int s)
+{
+	close(sc.fd[s].fd);
+	memmove(&sc.fd[s],&sc.fd[s+1],sizeof(sc.fd[0])*(sc.count-s-1));
+	sc.count--;
+}
+
+// Take the complete header of a webhook's answer in f.answer: log a status other than
+// 2xx and work out how long the body after it is. Returns false if the next answer
+// can't be found after this one, for a body that is chunked or runs to the close
+static bool SinkStatus(struct SinkFd &f)
+{
+	const char *h=f.answer;
+
+	f.body=-1;
+	if (strncmp(h,"HTTP/1.",7)!=0||h[8]!=' '||h[9]<'1'||h[9]>'5'||h[10]<'0'||h[10]>'9'||h[11]<'0'||h[11]>'9')
+	{
+		snprintf(logme,939,"Error: webhook %s answered with something other than HTTP",f.path);
+		WriteLog(logme,1);
+		return false;
+	}
+	f.status=atoi(h+9);
+	if (f.status>=300)
+	{
+		snprintf(logme,939,"Error: webhook %s answered %d",f.path,f.status);
+		WriteLog(logme,1);
+	}
+	if (f.status<200||f.status==204||f.status==304)
+	{
+		f.body=0;
+		return true;
+	}
+	for (h=strstr(h,"\r\n")+2;*h!='\r';h=strstr(h,"\r\n")+2)
+	{
+		if (strncasecmp(h,"Transfer-Encoding:",18)==0)
+		{
+			f.body=-1;
+			break;
+		}
+		if (strncasecmp(h,"Content-Length:",15)==0) f.body=strtoll(h+15,NULL,10);
+	}
+	if (f.body<0) f.body=-1;
+	return f.body>=0;
+}
+
+// Read what a webhook has answered since the last message, logging any message it
+// didn't accept. Only the status line at the start of each answer is looked at, and
+// the body after it is skipped by its Content-Length. Returns false if it has closed
+// the connection, or the answers can't be followed
+static bool SinkAnswers(struct SinkFd &f)
+{
+	char buf[1024];
+	ssize_t n;
+
+	if (f.body<0) return false;
+	while ((n=recv(f.fd,buf,sizeof(buf),MSG_DONTWAIT))>0)
+	{
+		for (ssize_t i=0;i<n;)
+		{
+			if (f.body>0)
+			{
+				ssize_t skip=n-i<f.body?n-i:(ssize_t)f.body;
+				f.body-=skip;
+				i+=skip;
+				continue;
+			}
+			if (f.answerlen==SINK_ANSWER-1)
+			{
+				snprintf(logme,939,"Error: webhook %s answered with a header over %d bytes",f.path,SINK_ANSWER-1);
+				WriteLog(logme,1);
+				f.body=-1;
+				return false;
+			}
+			f.answer[f.answerlen++]=buf[i++];
+			if (f.answerlen>=4&&memcmp(f.answer+f.answerlen-4,"\r\n\r\n",4)==0)
+			{
+				f.answer[f.answerlen]=0;
+				f.answerlen=0;
+				if (!SinkStatus(f)) return false;
+			}
+		}
+	}
+	return n<0&&(errno==EAGAIN||errno==EWOULDBLOCK);
+}
+
+// Write iov to the file or socket of kind at path, opening it if it isn't open. A socket
+// whose server has restarted since the last message is reconnected once. A socket or
+// webhook that isn't ready for the message loses it rather than holding up the daemon.
+// Returns false, having logged why, if the message wasn't written
+static bool SinkSend(struct SinkCache &sc, int kind, const char *path, struct iovec *iov, int n, const char *name)
+{
+	struct msghdr mh;
+	ssize_t len=0, r=-1;
+	int s=-1;
+
+	for (int i=0;i<n;i++) len+=iov[i].iov_len;
+	memset(&mh,0,sizeof(mh));
+	mh.msg_iov=iov;
+	mh.msg_iovlen=n;
+
+	for (int tries=0;tries<2;tries++)
+	{
+		s=SinkOpen(sc,kind,path);
+		if (s<0) break;
+		if (kind==SINK_HTTP&&!SinkAnswers(sc.fd[s]))
+		{
+			SinkDrop(sc,s);
+			s=-1;
+			errno=ECONNRESET;
+			continue;
+		}
+		if (kind==SINK_FILE) r=writev(sc.fd[s].fd,iov,n);
+		else r=sendmsg(sc.fd[s].fd,&mh,MSG_NOSIGNAL|MSG_DONTWAIT);
+		if (r>=0||errno==EAGAIN||errno==EWOULDBLOCK) break;
+		int err=errno;
+		SinkDrop(sc,s);
+		s=-1;
+		errno=err;
+	}
+	if (r==len) return true;
+
+	if (r>=0)
+	{
+		// the rest of a request can't follow later without holding up the next one
+		snprintf(logme,939,"Error: action %s could only send %d of %d bytes to %s",name,(int)r,(int)len,path);
+		if (kind==SINK_HTTP) SinkDrop(sc,s);
+	}
+	else if (s>=0&&(errno==EAGAIN||errno==EWOULDBLOCK))
+		snprintf(logme,939,"Error: action %s dropped, %s isn't keeping up",name,path);
+	else snprintf(logme,939,"Error: action %s unable to write %s: %s",name,path,strerror(errno));
+	WriteLog(logme,1);
+	return false;
+}
+
+// Close every file and socket the actions have open. A webhook's answers are read
+// first, since closing with them unread resets the connection, and the webhook may
+// lose a message it hasn't read yet
+void SinksClose(struct SinkCache &sc)
+{
+	while (sc.count>0)
+	{
+		if (sc.fd[sc.count-1].kind==SINK_HTTP) SinkAnswers(sc.fd[sc.count-1]);
+		SinkDrop(sc,sc.count-1);
+	}
+}
+
+// echo ... >> file, done by the daemon itself in one write. A file appended to stays
+// open for the next event
+static bool ActionAppend(struct SinkCache &sc, struct ActionJob &j)
+{
+	struct iovec iov[ACTION_ARGS*2];
+	int n=0, fd;
+
+	for (int i=1;j.argv[i]!=NULL;i++)
+	{
+		if (i>1)
+		{
+			iov[n].iov_base=(void *)" ";
+			iov[n++].iov_len=1;
+		}
+		iov[n].iov_base=j.argv[i];
+		iov[n++].iov_len=strlen(j.argv[i]);
+	}
+	iov[n].iov_base=(void *)"\n";
+	iov[n++].iov_len=1;
+
+	if (j.redirect==O_APPEND) return SinkSend(sc,SINK_FILE,j.target,iov,n,j.name);
+
+	fd=open(j.target,O_WRONLY|O_CREAT|O_CLOEXEC|j.redirect,0644);
+	if (fd<0||writev(fd,iov,n)<0)
+	{
+		snprintf(logme,939,"Error: action %s unable to write %s: %s",j.name,j.target,strerror(errno));
+		WriteLog(logme,1);
+		if (fd>=0) close(fd);
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+// Send the message of an expanded file:, syslog:, unix: or http:// action. Returns false
+// if it wasn't sent
+bool SinkWrite(struct SinkCache &sc, struct ActionCmd &a, struct ActionJob &j)
+{
+	struct iovec iov[3];
+	char head[160], stamp[32];
+	const char *msg=j.argv[0];
+	size_t len=strlen(msg);
+	time_t now;
+	struct tm tm;
+	int n=0;
+
+	switch (a.sink)
+	{
+		case SINK_FILE:
+			iov[n].iov_base=(void *)msg;
+			iov[n++].iov_len=len;
+			iov[n].iov_base=(void *)"\n";
+			iov[n++].iov_len=1;
+			break;
+
+		case SINK_UNIX:
+			iov[n].iov_base=(void *)msg;
+			iov[n++].iov_len=len;
+			break;
+
+		// the traditional syslog format, which the daemon on /dev/log stamps with the host
+		case SINK_SYSLOG:
+			now=time(NULL);
+			strftime(stamp,sizeof(stamp),"%b %e %H:%M:%S",localtime_r(&now,&tm));
+			iov[n].iov_base=head;
+			iov[n++].iov_len=snprintf(head,sizeof(head),"%s%s sumpalarm[%d]: ",a.sinkhead,stamp,(int)getpid());
+			iov[n].iov_base=(void *)msg;
+			iov[n++].iov_len=len;
+			break;
+
+		case SINK_HTTP:
+			iov[n].iov_base=a.sinkhead;
+			iov[n++].iov_len=strlen(a.sinkhead);
+			iov[n].iov_base=head;
+			iov[n++].iov_len=snprintf(head,sizeof(head),"Content-Type: %s\r\nContent-Length: %d\r\nX-SumpAlarm-Action: %s\r\n\r\n",
+				*msg=='{'||*msg=='['?"application/json":"text/plain",(int)len,a.name);
+			iov[n].iov_base=(void *)msg;
+			iov[n++].iov_len=len;
+			break;
+
+		default:
+			return false;
+	}
+	return SinkSend(sc,a.sink,a.sinkpath,iov,n,a.name);
+}
+
+// Start an expanded action without waiting for it to finish; the main loop reaps it on
+// SIGCHLD. posix_spawn shares the daemon's memory until the exec (vfork) instead of
+// copying it, and a line without shell syntax is exec'ed directly, so no /bin/sh is
+// started either. The child gets the signal mask from before the daemon blocked
+// everything, and a process group of its own so a timeout can stop everything it
+// started. Returns the pid, or -1
+pid_t ActionSpawn(struct ActionJob &j)
+{
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t fa;
+	pid_t pid;
+	int err;
+
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr,&OrigSigMask);
+	posix_spawnattr_setpgroup(&attr,0);
+	posix_spawnattr_setflags(&attr,POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETPGROUP);
+	posix_spawn_file_actions_init(&fa);
+	if (j.target!=NULL) posix_spawn_file_actions_addopen(&fa,STDOUT_FILENO,j.target,O_WRONLY|O_CREAT|j.redirect,0644);
+	err=posix_spawnp(&pid,j.argv[0],&fa,&attr,j.argv,j.envp);
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+
+	if (err!=0)
+	{
+		snprintf(logme,939,"Error: unable to run action %s (%s): %s",j.name,j.argv[0],strerror(err));
+		WriteLog(logme,1);
+		return -1;
+	}
+	return pid;
+}
+
+// Run an expanded action now: written by the daemon, or spawned. Returns the pid, 0 if
+// there is no process, or -1 if it couldn't be started or written
+pid_t ActionLaunch(struct SinkCache &sc, struct ActionCmd &a, struct ActionJob &j)
+{
+	if (a.sink!=SINK_NONE) return SinkWrite(sc,a,j)?0:-1;
+	if (a.append) return ActionAppend(sc,j)?0:-1;
+	return ActionSpawn(j);
+}
+
+// Whether an action of this priority can have a slot now
+static bool ActionMayStart(struct ConfigData &cd, int priority)
+{
+	int limit=cd.actionlimit, reserve=cd.actionreserve<limit?cd.actionreserve:limit-1;
+
+	if (cd.exec.running>=limit) return false;
+	return priority>0||cd.exec.informational<limit-reserve;
+}
+
+// Spawn an action into a free slot and start its timeout
+static void ActionStart(struct ConfigData &cd, struct ActionJob &j)
+{
+	struct ActionExec &x=cd.exec;
+	int s;
+
+	for (s=0;s<ACTION_SLOTS&&x.child[s].pid!=0;s++);
+	if (s==ACTION_SLOTS) return;
+
+	pid_t pid=ActionSpawn(j);
+	if (pid<0) return;
+
+	struct ActionChild &c=x.child[s];
+	c.pid=pid;
+	strcpy(c.name,j.name);
+	c.priority=j.priority;
+	c.started=MonoMs();
+	c.stage=0;
+	if (cd.actiontimeout>0) TimerArm(cd.wheel,&c.timer,c.started+(msec_t)cd.actiontimeout*1000);
+	x.running++;
+	if (c.priority==0) x.informational++;
+}
+
+// Free what a queued job was given by ActionQueue
+static void ActionJobFree(struct ActionJob &j)
+{
+	free(j.argv);
+	free(j.envp);
+	if (j.target!=NULL) free(j.target);
+}
+
+// Start queued actions, highest priority and then oldest first, while there are slots
+void ActionDrain(struct ConfigData &cd)
+{
+	struct ActionExec &x=cd.exec;
+
+	while (x.queued>0)
+	{
+		int best=0;
+		for (int i=1;i<x.queued;i++)
+			if (x.queue[i].priority>x.queue[best].priority) best=i;
+		if (!ActionMayStart(cd,x.queue[best].priority)) break;
+
+		struct ActionJob j=x.queue[best];
+		memmove(&x.queue[best],&x.queue[best+1],sizeof(x.queue[0])*(x.queued-best-1));
+		x.queued--;
+		ActionStart(cd,j);
+		ActionJobFree(j);
+	}
+}
+
+// Log how a finished action ended and free its slot
+void ActionReaped(struct ConfigData &cd, pid_t pid, int status)
+{
+	struct ActionExec &x=cd.exec;
+	int s;
+
+	for (s=0;s<ACTION_SLOTS&&x.child[s].pid!=pid;s++);
+	if (s==ACTION_SLOTS) return;
+
+	struct ActionChild &c=x.child[s];
+	double secs=(MonoMs()-c.started)/1000.0;
+	if (WIFEXITED(status)&&WEXITSTATUS(status)==0)
+	{
+		snprintf(logme,939,"Action %s finished after %.1fs",c.name,secs);
+		WriteLog(logme,3);
+	}
+	else
+	{
+		if (WIFEXITED(status)) snprintf(logme,939,"Error: action %s exited with status %d after %.1fs",c.name,WEXITSTATUS(status),secs);
+		else snprintf(logme,939,"Error: action %s killed by signal %d after %.1fs",c.name,WTERMSIG(status),secs);
+		WriteLog(logme,1);
+	}
+
+	// whatever it started that ignored the SIGTERM goes with it
+	if (c.stage==1) kill(-c.pid,SIGKILL);
+	TimerCancel(cd.wheel,&c.timer);
+	c.pid=0;
+	x.running--;
+	if (c.priority==0) x.informational--;
+}
+
+// An action has run for ActionTimeout seconds. Ask its process group to stop, and if
+// it is still there ACTION_KILLDELAY later, kill it
+void ActionExpired(struct ConfigData &cd, struct Timer *tm)
+{
+	struct ActionChild &c=cd.exec.child[tm->id];
+
+	if (c.pid==0||c.stage>=2) return;
+	if (c.stage==0)
+	{
+		snprintf(logme,939,"Error: action %s still running after %ds, sending SIGTERM",c.name,cd.actiontimeout);
+		kill(-c.pid,SIGTERM);
+		TimerArm(cd.wheel,&c.timer,tm->expires+ACTION_KILLDELAY);
+	}
+	else
+	{
+		snprintf(logme,939,"Error: action %s ignored SIGTERM, sending SIGKILL",c.name);
+		kill(-c.pid,SIGKILL);
+	}
+	WriteLog(logme,1);
+	c.stage++;
+}
+
+// Copy of a NULL terminated array of strings that outlives it, in one allocation
+static char **StringsCopy(char **from)
+{
+	size_t n=0, len=0;
+	char **envp, *p;
+
+	for (n=0;from[n]!=NULL;n++) len+=strlen(from[n])+1;
+	envp=(char **)malloc(sizeof(char *)*(n+1)+len);
+	p=(char *)(envp+n+1);
+	for (n=0;from[n]!=NULL;n++)
+	{
+		envp[n]=p;
+		strcpy(p,from[n]);
+		p+=strlen(p)+1;
+	}
+	envp[n]=NULL;
+	return envp;
+}
+
+// Execute an action script in a separate process to avoid slow scripts interfering with
+// intended application behavior. It starts now if its priority may take a free slot,
+// otherwise it waits in the queue
+void Action(struct ConfigData &cd, struct ActionCmd &a)
+{
+	struct ActionJob j;
+
+	if (a.line==NULL) return;
+	if (Replaying!=NULL)
+	{
+		Replaying->actions++;
+		if (a.line==Replaying->ratechange) Replaying->ratechanges++;
+		if (a.line==Replaying->overdue) Replaying->overdues++;
+		// a run that measures the environment fills in the words as well, but starts nothing
+		if (Replaying->environment) ActionExpand(a,cd.env.envp,cd.args,j);
+		return;
+	}
+	#ifdef DEBUG
+	snprintf(logme,939,"Executing Action \"%s\"",a.line);
+	WriteLog(logme,3);
+	#endif
+
+	if (!ActionExpand(a,cd.env.envp,cd.args,j))
+	{
+		snprintf(logme,939,"Error: action %s is empty or too long once its variables are filled in",a.name);
+		WriteLog(logme,1);
+		return;
+	}
+	if (a.sink!=SINK_NONE)
+	{
+		SinkWrite(cd.sinks,a,j);
+		return;
+	}
+	if (a.append)
+	{
+		ActionAppend(cd.sinks,j);
+		return;
+	}
+	if (ActionMayStart(cd,j.priority))
+	{
+		ActionStart(cd,j);
+		return;
+	}
+
+	struct ActionExec &x=cd.exec;
+	if (x.queued>=cd.actionqueue)
+	{
+		// make room by dropping the oldest of the least important, unless that is this one
+		int v=-1;
+		for (int i=0;i<x.queued;i++)
+			if (v<0||x.queue[i].priority<x.queue[v].priority) v=i;
+		if (v<0||x.queue[v].priority>=a.priority)
+		{
+			snprintf(logme,939,"Error: action queue full, %s dropped",a.name);
+			WriteLog(logme,1);
+			return;
+		}
+		snprintf(logme,939,"Error: action queue full, %s dropped for %s",x.queue[v].name,a.name);
+		WriteLog(logme,1);
+		ActionJobFree(x.queue[v]);
+		memmove(&x.queue[v],&x.queue[v+1],sizeof(x.queue[0])*(x.queued-v-1));
+		x.queued--;
+	}
+
+	// the words and environment are copied, since they will have been rebuilt for another
+	// event by the time this runs
+	struct ActionJob &q=x.queue[x.queued++];
+	q=j;
+	q.argv=StringsCopy(j.argv);
+	q.envp=StringsCopy(j.envp);
+	if (j.target!=NULL)
+	{
+		q.target=(char *)malloc(strlen(j.target)+1);
+		strcpy(q.target,j.target);
+	}
+	snprintf(logme,939,"Action %s queued, %d running",a.name,x.running);
+	WriteLog(logme,3);
+}
+
+// Drop whatever is still queued at exit. Running actions are left to finish
+void ActionExecClose(struct ConfigData &cd)
+{
+	struct ActionExec &x=cd.exec;
+
+	if (x.queued>0)
+	{
+		snprintf(logme,939,"%d queued actions not run",x.queued);
+		WriteLog(logme,2);
+	}
+	for (int i=0;i<x.queued;i++) ActionJobFree(x.queue[i]);
+	x.queued=0;
+}
+
+// Defaults for everything in the config, with every switch uninitialized and no history
+void ConfigInit(struct ConfigData &cd)
+{
+	char name[16];
+
+	// sump dimensions
+	cd.sumpdepth=0;
+	cd.sumpdiameter=0;
+	cd.lowwater=0;
+	cd.highwater=0;
+
+	ActionInit(cd.ratechange,"RateChange",1);
+	cd.ratechangeamt=CHANGE_AMT;
+	cd.ratechangelimit=CHANGE_LIMIT;
+	cd.overduethreshold=0;
+	cd.overduequantile=0;
+	cd.overduefactor=1.0;
+	ActionInit(cd.overdue,"Overdue",2);
+	cd.actionlimit=ACTIONLIMIT;
+	cd.actionreserve=ACTIONRESERVE;
+	cd.actionqueue=ACTIONQUEUE;
+	cd.actiontimeout=ACTIONTIMEOUT;
+	memset(&cd.exec,0,sizeof(cd.exec));
+	memset(&cd.sinks,0,sizeof(cd.sinks));
+	EnvBegin(cd.env);
+	for (int s=0;s<ACTION_SLOTS;s++)
+	{
+		cd.exec.child[s].timer.fire=ActionExpired;
+		cd.exec.child[s].timer.id=s;
+	}
+	cd.freqhistory=FREQ_HISTORY;
+	strcpy(cd.gpiochip,GPIOCHIPDEV);
+	cd.sysfsbase=0;
+	cd.simgpio[0]=0;
+	cd.edgelatch=0;
+	cd.pinmask=0;
+	cd.statebits=0;
+	memset(&cd.inflow,0,sizeof(cd.inflow));
+	memset(&cd.pit,0,sizeof(cd.pit));
+	strcpy(cd.statefile,STATEFILE);
+	cd.statesync=STATESYNC;
+	cd.statetimer.pprev=NULL;
+	cd.statetimer.fire=StateExpired;
+	cd.statetimer.id=-1;
+	cd.state=NULL;
+	strcpy(cd.journaldir,JOURNALDIR);
+	cd.journalsegment=JOURNALSEGMENT;
+	cd.journalkeep=0;
+	cd.journalflush=JOURNALFLUSH;
+	cd.journalsync=JOURNALSYNC;
+	cd.journal.fd=-1;
+	cd.journal.idxfd=-1;
+	cd.journal.timer.pprev=NULL;
+	cd.journal.timer.fire=JournalExpired;
+	cd.journal.timer.id=-1;
+
+	// set all switches to uninitialized and initialize other variables to zero/NULL
+	for (int ID=0;ID<100;ID++)
+	{
+		cd.switchlist[ID].initialized=0;
+		// Switch0 is informational, every switch above it outranks the one below
+		snprintf(name,sizeof(name),"Switch%dOn",ID);
+		ActionInit(cd.switchlist[ID].OnAction,name,ID?ID+2:0);
+		snprintf(name,sizeof(name),"Switch%dOff",ID);
+		ActionInit(cd.switchlist[ID].OffAction,name,ID?ID+2:0);
+		cd.switchlist[ID].level=0;
+		cd.switchlist[ID].pin=0;
+		memset(&cd.switchlist[ID].freq,0,sizeof(cd.switchlist[ID].freq));
+		memset(&cd.switchlist[ID].interval,0,sizeof(cd.switchlist[ID].interval));
+		memset(&cd.switchlist[ID].onduration,0,sizeof(cd.switchlist[ID].onduration));
+		memset(&cd.switchlist[ID].sketch,0,sizeof(cd.switchlist[ID].sketch));
+		memset(cd.switchlist[ID].duty,0,sizeof(cd.switchlist[ID].duty));
+		memset(&cd.switchlist[ID].change,0,sizeof(cd.switchlist[ID].change));
+		cd.switchlist[ID].runtime=0;
+		cd.switchlist[ID].cycles=0;
+		cd.switchlist[ID].lastduration=0;
+		cd.switchlist[ID].freqhistory=0;
+		cd.switchlist[ID].lastfreq=0;
+		cd.switchlist[ID].state=0;
+		cd.switchlist[ID].LastOn=0;
+		cd.switchlist[ID].LastOff=0;
+		cd.switchlist[ID].bouncedelay=BOUNCEDELAY;
+		cd.switchlist[ID].overduetimer.pprev=NULL;
+		cd.switchlist[ID].overduetimer.fire=OverdueExpired;
+		cd.switchlist[ID].overduetimer.id=ID;
+		cd.switchlist[ID].overduenotice=false;
+	}
+}
+
+void RefreshConfig(struct ConfigData &cd, bool initial)
+{
+	static char hash[65]="";
+
+	int ID;
+	char cline[65535];
+
+	if (!initial)
+	{
+		// decide whether the config has changed
+		system("sha256sum /etc/sumpalarm.conf > ./configsum");
+		FILE *check=fopen("./configsum","r");
+		if (check==NULL) return;
+		fgets(cline,64,check);
+		cline[64]=0;
+		fclose(check);
+
+		if (strcmp(hash,cline)==0) return; // no change to config
+
+		WriteLog("Config changed",2);
+		snprintf(logme,939,"Old: %s",hash);
+		WriteLog(logme,2);
+		snprintf(logme,939,"New: %.64s",cline);
+		WriteLog(logme,2);
+		memcpy((void *)hash,(void *)cline,64);
+		hash[64]=0;
+	}
+	else
+	{
+		// remember the checksum of the config file upon first load
+		system("sha256sum /etc/sumpalarm.conf > ./configsum");
+		FILE *check=fopen("./configsum","r");
+		if (check==NULL) return;
+		fgets(cline,64,check);
+		cline[64]=0;
+		fclose(check);
+		memcpy((void *)hash,(void *)cline,64);
+		hash[64]=0;
+		WriteLog("Reading Config...",3);
+	}
+
+	FILE *conf=fopen(CONFIGFILE,"r");
+	if (conf==NULL)
+	{
+		// if the file is locked or missing, it is a problem on startup but not during execution
+		if (initial)
+		{
+			WriteLog("Unable to open config file /etc/sumpalarm.conf",1);
+			exit(1);
+		}
+		else return;
+	}
+
+	// read each line of configuration
+	while (fgets(cline,65534,conf)!=NULL)
+	{
+		trim(cline);	// remove leading or trailing whitespace from config line
+
+		// if the line is blank or if the line is a comment, move to the next line
 		if (strlen(cline)<1) continue;
 		if (cline[0]=='#') continue;
 
-		if (sa_strcmp(cline,"LogLevel")==0)
-		{
-			// remove whitespace around '=' (SumpDepth =  x --> SumpDepth=x)
-			trim(cline+8);
-			trim(cline+9);
+		if (sa_strcmp(cline,"LogLevel")==0)
+		{
+			// remove whitespace around '=' (SumpDepth =  x --> SumpDepth=x)
+			trim(cline+8);
+			trim(cline+9);
+
+			LogLevel=atoi(cline+9);
+			if (LogLevel>3||LogLevel<0) LogLevel=3;
+			snprintf(logme,939,"Logging level %d set",LogLevel);
+			WriteLog(logme,3);
+			continue;
+		}
+		if (sa_strcmp(cline,"GpioChip")==0)
+		{
+			if (!initial) continue;
+			// remove whitespace around '='
+			trim(cline+8);
+			trim(cline+9);
+
+			strncpy(cd.gpiochip,cline+9,255);
+			cd.gpiochip[255]=0;
+			snprintf(logme,939,"GpioChip set: %s",cd.gpiochip);
+			WriteLog(logme,3);
+			continue;
+		}
+		if (sa_strcmp(cline,"StateFile")==0)
+		{
+			if (!initial) continue;
+			// remove whitespace around '='
+			trim(cline+9);
+			trim(cline+10);
+
+			strncpy(cd.statefile,cline+10,255);
+			cd.statefile[255]=0;
+			snprintf(logme,939,"StateFile set: %s",cd.statefile);
+			WriteLog(logme,3);
+			continue;
+		}
+		if (sa_strcmp(cline,"StateSync")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+9);
+			trim(cline+10);
+
+			int was=cd.statesync;
+			cd.statesync=atoi(cline+10);
+			if (cd.statesync<0) cd.statesync=0;
+			snprintf(logme,939,"StateSync set to %d",cd.statesync);
+			WriteLog(logme,3);
+
+			// on a reload, the next sync is due the new interval from now rather than
+			// whenever the old interval would have fired
+			if (cd.state!=NULL&&cd.statesync!=was)
+			{
+				if (cd.statesync>0) TimerArm(cd.wheel,&cd.statetimer,MonoMs()+(msec_t)cd.statesync*1000);
+				else TimerCancel(cd.wheel,&cd.statetimer);
+			}
+			continue;
+		}
+		if (sa_strcmp(cline,"JournalDir")==0)
+		{
+			if (!initial) continue;
+			// remove whitespace around '='
+			trim(cline+10);
+			trim(cline+11);
+
+			strncpy(cd.journaldir,cline+11,255);
+			cd.journaldir[255]=0;
+			snprintf(logme,939,"JournalDir set: %s",cd.journaldir);
+			WriteLog(logme,3);
+			continue;
+		}
+		if (sa_strcmp(cline,"JournalSegment")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+14);
+			trim(cline+15);
+
+			cd.journalsegment=atoi(cline+15);
+			if (cd.journalsegment<8) cd.journalsegment=8;
+			snprintf(logme,939,"JournalSegment set to %d KB",cd.journalsegment);
+			WriteLog(logme,3);
+			continue;
+		}
+		if (sa_strcmp(cline,"JournalKeep")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+11);
+			trim(cline+12);
+
+			cd.journalkeep=atoi(cline+12);
+			if (cd.journalkeep<0) cd.journalkeep=0;
+			snprintf(logme,939,"JournalKeep set to %d",cd.journalkeep);
+			WriteLog(logme,3);
+			continue;
+		}
+		if (sa_strcmp(cline,"JournalFlush")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+12);
+			trim(cline+13);
+
+			cd.journalflush=atoi(cline+13);
+			if (cd.journalflush<0) cd.journalflush=0;
+			snprintf(logme,939,"JournalFlush set to %d",cd.journalflush);
+			WriteLog(logme,3);
+			continue;
+		}
+		if (sa_strcmp(cline,"JournalSync")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+11);
+			trim(cline+12);
+
+			cd.journalsync=atoi(cline+12);
+			if (cd.journalsync<0) cd.journalsync=0;
+			snprintf(logme,939,"JournalSync set to %d",cd.journalsync);
+			WriteLog(logme,3);
+			continue;
+		}
+		if (sa_strcmp(cline,"SysfsBase")==0)
+		{
+			if (!initial) continue;
+			// remove whitespace around '='
+			trim(cline+9);
+			trim(cline+10);
+
+			cd.sysfsbase=atoi(cline+10);
+			snprintf(logme,939,"SysfsBase set to %d",cd.sysfsbase);
+			WriteLog(logme,3);
+			continue;
+		}
+		if (sa_strcmp(cline,"SimGpio")==0)
+		{
+			if (!initial) continue;
+			// remove whitespace around '='
+			trim(cline+7);
+			trim(cline+8);
+
+			strncpy(cd.simgpio,cline+8,255);
+			cd.simgpio[255]=0;
+			snprintf(logme,939,"SimGpio set: %s",cd.simgpio);
+			WriteLog(logme,3);
+			continue;
+		}
+		if (sa_strcmp(cline,"FreqHistory")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+11);
+			trim(cline+12);
+
+			cd.freqhistory=atoi(cline+12);
+			if (cd.freqhistory<1) cd.freqhistory=1;
+			if (cd.freqhistory>FREQ_HISTORY_MAX) cd.freqhistory=FREQ_HISTORY_MAX;
+			snprintf(logme,939,"FreqHistory set to %d",cd.freqhistory);
+			WriteLog(logme,3);
+			continue;
+		}
+		if (sa_strcmp(cline,"EdgeLatch")==0)
+		{
+			if (!initial) continue;
+			// remove whitespace around '='
+			trim(cline+9);
+			trim(cline+10);
+
+			cd.edgelatch=atoi(cline+10)?1:0;
+			snprintf(logme,939,"EdgeLatch set to %d",cd.edgelatch);
+			WriteLog(logme,3);
+			continue;
+		}
+		if (sa_strcmp(cline,"LogFile")==0)
+		{
+			// remove whitespace around '=' (SumpDepth =  x --> SumpDepth=x)
+			trim(cline+7);
+			trim(cline+8);
+
+			strncpy(LogFileName,cline+8,999);
+			snprintf(logme,939,"LogFile set: %s",LogFileName);
+			WriteLog(logme,3);
+			continue;
+		}
+
+		// Sump pit sizing parameters
+		if (sa_strcmp(cline,"SumpDepth")==0)
+		{
+			if (!initial) continue; // only load action scripts if not initial load
+			// remove whitespace around '=' (SumpDepth =  x --> SumpDepth=x)
+			trim(cline+9);
+			trim(cline+10);
+
+			cd.sumpdepth=atoi(cline+10);
+			snprintf(logme,939,"SumpDepth set to %d",cd.sumpdepth);
+			WriteLog(logme,3);
+			continue;
+		}
+
+		if (sa_strcmp(cline,"SumpDiameter")==0)
+		{
+			if (!initial) continue; // only load action scripts if not initial load
+
+			// remove whitespace around '='
+			trim(cline+12);
+			trim(cline+13);
+
+			cd.sumpdiameter=atoi(cline+13);
+
+			snprintf(logme,939,"SumpDiameter set to %d",cd.sumpdiameter);
+			WriteLog(logme,3);
+
+			continue;
+		}
+		if (sa_strcmp(cline,"LowWater")==0)
+		{
+			if (!initial) continue; // only load action scripts if not initial load
+
+			// remove whitespace around '='
+			trim(cline+8);
+			trim(cline+9);
+
+			cd.lowwater=atoi(cline+9);
+			snprintf(logme,939,"LowWater set to %d",cd.lowwater);
+			WriteLog(logme,3);
+
+			continue;
+		}
+
+		if (sa_strcmp(cline,"HighWater")==0)
+		{
+			if (!initial) continue; // only load action scripts if not initial load
+
+			// remove whitespace around '='
+			trim(cline+9);
+			trim(cline+10);
+
+			cd.highwater=atoi(cline+10);
+			snprintf(logme,939,"HighWater set to %d",cd.highwater);
+			WriteLog(logme,3);
+
+			continue;
+		}
+
+		if (sa_strcmp(cline,"RateChangeAmt")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+13);
+			trim(cline+14);
+
+			cd.ratechangeamt=atoi(cline+14);
+			if (cd.ratechangeamt<=0) cd.ratechangeamt=CHANGE_AMT;
+			snprintf(logme,939,"Rate Change percentage set to %d",cd.ratechangeamt);
+			WriteLog(logme,3);
+
+			continue;
+		}
+
+		if (sa_strcmp(cline,"RateChangeLimit")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+15);
+			trim(cline+16);
+
+			cd.ratechangelimit=atof(cline+16);
+			if (cd.ratechangelimit<=0) cd.ratechangelimit=CHANGE_LIMIT;
+			snprintf(logme,939,"Rate Change limit set to %.1f",cd.ratechangelimit);
+			WriteLog(logme,3);
+
+			continue;
+		}
+
+		if (sa_strcmp(cline,"OverdueThreshold")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+16);
+			trim(cline+17);
+
+			cd.overduethreshold=atoi(cline+17);
+			snprintf(logme,939,"Overdue threshold set to %d",cd.overduethreshold);
+			WriteLog(logme,3);
+
+			continue;
+		}
+
+		if (sa_strcmp(cline,"OverdueQuantile")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+15);
+			trim(cline+16);
+
+			cd.overduequantile=atof(cline+16);
+			if (cd.overduequantile<0||cd.overduequantile>100) cd.overduequantile=0;
+			snprintf(logme,939,"Overdue quantile set to %.1f",cd.overduequantile);
+			WriteLog(logme,3);
+
+			continue;
+		}
+
+		if (sa_strcmp(cline,"OverdueFactor")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+13);
+			trim(cline+14);
+
+			cd.overduefactor=atof(cline+14);
+			if (cd.overduefactor<=0) cd.overduefactor=1.0;
+			snprintf(logme,939,"Overdue factor set to %.2f",cd.overduefactor);
+			WriteLog(logme,3);
+
+			continue;
+		}
+
+		if (sa_strcmp(cline,"RateChange")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+10);
+			trim(cline+11);
+
+			if (strlen(cline+11)<=0) continue;
+
+			if (!ActionSet(cd.ratechange,cline+11)) continue;
+			snprintf(logme,939,"Rate Change command string set: %s%s",cd.ratechange.line,ActionHow(cd.ratechange));
+			WriteLog(logme,3);
+
+			continue;
+		}
+
+		if (sa_strcmp(cline,"Overdue")==0&&sa_strcmp(cline,"OverdueT")!=0)
+		{
+			// remove whitespace around '='
+			trim(cline+7);
+			trim(cline+8);
+
+			if (strlen(cline+8)<=0) continue;
+
+			if (!ActionSet(cd.overdue,cline+8)) continue;
+			snprintf(logme,939,"Overdue command string set: %s%s",cd.overdue.line,ActionHow(cd.overdue));
+			WriteLog(logme,3);
+
+			continue;
+		}
+
+		if (sa_strcmp(cline,"ActionLimit")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+11);
+			trim(cline+12);
+
+			cd.actionlimit=atoi(cline+12);
+			if (cd.actionlimit<1) cd.actionlimit=1;
+			if (cd.actionlimit>ACTION_SLOTS) cd.actionlimit=ACTION_SLOTS;
+			snprintf(logme,939,"ActionLimit set to %d",cd.actionlimit);
+			WriteLog(logme,3);
+			continue;
+		}
+
+		if (sa_strcmp(cline,"ActionReserve")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+13);
+			trim(cline+14);
+
+			cd.actionreserve=atoi(cline+14);
+			if (cd.actionreserve<0) cd.actionreserve=0;
+			snprintf(logme,939,"ActionReserve set to %d",cd.actionreserve);
+			WriteLog(logme,3);
+			continue;
+		}
+
+		if (sa_strcmp(cline,"ActionQueue")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+11);
+			trim(cline+12);
+
+			cd.actionqueue=atoi(cline+12);
+			if (cd.actionqueue<0) cd.actionqueue=0;
+			if (cd.actionqueue>ACTION_QUEUE_MAX) cd.actionqueue=ACTION_QUEUE_MAX;
+			snprintf(logme,939,"ActionQueue set to %d",cd.actionqueue);
+			WriteLog(logme,3);
+			continue;
+		}
+
+		if (sa_strcmp(cline,"ActionTimeout")==0)
+		{
+			// remove whitespace around '='
+			trim(cline+13);
+			trim(cline+14);
+
+			cd.actiontimeout=atoi(cline+14);
+			if (cd.actiontimeout<0) cd.actiontimeout=0;
+			snprintf(logme,939,"ActionTimeout set to %d seconds",cd.actiontimeout);
+			WriteLog(logme,3);
+			continue;
+		}
+
+		if (sa_strcmp(cline,"Switch")==0)
+		{
+			// Determine ID of switch
+			if (cline[6]<'0'||cline[6]>'9')
+				continue; // Invalid (non numeric) switch ID
+			ID=cline[6]-'0';
+			if (cline[7]>='0'&&cline[7]<='9')
+				ID=ID*10+(cline[7]-'0'); // 2-digit switch ID
+
+			int digits=1; // note the number of digits in the Switch ID for parsing
+			if (ID>9)digits=2;
+
+			// determine which parameter of the switch is being set
+			if (sa_strcmp(cline+6+digits,"Level")==0)
+			{
+				trim(cline+11+digits);
+				trim(cline+12+digits);
+				cd.switchlist[ID].level=atoi(cline+12+digits);
+				snprintf(logme,939,"Switch %d Level set: %d",ID,cd.switchlist[ID].level);
+				WriteLog(logme,3);
+				continue;
+			}
+
+			if (sa_strcmp(cline+6+digits,"Pin")==0)
+			{
+				if (!initial) continue;
+				trim(cline+9+digits);
+				trim(cline+10+digits);
+				cd.switchlist[ID].pin=atoi(cline+10+digits);
+
+				// validate value
+				if (cd.switchlist[ID].pin>0&&cd.switchlist[ID].pin<GPIO_PINS&&(cd.pinmask&((uint64_t)1<<cd.switchlist[ID].pin))==0)
+				{
+					// a switch is only considered initialized when a Pin number has been set
+					cd.switchlist[ID].initialized=1;
+					cd.pinmask|=(uint64_t)1<<cd.switchlist[ID].pin;
+					cd.pinswitch[cd.switchlist[ID].pin]=ID;
+					snprintf(logme,939,"Switch %d Pin set: %d",ID,cd.switchlist[ID].pin);
+					WriteLog(logme,3);
+					continue;
+				}
+				else
+				{
+					snprintf(logme,939,"Switch%d GPIO PIN invalid or already in use",ID);
+					WriteLog(logme,1);
+					exit(1);
+				}
+			}
+
+			if (sa_strcmp(cline+6+digits,"FreqHistory")==0)
+			{
+				trim(cline+17+digits);
+				trim(cline+18+digits);
+				cd.switchlist[ID].freqhistory=atoi(cline+18+digits);
+				if (cd.switchlist[ID].freqhistory<1) cd.switchlist[ID].freqhistory=1;
+				if (cd.switchlist[ID].freqhistory>FREQ_HISTORY_MAX) cd.switchlist[ID].freqhistory=FREQ_HISTORY_MAX;
+				snprintf(logme,939,"Switch %d FreqHistory set: %d",ID,cd.switchlist[ID].freqhistory);
+				WriteLog(logme,3);
+				continue;
+			}
+
+			if (sa_strcmp(cline+6+digits,"Bounce")==0)
+			{
+				trim(cline+12+digits);
+				trim(cline+13+digits);
+				// seconds, fractions allowed
+				cd.switchlist[ID].bouncedelay=(msec_t)(atof(cline+13+digits)*1000.0);
+				snprintf(logme,939,"Switch %d Bounce Delay set: %d ms",ID,(int)cd.switchlist[ID].bouncedelay);
+				continue;
+			}
+
+			if (sa_strcmp(cline+6+digits,"On")==0)
+			{
+				trim(cline+8+digits);
+				trim(cline+9+digits);
+
+				if (strlen(cline+9)<=0) continue;
+
+				if (!ActionSet(cd.switchlist[ID].OnAction,cline+9+digits)) continue;
+				snprintf(logme,939,"Switch %d On Action set: %s%s",ID,cd.switchlist[ID].OnAction.line,
+					ActionHow(cd.switchlist[ID].OnAction));
+				WriteLog(logme,3);
+
+				continue;
+			}
+
+			if (sa_strcmp(cline+6+digits,"Off")==0)
+			{
+				trim(cline+9+digits);
+				trim(cline+10+digits);
+
+				if (strlen(cline+10)<=0) continue;
+
+				if (!ActionSet(cd.switchlist[ID].OffAction,cline+10+digits)) continue;
+				snprintf(logme,939,"Switch %d Off Action set: %s%s",ID,cd.switchlist[ID].OffAction.line,
+					ActionHow(cd.switchlist[ID].OffAction));
+				WriteLog(logme,3);
+				continue;
+			}
+		}
+	}
+
+	fclose(conf);
+
+	PitInit(cd);
+	snprintf(logme,939,"Capacity set to %d Litres",(int)(cd.pit.capacity/1000));
+	WriteLog(logme,3);
+
+	// size the frequency histories, keeping what has been recorded so far
+	for (ID=0;ID<100;ID++)
+		HistoryResize(cd.switchlist[ID].freq,cd.switchlist[ID].freqhistory?cd.switchlist[ID].freqhistory:cd.freqhistory);
+}
+
+// Whether WriteLog would put an entry of this level anywhere
+bool LogWanted(int level)
+{
+	return Replaying==NULL&&(verbose||level<=LogLevel);
+}
+
+// Write a log entry to file or to the console if running verbose
+void WriteLog(const char *entry,int level)
+{
+	if (Replaying!=NULL) return;
+
+	time_t lt;
+	time(&lt);
+	char logtime[40],logentry[1000];
+	strftime(logtime, 39, "%Y-%m-%d %T", localtime(&lt));
+	snprintf(logentry,999,"%s,\"%s\"\n",logtime,entry);
+
+	if (!verbose&&level<=LogLevel)
+	{
+		FILE *logfile=fopen(LogFileName,"a");
+		if (logfile==NULL) return;
+		fputs(logentry,logfile);
+		fclose(logfile);
+	}
+	else fputs(logentry,stdout);
+}
+// Deterministic generator for the synthetic benchmark traces (splitmix64)
+static double BenchRandom(uint64_t &seed)
+{
+	uint64_t z=(seed+=0x9e3779b97f4a7c15ULL);
+	z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+	z=(z^(z>>27))*0x94d049bb133111ebULL;
+	z^=z>>31;
+	return ((z>>11)+0.5)/9007199254740992.0;	// (0,1)
+}
+
+// Standard normal deviate
+static double BenchNormal(uint64_t &seed)
+{
+	double u=BenchRandom(seed), v=BenchRandom(seed);
+	return sqrt(-2.0*log(u))*cos(2*3.14159265358979*v);
+}
+
+// Tally of one detector over a set of traces
+struct BenchScore
+{
+	int64_t samples;
+	int changes;			// true change points
+	int detected;
+	int64_t delay;			// total intervals from change point to detection
+	int falsealarms;
+	double ns;				// time spent in the detector
+};
+
+// Score the alarms of one trace. An alarm is a detection if it is the first one within
+// window intervals of a true change point that hasn't been detected yet, otherwise it
+// is a false alarm
+static void BenchScoreTrace(struct BenchScore &sc, const bool *mark, const bool *alarm, int n, int window)
+{
+	int last=-1;
+	bool found=false;
+
+	for (int i=0;i<n;i++)
+	{
+		if (mark[i])
+		{
+			sc.changes++;
+			last=i;
+			found=false;
+		}
+		if (!alarm[i]) continue;
+		if (last>=0&&!found&&i-last<=window)
+		{
+			sc.detected++;
+			sc.delay+=i-last;
+			found=true;
+		}
+		else sc.falsealarms++;
+	}
+	sc.samples+=n;
+}
+
+// Run the fixed-percentage ratio test the daemon used before the change detector, as
+// a baseline: alarm when the running average moves amt percent from the last report
+static void BenchRatio(struct BenchScore &sc, const msec_t *iv, const bool *mark, bool *alarm, int n, int depth, int amt, int window)
+{
+	struct FreqHistory h;
+	msec_t last=0;
+	struct timespec t0, t1;
+
+	memset(&h,0,sizeof(h));
+	HistoryResize(h,depth);
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	for (int i=0;i<n;i++)
+	{
+		HistoryAdd(h,iv[i]);
+		msec_t f=h.sum/h.count;
+		alarm[i]=false;
+		if (last==0)
+		{
+			if (h.count==h.depth) last=f;
+			continue;
+		}
+		double rat=(double)last/(double)f;
+		if (rat>(1.0+amt/100.0)||rat<(1.0-amt/100.0))
+		{
+			alarm[i]=true;
+			last=f;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	sc.ns+=(t1.tv_sec-t0.tv_sec)*1e9+(t1.tv_nsec-t0.tv_nsec);
+	free(h.buf);
+	BenchScoreTrace(sc,mark,alarm,n,window);
+}
+
+static void BenchCusum(struct BenchScore &sc, const msec_t *iv, const bool *mark, bool *alarm, int n, int warmup, int amt, double limit, int window)
+{
+	struct ChangeDetector cp;
+	struct timespec t0, t1;
+	double shift=log(1.0+amt/100.0);
+
+	memset(&cp,0,sizeof(cp));
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	for (int i=0;i<n;i++)
+	{
+		int change=ChangeAdd(cp,iv[i],warmup,shift,limit);
+		alarm[i]=change==CHANGE_SLOWER||change==CHANGE_FASTER;
+	}
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	sc.ns+=(t1.tv_sec-t0.tv_sec)*1e9+(t1.tv_nsec-t0.tv_nsec);
+	BenchScoreTrace(sc,mark,alarm,n,window);
+}
+
+static void BenchReport(const char *name, struct BenchScore &sc)
+{
+	printf("%-8s %8lld %8d %8d %8d %10.1f %8d %10.2f %8.1f\n",name,(long long)sc.samples,sc.changes,sc.detected,
+		sc.changes-sc.detected,sc.detected?(double)sc.delay/sc.detected:0.0,sc.falsealarms,
+		sc.samples?sc.falsealarms*1000.0/sc.samples:0.0,sc.samples?sc.ns/sc.samples:0.0);
+}
+
+// sumpalarm ratebench [-a percent] [-l limit] [-w warmup] [-d depth] [trace ...]
+// Replay Switch0 interval traces through the old ratio test (over a history of depth
+// intervals) and the change detector
+// and report detection delay and false alarm rate for each. A trace has one interval
+// in seconds per line, optionally followed by 1 on the lines where the true inflow
+// rate changed; lines starting with # are skipped. Without traces a reproducible set
+// of synthetic ones (log-normal jitter around step changes of 25% to 100%) is used
+int RateBench(int argc, char **argv)
+{
+	int amt=CHANGE_AMT, depth=FREQ_HISTORY, warmup=CHANGE_WARMUP_MIN, window=50, ntrace=0, n, a;
+	double limit=CHANGE_LIMIT;
+	struct BenchScore ratio, cusum;
+	msec_t *iv=(msec_t *)malloc(sizeof(msec_t)*1000000);
+	bool *mark=(bool *)malloc(1000000), *alarm=(bool *)malloc(1000000);
+
+	memset(&ratio,0,sizeof(ratio));
+	memset(&cusum,0,sizeof(cusum));
+	for (a=0;a<argc;a++)
+	{
+		if (strcmp(argv[a],"-a")==0&&a+1<argc) amt=atoi(argv[++a]);
+		else if (strcmp(argv[a],"-l")==0&&a+1<argc) limit=atof(argv[++a]);
+		else if (strcmp(argv[a],"-d")==0&&a+1<argc) depth=atoi(argv[++a])>0?atoi(argv[a]):1;
+		else if (strcmp(argv[a],"-w")==0&&a+1<argc)
+		{
+			warmup=atoi(argv[++a]);
+			if (warmup<CHANGE_WARMUP_MIN) warmup=CHANGE_WARMUP_MIN;
+		}
+		else
+		{
+			FILE *f=fopen(argv[a],"r");
+			char line[200];
+
+			if (f==NULL)
+			{
+				printf("Unable to open %s\n",argv[a]);
+				return 1;
+			}
+			for (n=0;n<1000000&&fgets(line,sizeof(line),f)!=NULL;)
+			{
+				double sec;
+				int m=0;
+
+				if (line[0]=='#'||sscanf(line,"%lf %d",&sec,&m)<1) continue;
+				iv[n]=(msec_t)(sec*1000);
+				mark[n++]=m!=0;
+			}
+			fclose(f);
+			BenchRatio(ratio,iv,mark,alarm,n,depth,amt,window);
+			BenchCusum(cusum,iv,mark,alarm,n,warmup,amt,limit,window);
+			ntrace++;
+		}
+	}
+	if (ntrace==0)
+	{
+		uint64_t seed=2017;
+
+		for (ntrace=0;ntrace<50;ntrace++)
+		{
+			double base=log(120000+BenchRandom(seed)*1680000);	// 2 to 30 minutes
+			double jitter=0.05+BenchRandom(seed)*0.15;
+			int next=100+(int)(BenchRandom(seed)*300);
+
+			for (n=0;n<5000;n++)
+			{
+				mark[n]=false;
+				if (n==next)
+				{
+					double step=log(1.25+BenchRandom(seed)*0.75);
+					base+=BenchRandom(seed)<0.5?step:-step;
+					if (base<log(60000.0)||base>log(7200000.0)) base-=2*(base-log(600000.0))/3;
+					mark[n]=true;
+					next+=100+(int)(BenchRandom(seed)*300);
+				}
+				iv[n]=(msec_t)exp(base+jitter*BenchNormal(seed));
+			}
+			BenchRatio(ratio,iv,mark,alarm,n,depth,amt,window);
+			BenchCusum(cusum,iv,mark,alarm,n,warmup,amt,limit,window);
+		}
+	}
+
+	printf("%d traces, change %d%%, limit %.1f, warm-up %d, ratio depth %d, detection window %d intervals\n",ntrace,amt,limit,warmup,depth,window);
+	printf("%-8s %8s %8s %8s %8s %10s %8s %10s %8s\n","detector","samples","changes","detected","missed","mean delay","false","false/1k","ns/int");
+	BenchReport("ratio",ratio);
+	BenchReport("cusum",cusum);
+
+	free(iv);
+	free(mark);
+	free(alarm);
+	return 0;
+}
+
+// Parse a query time: now, -N followed by m, h, d or w for that long ago, or a local
+// date and time as YYYY-MM-DD[ HH:MM[:SS]] (a T may separate them)
+static bool QueryTime(const char *arg, int64_t &ms)
+{
+	const char *formats[]={"%Y-%m-%d %H:%M:%S","%Y-%m-%dT%H:%M:%S","%Y-%m-%d %H:%M","%Y-%m-%dT%H:%M","%Y-%m-%d"};
+	struct tm tm;
+
+	if (strcmp(arg,"now")==0)
+	{
+		ms=WallMs();
+		return true;
+	}
+	if (arg[0]=='-')
+	{
+		char *end;
+		long n=strtol(arg+1,&end,10);
+		int64_t unit=*end=='m'?60000:*end=='h'?3600000:*end=='d'?86400000:*end=='w'?604800000:0;
+		if (unit==0||end[1]!=0) return false;
+		ms=WallMs()-n*unit;
+		return true;
+	}
+	for (unsigned i=0;i<sizeof(formats)/sizeof(formats[0]);i++)
+	{
+		memset(&tm,0,sizeof(tm));
+		const char *end=strptime(arg,formats[i],&tm);
+		if (end==NULL||*end!=0) continue;
+		tm.tm_isdst=-1;
+		ms=(int64_t)mktime(&tm)*1000;
+		return true;
+	}
+	return false;
+}
+
+static void QueryStamp(int64_t ms, char *buf)
+{
+	time_t sec=ms/1000;
+	char t[40];
+	strftime(t,39,"%Y-%m-%d %T",localtime(&sec));
+	snprintf(buf,59,"%s.%03d",t,(int)(ms%1000));
+}
+
+// Segment numbers of the journal in dirname, in order. -1 if it can't be read. Only
+// the segments themselves are listed, so an index left without one is never read
+static int JournalSegments(const char *dirname, uint32_t *seq, int max)
+{
+	DIR *dir=opendir(dirname);
+	struct dirent *de;
+	int nseg=0;
+
+	if (dir==NULL) return -1;
+	while ((de=readdir(dir))!=NULL&&nseg<max)
+	{
+		uint32_t n;
+		int len;
+		if (sscanf(de->d_name,"journal.%u%n",&n,&len)==1&&de->d_name[len]==0) seq[nseg++]=n;
+	}
+	closedir(dir);
+	for (int i=1;i<nseg;i++)
+		for (int j=i;j>0&&seq[j-1]>seq[j];j--)
+		{
+			uint32_t x=seq[j];
+			seq[j]=seq[j-1];
+			seq[j-1]=x;
+		}
+	return nseg;
+}
+
+// Per-hour totals of one switch
+struct QueryHour
+{
+	int cycles;				// On edges
+	int64_t ontime;			// ms on, from the Off edges
+	int64_t interval;		// total of the intervals on the On edges
+	int intervals;
+	int64_t rate;			// total of the rates recorded
+	int rates;
+};
+
+static void QueryHourPrint(int64_t hour, struct QueryHour *h)
+{
+	char stamp[60];
+
+	for (int ID=0;ID<100;ID++)
+	{
+		if (h[ID].cycles==0&&h[ID].ontime==0) continue;
+		QueryStamp(hour,stamp);
+		stamp[16]=0;	// minutes are always 00
+		printf("%s,Switch%d,%d,%.1f,%.1f,%.1f\n",stamp,ID,h[ID].cycles,h[ID].ontime/1000.0,
+			h[ID].intervals?h[ID].interval/1000.0/h[ID].intervals:0.0,h[ID].rates?h[ID].rate/1000.0/h[ID].rates:0.0);
+	}
+	memset(h,0,sizeof(struct QueryHour)*100);
+}
+
+// Called with each record a journal read turns up
+typedef void (*JournalEach)(void *ctx, const struct JournalRecord &rec);
+
+// Hand the records of the journal in dirname stamped from from to to (wall ms) to each,
+// in order, only those of switch sw if it isn't -1. With indexed, the segment indexes
+// are used to skip what comes before from; without, every segment is read from the
+// start. Counts the records handed over in matched. Returns the number of records read,
+// or -1 if dirname can't be opened
+static int64_t JournalRead(const char *dirname, int64_t from, int64_t to, int sw, bool indexed, JournalEach each, void *ctx, int64_t &matched)
+{
+	uint32_t seq[4096];
+	int64_t first[4096];
+	int64_t scanned=0;
+	char path[512];
+
+	matched=0;
+	int nseg=JournalSegments(dirname,seq,4096);
+	if (nseg<0) return -1;
+
+	// start time of each segment from its index, or -1 if it has none
+	for (int i=0;i<nseg;i++)
+	{
+		struct JournalIndexHeader ih;
+		struct JournalIndexEntry e;
+
+		first[i]=-1;
+		if (!indexed) continue;
+		snprintf(path,511,"%s/journal.%08u.idx",dirname,seq[i]);
+		int fd=open(path,O_RDONLY);
+		if (fd<0) continue;
+		if (read(fd,&ih,sizeof(ih))==sizeof(ih)&&ih.magic==JOURNAL_INDEX_MAGIC&&ih.seq==seq[i]&&
+			read(fd,&e,sizeof(e))==sizeof(e)) first[i]=e.wall;
+		close(fd);
+	}
+
+	for (int i=0;i<nseg;i++)
+	{
+		// skip segments that end before the range (the next one starts before it) or
+		// start after it
+		if (i+1<nseg&&first[i+1]>=0&&first[i+1]<from) continue;
+		if (first[i]>to) break;
+
+		snprintf(path,511,"%s/journal.%08u",dirname,seq[i]);
+		int fd=open(path,O_RDONLY);
+		struct stat st;
+		if (fd<0||fstat(fd,&st)<0||st.st_size<(off_t)sizeof(struct JournalSegment))
+		{
+			if (fd>=0) close(fd);
+			continue;
+		}
+		const uint8_t *p=(const uint8_t *)mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+		close(fd);
+		if (p==MAP_FAILED) continue;
+		const struct JournalSegment *sh=(const struct JournalSegment *)p;
+		off_t off=sizeof(struct JournalSegment);
+		if (sh->magic!=JOURNAL_MAGIC||sh->recsize!=sizeof(struct JournalRecord))
+		{
+			munmap((void *)p,st.st_size);
+			continue;
+		}
+
+		// binary search the index for the last block starting at or before from
+		snprintf(path,511,"%s/journal.%08u.idx",dirname,seq[i]);
+		fd=indexed?open(path,O_RDONLY):-1;
+		struct stat ist;
+		if (fd>=0&&fstat(fd,&ist)==0&&ist.st_size>(off_t)sizeof(struct JournalIndexHeader))
+		{
+			const uint8_t *ip=(const uint8_t *)mmap(NULL,ist.st_size,PROT_READ,MAP_SHARED,fd,0);
+			if (ip!=MAP_FAILED)
+			{
+				const struct JournalIndexEntry *e=(const struct JournalIndexEntry *)(ip+sizeof(struct JournalIndexHeader));
+				int lo=0, hi=(ist.st_size-sizeof(struct JournalIndexHeader))/sizeof(struct JournalIndexEntry)-1;
+				while (lo<hi)
+				{
+					int mid=(lo+hi+1)/2;
+					if (e[mid].wall<=from) lo=mid;
+					else hi=mid-1;
+				}
+				if (e[lo].wall<=from&&e[lo].offset>=off&&e[lo].offset<st.st_size) off=e[lo].offset;
+				munmap((void *)ip,ist.st_size);
+			}
+		}
+		if (fd>=0) close(fd);
+
+		bool done=false;
+		while (!done&&off+(off_t)JournalBlockSize(0)<=st.st_size)
+		{
+			const struct JournalBlock *b=(const struct JournalBlock *)(p+off);
+			if (b->magic!=JOURNAL_BLOCK_MAGIC||b->count>JOURNAL_BLOCK||off+(off_t)JournalBlockSize(b->count)>st.st_size||
+				b->crc!=Crc32(b->rec,b->count*sizeof(struct JournalRecord))) break;
+			for (int r=0;r<b->count;r++)
+			{
+				const struct JournalRecord &rec=b->rec[r];
+				scanned++;
+				if (rec.wall<from) continue;
+				if (rec.wall>to)
+				{
+					done=true;
+					break;
+				}
+				if (sw>=0&&rec.id!=sw) continue;
+				if (rec.id>=100) continue;
+				matched++;
+				each(ctx,rec);
+			}
+			off+=JournalBlockSize(b->count);
+		}
+		munmap((void *)p,st.st_size);
+		if (done) break;
+	}
+	return scanned;
+}
+
+// What query prints as it goes: each record, or the totals of each hour
+struct QueryRun
+{
+	bool hourly;
+	struct QueryHour *hours;	// of the hour being added up, per switch
+	int64_t hour;			// start of it, -1 before the first record
+};
+
+static void QueryRecord(void *ctx, const struct JournalRecord &rec)
+{
+	struct QueryRun &q=*(struct QueryRun *)ctx;
+	char stamp[60];
+
+	if (!q.hourly)
+	{
+		QueryStamp(rec.wall,stamp);
+		printf("%s,Switch%d,%s,%.1f,%.1f\n",stamp,rec.id,rec.edge?"On":"Off",rec.duration/1000.0,rec.rate/1000.0);
+		return;
+	}
+
+	// hours are on the local clock, like the log. The calendar is only consulted
+	// when a record falls outside the current hour
+	if (rec.wall<q.hour||rec.wall>=q.hour+3600000)
+	{
+		time_t sec=rec.wall/1000;
+		struct tm tm=*localtime(&sec);
+		tm.tm_min=0;
+		tm.tm_sec=0;
+		if (q.hour>=0) QueryHourPrint(q.hour,q.hours);
+		q.hour=(int64_t)mktime(&tm)*1000;
+	}
+	struct QueryHour &qh=q.hours[rec.id];
+	if (rec.edge)
+	{
+		qh.cycles++;
+		if (rec.duration>0)
+		{
+			qh.interval+=rec.duration;
+			qh.intervals++;
+		}
+	}
+	else qh.ontime+=rec.duration;
+	if (rec.rate>0)
+	{
+		qh.rate+=rec.rate;
+		qh.rates++;
+	}
+}
+
+// sumpalarm query [-d dir] [-s switch] [-H] from [to]
+// Stream the journalled transitions between two times, or per-hour totals with -H.
+// Segments are chosen by the first entry of their index, the start of the range is
+// found by a binary search of the index, and the blocks are read straight out of a
+// mapping of the segment, so only the part of the history that is asked for is read
+int Query(int argc, char **argv)
+{
+	const char *dirname=JOURNALDIR;
+	int sw=-1, a;
+	int64_t from=-1, to=-1, matched, scanned;
+	struct QueryRun q;
+	struct timespec t0, t1;
+
+	q.hourly=false;
+	for (a=0;a<argc;a++)
+	{
+		if (strcmp(argv[a],"-d")==0&&a+1<argc) dirname=argv[++a];
+		else if (strcmp(argv[a],"-s")==0&&a+1<argc) sw=atoi(argv[++a]);
+		else if (strcmp(argv[a],"-H")==0) q.hourly=true;
+		else if (from<0&&QueryTime(argv[a],from)) continue;
+		else if (to<0&&QueryTime(argv[a],to)) continue;
+		else
+		{
+			printf("Usage: sumpalarm query [-d dir] [-s switch] [-H] from [to]\n");
+			printf("Times are now, -N[m|h|d|w], or YYYY-MM-DD[ HH:MM[:SS]]\n");
+			return 1;
+		}
+	}
+	if (from<0)
+	{
+		printf("Usage: sumpalarm query [-d dir] [-s switch] [-H] from [to]\n");
+		return 1;
+	}
+	if (to<0) to=WallMs();
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+
+	q.hours=(struct QueryHour *)calloc(100,sizeof(struct QueryHour));
+	q.hour=-1;
+	if (q.hourly) printf("hour,switch,cycles,on seconds,mean interval,mean rate L/h\n");
+	scanned=JournalRead(dirname,from,to,sw,true,QueryRecord,&q,matched);
+	if (scanned<0)
+	{
+		printf("Unable to open %s\n",dirname);
+		free(q.hours);
+		return 1;
+	}
+	if (q.hourly&&q.hour>=0) QueryHourPrint(q.hour,q.hours);
+	free(q.hours);
+
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	fprintf(stderr,"%lld transitions matched, %lld read, in %.2f ms\n",(long long)matched,(long long)scanned,
+		(t1.tv_sec-t0.tv_sec)*1e3+(t1.tv_nsec-t0.tv_nsec)/1e6);
+	return 0;
+}
+
+// Totals of one switch over one calendar month, the unit analyze reports in
+struct AnalyzeMonth
+{
+	int32_t month;			// year*12 + month-1, on the local calendar
+	int32_t sw;
+	uint32_t days;			// bit for every day of the month with an edge on any switch
+	int64_t cycles;			// On edges
+	msec_t ontime;
+	msec_t longest;			// longest time on
+	msec_t shortest;		// shortest time between On edges, 0 if none is known. Gives the peak inflow
+};
+
+// The edges of one switch at either end of a chunk. The interval or run that straddles
+// two chunks is only known once they are merged
+struct AnalyzeEdges
+{
+	int64_t headon;			// first On, if the time since the previous On wasn't recorded, else -1
+	int64_t headoff;		// first edge was an Off with no recorded length, else -1
+	int64_t tailon;			// last On, -1 if none
+	bool tailopen;			// the last edge was an On
+	bool seen;
+};
+
+// What one chunk or a whole source adds up to. Times are local calendar ms since
+// 1970-01-01 00:00, so months and days fall where the log says they do
+struct AnalyzePartial
+{
+	struct AnalyzeMonth *month;
+	int months, cap;
+	struct AnalyzeEdges edge[100];
+	int64_t events;
+	int64_t dayfrom, dayto;	// the day the last event fell on, and its month and day of the month
+	int32_t key, mday;
+	int64_t tzfrom, tzto, tzoff;	// UTC offset of wall clock times in [tzfrom,tzto)
+};
+
+// A byte range of one mapped journal segment or log file. Chunks of a source are
+// consecutive and in time order
+struct AnalyzeChunk
+{
+	int source;
+	bool journal;
+	const uint8_t *p;
+	size_t len;				// of the mapping
+	size_t from, to;
+	struct AnalyzePartial part;
+};
+
+struct AnalyzeSource
+{
+	char name[512];
+	int first, last;		// its chunks
+	struct AnalyzePartial total;
+};
+
+// Chunks queued for one worker. It works forward from head while idle workers steal
+// from tail, the far end of its share
+struct AnalyzeQueue
+{
+	pthread_mutex_t lock;
+	int head, tail;
+};
+
+struct AnalyzeRun
+{
+	struct AnalyzeSource source[64];
+	int sources;
+	struct AnalyzeChunk *chunk;
+	int chunks, cap;
+	struct AnalyzeQueue *queue;
+	int threads;
+	int64_t stolen;
+	void *map[4096];		// mappings to release
+	size_t maplen[4096];
+	int maps;
+};
+
+struct AnalyzeWorkerArg
+{
+	struct AnalyzeRun *run;
+	int id;
+	int64_t stolen;
+};
+
+static void AnalyzeReset(struct AnalyzePartial &p)
+{
+	free(p.month);
+	memset(&p,0,sizeof(p));
+	for (int ID=0;ID<100;ID++)
+	{
+		p.edge[ID].headon=-1;
+		p.edge[ID].headoff=-1;
+		p.edge[ID].tailon=-1;
+	}
+	p.dayto=INT64_MIN;
+	p.tzto=INT64_MIN;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date, and back again
+static int64_t AnalyzeDays(int y, int m, int d)
+{
+	y-=m<=2;
+	int64_t era=(y>=0?y:y-399)/400;
+	int64_t yoe=y-era*400;
+	int64_t doy=(153*(m>2?m-3:m+9)+2)/5+d-1;
+	return era*146097+yoe*365+yoe/4-yoe/100+doy-719468;
+}
+
+static void AnalyzeDate(int64_t days, int &y, int &m, int &d)
+{
+	int64_t z=days+719468;
+	int64_t era=(z>=0?z:z-146096)/146097;
+	int64_t doe=z-era*146097;
+	int64_t yoe=(doe-doe/1460+doe/36524-doe/146096)/365;
+	int64_t doy=doe-(365*yoe+yoe/4-yoe/100);
+	int64_t mp=(5*doy+2)/153;
+	d=doy-(153*mp+2)/5+1;
+	m=mp<10?mp+3:mp-9;
+	y=yoe+era*400+(m<=2);
+}
+
+// Local calendar time of a wall clock ms. The offset only changes on the quarter hour,
+// so the time zone is consulted once per quarter hour of history at most
+static int64_t AnalyzeLocal(struct AnalyzePartial &p, int64_t wall)
+{
+	if (wall<p.tzfrom||wall>=p.tzto)
+	{
+		time_t sec=wall/1000;
+		struct tm tm;
+
+		localtime_r(&sec,&tm);
+		p.tzfrom=wall-wall%900000;
+		p.tzto=p.tzfrom+900000;
+		p.tzoff=(int64_t)tm.tm_gmtoff*1000;
+	}
+	return wall+p.tzoff;
+}
+
+static struct AnalyzeMonth &AnalyzeFind(struct AnalyzePartial &p, int32_t key, int sw)
+{
+	// events come in time order, so the month is almost always one of the last few
+	for (int i=p.months-1;i>=0;i--)
+		if (p.month[i].month==key&&p.month[i].sw==sw) return p.month[i];
+	if (p.months==p.cap)
+	{
+		p.cap=p.cap?p.cap*2:64;
+		p.month=(struct AnalyzeMonth *)realloc(p.month,p.cap*sizeof(struct AnalyzeMonth));
+	}
+	struct AnalyzeMonth &m=p.month[p.months++];
+	memset(&m,0,sizeof(m));
+	m.month=key;
+	m.sw=sw;
+	return m;
+}
+
+// Month totals of switch sw for local time t, marking the day as covered
+static struct AnalyzeMonth &AnalyzeAt(struct AnalyzePartial &p, int64_t t, int sw)
+{
+	if (t<p.dayfrom||t>=p.dayto)
+	{
+		int64_t day=(t>=0?t:t-86399999)/86400000;
+		int y, m, d;
+
+		AnalyzeDate(day,y,m,d);
+		p.dayfrom=day*86400000;
+		p.dayto=p.dayfrom+86400000;
+		p.key=y*12+m-1;
+		p.mday=d;
+	}
+	struct AnalyzeMonth &m=AnalyzeFind(p,p.key,sw);
+	m.days|=1u<<(p.mday-1);
+	return m;
+}
+
+static inline void AnalyzeInterval(struct AnalyzeMonth &m, msec_t interval)
+{
+	if (m.shortest==0||interval<m.shortest) m.shortest=interval;
+}
+
+static inline void AnalyzeOn(struct AnalyzeMonth &m, msec_t duration)
+{
+	m.ontime+=duration;
+	if (duration>m.longest) m.longest=duration;
+}
+
+// One switch edge at local time t. duration is the time since the last On (On) or the
+// time on (Off) if the source recorded it, else 0 and it is worked out from the edges
+static void AnalyzeEvent(struct AnalyzePartial &p, int sw, int edge, int64_t t, msec_t duration)
+{
+	struct AnalyzeEdges &e=p.edge[sw];
+	struct AnalyzeMonth &m=AnalyzeAt(p,t,sw);
+
+	p.events++;
+	if (edge)
+	{
+		m.cycles++;
+		if (duration<=0&&e.tailon>=0) duration=t-e.tailon;
+		if (duration>0) AnalyzeInterval(m,duration);
+		else if (e.tailon<0) e.headon=t;
+		e.tailon=t;
+		e.tailopen=true;
+	}
+	else
+	{
+		if (duration<=0&&e.tailopen) duration=t-e.tailon;
+		if (duration>0) AnalyzeOn(m,duration);
+		else if (!e.seen) e.headoff=t;
+		e.tailopen=false;
+	}
+	e.seen=true;
+}
+
+// Add the partial of the chunk that follows dst, closing the intervals and runs that
+// were open across the boundary
+static void AnalyzeMerge(struct AnalyzePartial &dst, struct AnalyzePartial &src)
+{
+	for (int i=0;i<src.months;i++)
+	{
+		struct AnalyzeMonth &s=src.month[i];
+		struct AnalyzeMonth &m=AnalyzeFind(dst,s.month,s.sw);
+
+		m.days|=s.days;
+		m.cycles+=s.cycles;
+		m.ontime+=s.ontime;
+		if (s.longest>m.longest) m.longest=s.longest;
+		if (s.shortest>0) AnalyzeInterval(m,s.shortest);
+	}
+	for (int ID=0;ID<100;ID++)
+	{
+		struct AnalyzeEdges &e=src.edge[ID], &c=dst.edge[ID];
+
+		if (!e.seen) continue;
+		if (e.headon>=0&&c.tailon>=0) AnalyzeInterval(AnalyzeAt(dst,e.headon,ID),e.headon-c.tailon);
+		if (e.headoff>=0&&c.tailopen) AnalyzeOn(AnalyzeAt(dst,e.headoff,ID),e.headoff-c.tailon);
+		if (e.tailon>=0) c.tailon=e.tailon;
+		c.tailopen=e.tailopen;
+		c.seen=true;
+	}
+	dst.events+=src.events;
+}
+
+// A WriteLog line of a switch edge:
+//   2017-06-20 14:03:11,"Switch0 On"
+//   2017-06-20 14:03:52,"Switch0 Off after 41.0s, duty ..."   ("Switch0 Off" before the length was logged)
+// t is set to local calendar ms and duration to the logged time on, 0 if there is none
+static bool LogEdge(const char *s, const char *end, int &sw, int &edge, int64_t &t, msec_t &duration)
+{
+	const char *q=s+27;
+	int n=0;
+
+	if (end-s<32||s[4]!='-'||s[7]!='-'||s[10]!=' '||s[13]!=':'||s[16]!=':'||memcmp(s+19,",\"Switch",8)!=0) return false;
+	for (sw=0;q<end&&*q>='0'&&*q<='9'&&n<3;n++) sw=sw*10+*q++-'0';
+	if (n==0||sw>=100) return false;
+	duration=0;
+	if (end-q>=4&&memcmp(q," On\"",4)==0) edge=1;
+	else if (end-q>=5&&memcmp(q," Off",4)==0&&(q[4]=='"'||q[4]==' '))
+	{
+		edge=0;
+		if (end-q>12&&memcmp(q+4," after ",7)==0&&memchr(q+11,'s',end-q-11)!=NULL) duration=(msec_t)(strtod(q+11,NULL)*1000+0.5);
+	}
+	else return false;
+
+	#define DIGIT(i) (s[i]-'0')
+	int64_t day=AnalyzeDays(DIGIT(0)*1000+DIGIT(1)*100+DIGIT(2)*10+DIGIT(3),DIGIT(5)*10+DIGIT(6),DIGIT(8)*10+DIGIT(9));
+	int64_t sec=(DIGIT(11)*10+DIGIT(12))*3600+(DIGIT(14)*10+DIGIT(15))*60+DIGIT(17)*10+DIGIT(18);
+	#undef DIGIT
+	t=day*86400000+sec*1000;
+	return true;
+}
+
+static void AnalyzeChunkRun(struct AnalyzeChunk &c)
+{
+	if (c.journal)
+	{
+		size_t off=c.from;
+		while (off<c.to&&off+JournalBlockSize(0)<=c.len)
+		{
+			const struct JournalBlock *b=(const struct JournalBlock *)(c.p+off);
+			if (b->magic!=JOURNAL_BLOCK_MAGIC||b->count>JOURNAL_BLOCK||off+JournalBlockSize(b->count)>c.len||
+				b->crc!=Crc32(b->rec,b->count*sizeof(struct JournalRecord))) break;
+			for (int r=0;r<b->count;r++)
+			{
+				const struct JournalRecord &rec=b->rec[r];
+				if (rec.id<100) AnalyzeEvent(c.part,rec.id,rec.edge,AnalyzeLocal(c.part,rec.wall),rec.duration);
+			}
+			off+=JournalBlockSize(b->count);
+		}
+		return;
+	}
+
+	const char *s=(const char *)c.p+c.from, *end=(const char *)c.p+c.to;
+	while (s<end)
+	{
+		const char *nl=(const char *)memchr(s,'\n',end-s);
+		if (nl==NULL) nl=end;
+		int sw, edge;
+		int64_t t;
+		msec_t duration;
+		if (LogEdge(s,nl,sw,edge,t,duration)) AnalyzeEvent(c.part,sw,edge,t,duration);
+		s=nl+1;
+	}
+}
+
+static void *AnalyzeWorker(void *arg)
+{
+	struct AnalyzeWorkerArg *wa=(struct AnalyzeWorkerArg *)arg;
+	struct AnalyzeRun &run=*wa->run;
+
+	for (;;)
+	{
+		int task=-1;
+		struct AnalyzeQueue &q=run.queue[wa->id];
+
+		pthread_mutex_lock(&q.lock);
+		if (q.head<q.tail) task=q.head++;
+		pthread_mutex_unlock(&q.lock);
+
+		// out of work: steal the last chunk of the next worker that has any. Nothing is
+		// queued after the start, so when every queue is empty the run is done
+		for (int v=1;task<0&&v<run.threads;v++)
+		{
+			struct AnalyzeQueue &vq=run.queue[(wa->id+v)%run.threads];
+			pthread_mutex_lock(&vq.lock);
+			if (vq.head<vq.tail) task=--vq.tail;
+			pthread_mutex_unlock(&vq.lock);
+			if (task>=0) wa->stolen++;
+		}
+		if (task<0) return NULL;
+		AnalyzeChunkRun(run.chunk[task]);
+	}
+}
+
+static void AnalyzeChunkAdd(struct AnalyzeRun &run, bool journal, const uint8_t *p, size_t len, size_t from, size_t to)
+{
+	if (run.chunks==run.cap)
+	{
+		run.cap=run.cap?run.cap*2:256;
+		run.chunk=(struct AnalyzeChunk *)realloc(run.chunk,run.cap*sizeof(struct AnalyzeChunk));
+	}
+	struct AnalyzeChunk &c=run.chunk[run.chunks++];
+	memset(&c,0,sizeof(c));
+	c.source=run.sources;
+	c.journal=journal;
+	c.p=p;
+	c.len=len;
+	c.from=from;
+	c.to=to;
+}
+
+static const uint8_t *AnalyzeMap(struct AnalyzeRun &run, const char *path, size_t &len)
+{
+	struct stat st;
+	int fd=open(path,O_RDONLY);
+
+	if (fd<0||fstat(fd,&st)<0||st.st_size==0||run.maps==4096)
+	{
+		if (fd>=0) close(fd);
+		return NULL;
+	}
+	void *m=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if (m==MAP_FAILED) return NULL;
+	madvise(m,st.st_size,MADV_SEQUENTIAL);
+	run.map[run.maps]=m;
+	run.maplen[run.maps++]=st.st_size;
+	len=st.st_size;
+	return (const uint8_t *)m;
+}
+
+// Add a journal directory as one source. Segments are cut into chunks of
+// ANALYZE_INDEX_STEP index entries, or taken whole if they have no index
+static bool AnalyzeAddJournal(struct AnalyzeRun &run, const char *dirname)
+{
+	uint32_t seq[4096];
+	char path[512];
+	int nseg=JournalSegments(dirname,seq,4096);
+
+	if (nseg<0||run.sources==64) return false;
+	run.source[run.sources].first=run.chunks;
+	for (int i=0;i<nseg;i++)
+	{
+		size_t len, ilen, from=sizeof(struct JournalSegment);
+
+		snprintf(path,511,"%s/journal.%08u",dirname,seq[i]);
+		const uint8_t *p=AnalyzeMap(run,path,len);
+		if (p==NULL) continue;
+		const struct JournalSegment *sh=(const struct JournalSegment *)p;
+		if (len<sizeof(*sh)||sh->magic!=JOURNAL_MAGIC||sh->recsize!=sizeof(struct JournalRecord)) continue;
+
+		snprintf(path,511,"%s/journal.%08u.idx",dirname,seq[i]);
+		const uint8_t *ip=AnalyzeMap(run,path,ilen);
+		const struct JournalIndexHeader *ih=(const struct JournalIndexHeader *)ip;
+		if (ip!=NULL&&ilen>sizeof(*ih)&&ih->magic==JOURNAL_INDEX_MAGIC&&ih->seq==seq[i])
+		{
+			const struct JournalIndexEntry *e=(const struct JournalIndexEntry *)(ip+sizeof(*ih));
+			int n=(ilen-sizeof(*ih))/sizeof(*e);
+			for (int k=ANALYZE_INDEX_STEP;k<n;k+=ANALYZE_INDEX_STEP)
+			{
+				size_t to=e[k].offset;
+				if (to<=from||to>=len) break;
+				AnalyzeChunkAdd(run,true,p,len,from,to);
+				from=to;
+			}
+		}
+		AnalyzeChunkAdd(run,true,p,len,from,len);
+	}
+	snprintf(run.source[run.sources].name,511,"%s",dirname);
+	run.source[run.sources++].last=run.chunks;
+	return true;
+}
+
+// Add a log file as one source, cut into chunks of about ANALYZE_LOG_CHUNK bytes
+// that end on a line
+static bool AnalyzeAddLog(struct AnalyzeRun &run, const char *path)
+{
+	size_t len;
+	const uint8_t *p;
+
+	if (run.sources==64||(p=AnalyzeMap(run,path,len))==NULL) return false;
+	run.source[run.sources].first=run.chunks;
+	for (size_t from=0;from<len;)
+	{
+		size_t to=from+ANALYZE_LOG_CHUNK;
+		if (to>=len) to=len;
+		else
+		{
+			const uint8_t *nl=(const uint8_t *)memchr(p+to,'\n',len-to);
+			to=nl!=NULL?nl-p+1:len;
+		}
+		AnalyzeChunkAdd(run,false,p,len,from,to);
+		from=to;
+	}
+	snprintf(run.source[run.sources].name,511,"%s",path);
+	run.source[run.sources++].last=run.chunks;
+	return true;
+}
+
+static int AnalyzeCompare(const void *a, const void *b)
+{
+	const struct AnalyzeMonth *x=(const struct AnalyzeMonth *)a, *y=(const struct AnalyzeMonth *)b;
+	if (x->month!=y->month) return x->month<y->month?-1:1;
+	return x->sw-y->sw;
+}
+
+// Run every chunk on the pool, then merge the partials of each source in order.
+// Returns the wall time taken in ms
+static double AnalyzeExecute(struct AnalyzeRun &run, int threads)
+{
+	struct timespec t0, t1;
+	pthread_t *th=(pthread_t *)calloc(threads,sizeof(pthread_t));
+	struct AnalyzeWorkerArg *wa=(struct AnalyzeWorkerArg *)calloc(threads,sizeof(struct AnalyzeWorkerArg));
+
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	for (int i=0;i<run.chunks;i++) AnalyzeReset(run.chunk[i].part);
+	Crc32(NULL,0);	// builds the table before the workers share it
+
+	// each worker starts with an equal run of consecutive chunks
+	run.threads=threads;
+	run.queue=(struct AnalyzeQueue *)calloc(threads,sizeof(struct AnalyzeQueue));
+	for (int w=0;w<threads;w++)
+	{
+		pthread_mutex_init(&run.queue[w].lock,NULL);
+		run.queue[w].head=(int64_t)run.chunks*w/threads;
+		run.queue[w].tail=(int64_t)run.chunks*(w+1)/threads;
+		wa[w].run=&run;
+		wa[w].id=w;
+	}
+	for (int w=1;w<threads;w++)
+		if (pthread_create(&th[w],NULL,AnalyzeWorker,&wa[w])!=0) th[w]=0;
+	AnalyzeWorker(&wa[0]);
+	run.stolen=wa[0].stolen;
+	for (int w=1;w<threads;w++)
+	{
+		if (th[w]!=0) pthread_join(th[w],NULL);
+		run.stolen+=wa[w].stolen;
+		pthread_mutex_destroy(&run.queue[w].lock);
+	}
+	pthread_mutex_destroy(&run.queue[0].lock);
+	free(run.queue);
+	run.queue=NULL;
+
+	for (int i=0;i<run.sources;i++)
+	{
+		struct AnalyzeSource &src=run.source[i];
+		AnalyzeReset(src.total);
+		for (int c=src.first;c<src.last;c++) AnalyzeMerge(src.total,run.chunk[c].part);
+		qsort(src.total.month,src.total.months,sizeof(struct AnalyzeMonth),AnalyzeCompare);
+	}
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	free(th);
+	free(wa);
+	return (t1.tv_sec-t0.tv_sec)*1e3+(t1.tv_nsec-t0.tv_nsec)/1e6;
+}
+
+static void AnalyzeReport(struct AnalyzeRun &run, struct PitGeometry &pit)
+{
+	printf("source,month,switch,days,cycles,cycles per day,peak inflow L/h,longest run s,hours on\n");
+	for (int i=0;i<run.sources;i++)
+	{
+		struct AnalyzePartial &t=run.source[i].total;
+		for (int m=0;m<t.months;)
+		{
+			// days covered by the source in this month, whichever switch moved
+			uint32_t days=0;
+			int n;
+			for (n=m;n<t.months&&t.month[n].month==t.month[m].month;n++) days|=t.month[n].days;
+			int ndays=__builtin_popcount(days);
+
+			for (;m<n;m++)
+			{
+				struct AnalyzeMonth &a=t.month[m];
+				char peak[32]="";
+				if (a.sw==0&&a.shortest>0) snprintf(peak,31,"%.1f",PitRate(pit,a.shortest)/1000.0);
+				printf("%s,%04d-%02d,Switch%d,%d,%lld,%.1f,%s,%.1f,%.2f\n",run.source[i].name,a.month/12,a.month%12+1,a.sw,ndays,
+					(long long)a.cycles,(double)a.cycles/ndays,peak,a.longest/1000.0,a.ontime/3600000.0);
+			}
+		}
+	}
+}
+
+static void AnalyzeFree(struct AnalyzeRun &run)
+{
+	for (int i=0;i<run.chunks;i++) AnalyzeReset(run.chunk[i].part);
+	for (int i=0;i<run.sources;i++) AnalyzeReset(run.source[i].total);
+	for (int i=0;i<run.maps;i++) munmap(run.map[i],run.maplen[i]);
+	free(run.chunk);
+	run.chunk=NULL;
+	run.chunks=run.cap=run.sources=run.maps=0;
+}
+
+// The pit dimensions from the config file, or those of the sample config if it can't
+// be read, for the rates in the report
+static void AnalyzePit(const char *path, struct ConfigData &cd)
+{
+	char cline[1000];
+	FILE *conf=fopen(path,"r");
+
+	cd.sumpdepth=760;
+	cd.sumpdiameter=510;
+	cd.lowwater=114;
+	cd.highwater=222;
+	if (conf!=NULL)
+	{
+		while (fgets(cline,sizeof(cline),conf)!=NULL)
+		{
+			cline[strcspn(cline,"\r\n")]=0;
+			if (sa_strcmp(cline,"SumpDepth")==0)
+			{
+				trim(cline+9);
+				trim(cline+10);
+				cd.sumpdepth=atoi(cline+10);
+			}
+			else if (sa_strcmp(cline,"SumpDiameter")==0)
+			{
+				trim(cline+12);
+				trim(cline+13);
+				cd.sumpdiameter=atoi(cline+13);
+			}
+			else if (sa_strcmp(cline,"LowWater")==0)
+			{
+				trim(cline+8);
+				trim(cline+9);
+				cd.lowwater=atoi(cline+9);
+			}
+			else if (sa_strcmp(cline,"HighWater")==0)
+			{
+				trim(cline+9);
+				trim(cline+10);
+				cd.highwater=atoi(cline+10);
+			}
+		}
+		fclose(conf);
+	}
+	PitInit(cd);
+}
+
+// Receives the edges of synthetic history in time order. duration is what the daemon
+// would journal: the time since the previous On for an On (0 for the first), the time on
+// for an Off. interval and on are those of the Switch0 cycle the edge belongs to
+typedef void (*BenchEdge)(void *ctx, int sw, int edge, int64_t wall, msec_t duration, msec_t interval, msec_t on);
+
+// Years of synthetic history ending now. The inflow follows the seasons with log-normal
+// jitter, and now and then the pump fails for a while and the water reaches Switch1.
+// Returns the number of edges
+static int64_t BenchHistory(struct PitGeometry &pit, int years, BenchEdge emit, void *ctx)
+{
+	uint64_t seed=2017;
+	int64_t events=0, wall=WallMs()-(int64_t)years*31557600000LL, end=WallMs();
+	msec_t laston=0;
+
+	while (wall<end)
+	{
+		double season=0.5+0.5*sin(2*M_PI*(wall%31557600000LL)/31557600000.0);
+		double q=(20+180*season)*exp(0.3*BenchNormal(seed));		// L/h
+		msec_t interval=(msec_t)(pit.pumpout*3600/q);				// ms for q to refill what the pump took out
+		msec_t on=(msec_t)(pit.pumpout*3600/(3000-q));				// the pump moves 3000 L/h
+		bool failed=BenchRandom(seed)<0.0002;
+
+		if (failed) on+=600000+(msec_t)(BenchRandom(seed)*3000000);
+		for (int e=0;e<(failed?4:2);e++)
+		{
+			// Switch0 On, Switch1 On and Off during a failure, then Switch0 Off
+			int sw=failed&&(e==1||e==2)?1:0, edge=e==0||(failed&&e==1);
+			int64_t t=wall+(e==0?0:e==3||!failed?on:e==1?on/3:on*2/3);
+
+			emit(ctx,sw,edge,t,sw!=0?(e==2?on/3:0):edge?(laston?t-laston:0):on,interval,on);
+			events++;
+		}
+		laston=wall;
+		wall+=interval>on?interval:on+interval;
+	}
+	return events;
+}
+
+struct AnalyzeSynthesis
+{
+	struct ConfigData *cd;
+	FILE *log;
+};
+
+// Journal an edge and log it, the way the daemon would have
+static void AnalyzeSynthesizeEdge(void *ctx, int sw, int edge, int64_t wall, msec_t duration, msec_t interval, msec_t on)
+{
+	struct AnalyzeSynthesis &as=*(struct AnalyzeSynthesis *)ctx;
+	struct ConfigData &cd=*as.cd;
+	struct JournalRecord &r=cd.journal.blk.rec[cd.journal.blk.count++];
+	time_t sec=wall/1000;
+	struct tm tm;
+	char stamp[40];
+
+	memset(&r,0,sizeof(r));
+	r.wall=wall;
+	r.mono=wall;
+	r.duration=duration;
+	r.rate=(int32_t)PitRate(cd.pit,interval);
+	r.id=sw;
+	r.edge=edge;
+	if (cd.journal.blk.count==JOURNAL_BLOCK) JournalFlush(cd,false);
+
+	localtime_r(&sec,&tm);
+	strftime(stamp,39,"%Y-%m-%d %T",&tm);
+	if (edge) fprintf(as.log,"%s,\"Switch%d On\"\n",stamp,sw);
+	else fprintf(as.log,"%s,\"Switch%d Off after %.1fs, duty 1h %.1f%% 24h %.1f%% 7d %.1f%%\"\n",stamp,sw,duration/1000.0,
+		100.0*on/interval,100.0*on/interval,100.0*on/interval);
+}
+
+// Write years of synthetic history ending now to a journal under dirname and the same
+// edges as log lines to logname
+static int64_t AnalyzeSynthesize(struct ConfigData &cd, const char *dirname, const char *logname, int years)
+{
+	struct AnalyzeSynthesis as;
+
+	snprintf(cd.journaldir,255,"%s",dirname);
+	cd.journalsegment=JOURNALSEGMENT;
+	cd.journalflush=JOURNALFLUSH;
+	cd.journalsync=1<<20;		// a benchmark doesn't need it on disk
+	cd.journal.fd=-1;
+	cd.journal.idxfd=-1;
+	cd.journal.timer.fire=JournalExpired;
+	cd.journal.timer.id=-1;
+	WheelInit(cd.wheel,MonoMs());
+	as.cd=&cd;
+	as.log=fopen(logname,"w");
+	if (as.log==NULL||!JournalOpen(cd))
+	{
+		if (as.log!=NULL) fclose(as.log);
+		return 0;
+	}
+
+	int64_t events=BenchHistory(cd.pit,years,AnalyzeSynthesizeEdge,&as);
+	JournalClose(cd);
+	fclose(as.log);
+	return events;
+}
+
+// The same history through 1 thread and then threads threads, from the journal and from the log
+static int AnalyzeBench(struct ConfigData &cd, int years, int threads)
+{
+	char dirname[]="/tmp/sumpalarm-analyze.XXXXXX", logname[600], path[600];
+	struct AnalyzeRun *run=(struct AnalyzeRun *)calloc(1,sizeof(struct AnalyzeRun));
+	struct timespec t0, t1;
+	int rc=0;
+
+	if (mkdtemp(dirname)==NULL)
+	{
+		printf("Unable to create a directory for the benchmark\n");
+		return 1;
+	}
+	snprintf(logname,599,"%s/sumpalarm.log",dirname);
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	int64_t events=AnalyzeSynthesize(cd,dirname,logname,years);
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	printf("%d years, %lld events generated in %.0f ms\n",years,(long long)events,(t1.tv_sec-t0.tv_sec)*1e3+(t1.tv_nsec-t0.tv_nsec)/1e6);
+
+	printf("%-8s %7s %7s %10s %10s %12s %8s %8s\n","source","chunks","threads","events","ms","events/s","speedup","stolen");
+	for (int pass=0;pass<2&&events>0;pass++)
+	{
+		struct AnalyzeMonth *one=NULL;
+		int ones=0;
+		double base=0;
+
+		if (pass==0) AnalyzeAddJournal(*run,dirname);
+		else AnalyzeAddLog(*run,logname);
+		for (int n=1;n<=threads;n=n==threads?threads+1:threads)
+		{
+			double ms=AnalyzeExecute(*run,n);
+			struct AnalyzePartial &t=run->source[0].total;
+
+			if (n==1)
+			{
+				base=ms;
+				ones=t.months;
+				one=(struct AnalyzeMonth *)malloc(ones*sizeof(struct AnalyzeMonth));
+				memcpy(one,t.month,ones*sizeof(struct AnalyzeMonth));
+			}
+			printf("%-8s %7d %7d %10lld %10.1f %12.0f %7.2fx %8lld\n",pass==0?"journal":"log",run->chunks,n,(long long)t.events,
+				ms,t.events*1000.0/ms,base/ms,(long long)run->stolen);
+			if (t.months!=ones||memcmp(one,t.month,ones*sizeof(struct AnalyzeMonth))!=0)
+			{
+				printf("Results of %d threads differ from 1 thread\n",n);
+				rc=1;
+			}
+		}
+		free(one);
+		AnalyzeFree(*run);
+	}
+
+	// remove the synthetic history
+	DIR *dir=opendir(dirname);
+	struct dirent *de;
+	while (dir!=NULL&&(de=readdir(dir))!=NULL)
+	{
+		if (de->d_name[0]=='.') continue;
+		snprintf(path,599,"%s/%s",dirname,de->d_name);
+		unlink(path);
+	}
+	if (dir!=NULL) closedir(dir);
+	rmdir(dirname);
+	free(run);
+	return rc;
+}
+
+// sumpalarm analyze [-c config] [-j threads] [-d journaldir ...] [logfile ...]
+// sumpalarm analyze -b [years] [-j threads]
+// Monthly totals of every switch from journals and WriteLog logs, one source per
+// journal directory or log file. The sources are cut into chunks that a pool of
+// threads works through, each chunk adding up to a partial of its own; the partials
+// of a source are then merged in order, which also joins up the intervals and runs
+// cut in two at the chunk boundaries. -b times this on synthetic history instead
+int Analyze(int argc, char **argv)
+{
+	const char *conf=CONFIGFILE;
+	int threads=sysconf(_SC_NPROCESSORS_ONLN), years=-1, a;
+	struct ConfigData *cd=(struct ConfigData *)calloc(1,sizeof(struct ConfigData));
+	struct AnalyzeRun *run=(struct AnalyzeRun *)calloc(1,sizeof(struct AnalyzeRun));
+	bool bad=false;
+
+	verbose=true;	// anything logged goes to the console
+	for (a=0;a<argc;a++)
+	{
+		if (strcmp(argv[a],"-c")==0&&a+1<argc) conf=argv[++a];
+		else if (strcmp(argv[a],"-j")==0&&a+1<argc) threads=atoi(argv[++a]);
+		else if (strcmp(argv[a],"-b")==0)
+		{
+			years=10;
+			if (a+1<argc&&atoi(argv[a+1])>0) years=atoi(argv[++a]);
+		}
+		else if (strcmp(argv[a],"-d")==0&&a+1<argc)
+		{
+			if (!AnalyzeAddJournal(*run,argv[++a]))
+			{
+				printf("Unable to read journal %s\n",argv[a]);
+				bad=true;
+			}
+		}
+		else if (argv[a][0]!='-')
+		{
+			if (!AnalyzeAddLog(*run,argv[a]))
+			{
+				printf("Unable to read log %s\n",argv[a]);
+				bad=true;
+			}
+		}
+		else bad=true;
+	}
+	if (threads<1) threads=1;
+	if (bad||(years<0&&run->sources==0))
+	{
+		printf("Usage: sumpalarm analyze [-c config] [-j threads] [-d journaldir ...] [logfile ...]\n");
+		printf("       sumpalarm analyze -b [years] [-j threads]\n");
+		AnalyzeFree(*run);
+		return 1;
+	}
+
+	int rc=0;
+	if (years>0)
+	{
+		AnalyzePit("",*cd);
+		rc=AnalyzeBench(*cd,years,threads);
+	}
+	else
+	{
+		AnalyzePit(conf,*cd);
+		double ms=AnalyzeExecute(*run,threads);
+		int64_t events=0;
+		for (int i=0;i<run->sources;i++) events+=run->source[i].total.events;
+		AnalyzeReport(*run,cd->pit);
+		fprintf(stderr,"%lld events from %d chunks on %d threads in %.1f ms, %lld chunks stolen\n",(long long)events,
+			run->chunks,threads,ms,(long long)run->stolen);
+	}
+	AnalyzeFree(*run);
+	free(run);
+	free(cd);
+	return rc;
+}
+
+// A recorded switch edge
+struct ReplayEvent
+{
+	int64_t t;				// ms: local calendar time from a log, wall clock from the journal
+	int32_t order;			// position in the input, to keep simultaneous edges in order
+	int16_t sw;
+	int16_t edge;
+};
 
-			LogLevel=atoi(cline+9);
-			if (LogLevel>3||LogLevel<0) LogLevel=3;
-			snprintf(logme,939,"Logging level %d set",LogLevel);
-			WriteLog(logme,3);
+// One candidate set of parameters and the actions it would have run
+struct ReplayParams
+{
+	int ratechangeamt;
+	double ratechangelimit;
+	int overduethreshold;
+	double overduequantile;
+	double overduefactor;
+	struct ReplayTally tally;
+};
+
+struct ReplayRun
+{
+	struct ReplayEvent *ev;
+	int64_t events, cap;
+	int repeat;				// times the history is replayed back to back
+	struct ConfigData *base;	// the configuration every set starts from. It is never run itself
+	struct ReplayParams *set;
+	int sets;
+	int next;				// next set to be taken by a worker
+};
+
+// Pin levels as the recorded edges left them, read by ScanSwitches like any backend
+struct ReplayInput
+{
+	uint64_t levels;
+
+	bool Levels(uint64_t &l) { l=levels; return true; }
+	uint64_t Latched() { return 0; }
+};
+
+static void ReplayAdd(struct ReplayRun &run, int64_t t, int sw, int edge)
+{
+	if (run.events==run.cap)
+	{
+		run.cap=run.cap?run.cap*2:65536;
+		run.ev=(struct ReplayEvent *)realloc(run.ev,run.cap*sizeof(struct ReplayEvent));
+	}
+	struct ReplayEvent &e=run.ev[run.events];
+	e.t=t;
+	e.order=run.events++;
+	e.sw=sw;
+	e.edge=edge;
+}
+
+// Edges from a log written by WriteLog, or from a trace with one edge per line as
+// seconds, switch and 1 for On or 0 for Off
+static bool ReplayAddLog(struct ReplayRun &run, const char *path)
+{
+	FILE *f=fopen(path,"r");
+	char line[4096];
+
+	if (f==NULL) return false;
+	while (fgets(line,sizeof(line),f)!=NULL)
+	{
+		int sw, edge;
+		int64_t t;
+		msec_t duration;
+		double sec;
+
+		if (LogEdge(line,line+strcspn(line,"\r\n"),sw,edge,t,duration)) ReplayAdd(run,t,sw,edge);
+		else if (line[0]!='#'&&sscanf(line,"%lf %d %d",&sec,&sw,&edge)==3&&sw>=0&&sw<100) ReplayAdd(run,(int64_t)(sec*1000),sw,edge!=0);
+	}
+	fclose(f);
+	return true;
+}
+
+static bool ReplayAddJournal(struct ReplayRun &run, const char *dirname)
+{
+	uint32_t seq[4096];
+	char path[512];
+	int nseg=JournalSegments(dirname,seq,4096);
+
+	if (nseg<0) return false;
+	for (int i=0;i<nseg;i++)
+	{
+		struct stat st;
+
+		snprintf(path,511,"%s/journal.%08u",dirname,seq[i]);
+		int fd=open(path,O_RDONLY);
+		if (fd<0||fstat(fd,&st)<0||st.st_size<(off_t)sizeof(struct JournalSegment))
+		{
+			if (fd>=0) close(fd);
 			continue;
 		}
-		if (sa_strcmp(cline,"LogFile")==0)
+		const uint8_t *p=(const uint8_t *)mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+		close(fd);
+		if (p==MAP_FAILED) continue;
+
+		const struct JournalSegment *sh=(const struct JournalSegment *)p;
+		off_t off=sizeof(*sh);
+		while (sh->magic==JOURNAL_MAGIC&&sh->recsize==sizeof(struct JournalRecord)&&off+(off_t)JournalBlockSize(0)<=st.st_size)
 		{
-			// remove whitespace around '=' (SumpDepth =  x --> SumpDepth=x)
-			trim(cline+7);
-			trim(cline+8);
+			const struct JournalBlock *b=(const struct JournalBlock *)(p+off);
+			if (b->magic!=JOURNAL_BLOCK_MAGIC||b->count>JOURNAL_BLOCK||off+(off_t)JournalBlockSize(b->count)>st.st_size||
+				b->crc!=Crc32(b->rec,b->count*sizeof(struct JournalRecord))) break;
+			for (int r=0;r<b->count;r++)
+				if (b->rec[r].id<100) ReplayAdd(run,b->rec[r].wall,b->rec[r].id,b->rec[r].edge);
+			off+=JournalBlockSize(b->count);
+		}
+		munmap((void *)p,st.st_size);
+	}
+	return true;
+}
 
-			strncpy(LogFileName,cline+8,999);
-			snprintf(logme,939,"LogFile set: %s",LogFileName);
-			WriteLog(logme,3);
-			continue;
+static void ReplayBenchEdge(void *ctx, int sw, int edge, int64_t wall, msec_t, msec_t, msec_t)
+{
+	ReplayAdd(*(struct ReplayRun *)ctx,wall,sw,edge);
+}
+
+static int ReplayCompare(const void *a, const void *b)
+{
+	const struct ReplayEvent *x=(const struct ReplayEvent *)a, *y=(const struct ReplayEvent *)b;
+	if (x->t!=y->t) return x->t<y->t?-1:1;
+	return x->order-y->order;
+}
+
+// Values of a parameter: a comma separated list of numbers or from:to:step ranges
+static int ReplayList(const char *arg, double *v, int max)
+{
+	int n=0;
+
+	while (*arg&&n<max)
+	{
+		char *end;
+		double from=strtod(arg,&end), to=from, step=1;
+
+		if (end==arg) return 0;
+		if (*end==':')
+		{
+			to=strtod(end+1,&end);
+			if (*end==':') step=strtod(end+1,&end);
+			if (step<=0) return 0;
 		}
+		for (double x=from;x<=to+step*1e-9&&n<max;x+=step) v[n++]=x;
+		if (*end==',') end++;
+		else if (*end) return 0;
+		arg=end;
+	}
+	return n;
+}
 
-		// Sump pit sizing parameters
-		if (sa_strcmp(cline,"SumpDepth")==0)
+// The configuration the daemon would run with, or the sample pit with two switches if
+// there is no config file. Nothing is logged while it is read, and nothing that would
+// touch the daemon's files is kept
+static void ReplayConfig(struct ConfigData &cd)
+{
+	struct ReplayTally quiet;
+
+	ConfigInit(cd);
+	if (access(CONFIGFILE,R_OK)==0)
+	{
+		memset(&quiet,0,sizeof(quiet));
+		Replaying=&quiet;
+		RefreshConfig(cd,true);
+		Replaying=NULL;
+	}
+	else
+	{
+		for (int ID=0;ID<2;ID++)
 		{
-			if (!initial) continue; // only load action scripts if not initial load
-			// remove whitespace around '=' (SumpDepth =  x --> SumpDepth=x)
-			trim(cline+9);
-			trim(cline+10);
+			cd.switchlist[ID].initialized=1;
+			cd.switchlist[ID].level=ID==0?200:300;
+			cd.switchlist[ID].pin=14+ID;
+			cd.pinmask|=(uint64_t)1<<(14+ID);
+			cd.pinswitch[14+ID]=ID;
+			HistoryResize(cd.switchlist[ID].freq,cd.freqhistory);
+		}
+		cd.overduethreshold=120;
+		AnalyzePit("",cd);
+	}
+	cd.simgpio[0]=0;
+	cd.statefile[0]=0;
+	cd.journaldir[0]=0;
+	// the tally tells the two apart by these, so a config without them still counts
+	if (cd.ratechange.line==NULL) ActionSet(cd.ratechange,"RateChange");
+	if (cd.overdue.line==NULL) ActionSet(cd.overdue,"Overdue");
+}
 
-			cd.sumpdepth=atoi(cline+10);
-			snprintf(logme,939,"SumpDepth set to %d",cd.sumpdepth);
-			WriteLog(logme,3);
-			continue;
+// Feed the history through the daemon's own scan and timer path with the parameters
+// of one set, on a virtual clock that jumps from one deadline or edge to the next
+static void ReplayOne(struct ReplayRun &run, struct ConfigData &cd, struct ReplayParams &p)
+{
+	struct ReplayInput in;
+	int64_t span=run.ev[run.events-1].t-run.ev[0].t+86400000;	// repeats follow a day apart
+	msec_t t=86400000;
+	bool pending=false;
+
+	memcpy(&cd,run.base,sizeof(cd));
+	for (int ID=0;ID<100;ID++)
+	{
+		struct FreqHistory &h=cd.switchlist[ID].freq;
+		int depth=h.depth;
+
+		memset(&h,0,sizeof(h));
+		if (depth>0) HistoryResize(h,depth);
+	}
+	cd.ratechangeamt=p.ratechangeamt;
+	cd.ratechangelimit=p.ratechangelimit;
+	cd.overduethreshold=p.overduethreshold;
+	cd.overduequantile=p.overduequantile;
+	cd.overduefactor=p.overduefactor;
+	memset(&p.tally,0,sizeof(p.tally));
+	p.tally.ratechange=cd.ratechange.line;
+	p.tally.overdue=cd.overdue.line;
+	WheelInit(cd.wheel,t);
+	in.levels=0;
+	Replaying=&p.tally;
+
+	for (int r=0;r<=run.repeat;r++)
+	{
+		int64_t shift=86400000+r*span-run.ev[0].t;
+
+		for (int64_t i=0;i<run.events;i++)
+		{
+			const struct ReplayEvent &e=run.ev[i];
+			// the last pass only runs out the deadlines a day past the end
+			msec_t at=r<run.repeat?e.t+shift:t+86400000;
+
+			// wake for every deadline before the edge, as the daemon's timerfd would
+			for (msec_t due=NextDeadline(cd,t,pending,false);due>=0&&due<at;due=NextDeadline(cd,t,pending,false))
+			{
+				t=due;
+				WheelAdvance(cd.wheel,cd,t);
+				pending=ScanSwitches(in,cd,t);
+			}
+			if (r==run.repeat) break;
+
+			struct FloatSwitch &s=cd.switchlist[e.sw];
+			if (!s.initialized) continue;
+			if (e.edge) in.levels|=(uint64_t)1<<s.pin;
+			else in.levels&=~((uint64_t)1<<s.pin);
+			if (at>t) t=at;		// a log steps back an hour when daylight saving ends
+			WheelAdvance(cd.wheel,cd,t);
+			pending=ScanSwitches(in,cd,t);
 		}
+	}
 
-		if (sa_strcmp(cline,"SumpDiameter")==0)
+	Replaying=NULL;
+	for (int ID=0;ID<100;ID++) free(cd.switchlist[ID].freq.buf);
+}
+
+static void *ReplayWorker(void *arg)
+{
+	struct ReplayRun &run=*(struct ReplayRun *)arg;
+	struct ConfigData *cd=(struct ConfigData *)malloc(sizeof(struct ConfigData));
+
+	for (int i=__sync_fetch_and_add(&run.next,1);i<run.sets;i=__sync_fetch_and_add(&run.next,1))
+		ReplayOne(run,*cd,run.set[i]);
+	free(cd);
+	return NULL;
+}
+
+// sumpalarm replay [-a amt] [-l limit] [-o threshold] [-q quantile] [-f factor] [-j threads]
+//                  [-r repeat] [-d journaldir ...] [-b years] [log or trace ...]
+// Replay recorded switch edges through SwitchChanged and the Overdue timers for every
+// combination of the RateChangeAmt, RateChangeLimit, OverdueThreshold, OverdueQuantile
+// and OverdueFactor values given, and count the RateChange and Overdue actions each
+// would have run. The rest of the configuration comes from the config file. Each set
+// gets its own ConfigData and sets are shared out between threads
+int Replay(int argc, char **argv)
+{
+	double amt[256], limit[256], threshold[256], quantile[256], factor[256];
+	int namt=0, nlimit=0, nthreshold=0, nquantile=0, nfactor=0, threads=sysconf(_SC_NPROCESSORS_ONLN), years=0, a;
+	struct ReplayRun run;
+	struct ConfigData *base=(struct ConfigData *)malloc(sizeof(struct ConfigData));
+	struct timespec t0, t1;
+	bool bad=false;
+
+	memset(&run,0,sizeof(run));
+	run.repeat=1;
+	for (a=0;a<argc&&!bad;a++)
+	{
+		if (strcmp(argv[a],"-a")==0&&a+1<argc) bad=(namt=ReplayList(argv[++a],amt,256))==0;
+		else if (strcmp(argv[a],"-l")==0&&a+1<argc) bad=(nlimit=ReplayList(argv[++a],limit,256))==0;
+		else if (strcmp(argv[a],"-o")==0&&a+1<argc) bad=(nthreshold=ReplayList(argv[++a],threshold,256))==0;
+		else if (strcmp(argv[a],"-q")==0&&a+1<argc) bad=(nquantile=ReplayList(argv[++a],quantile,256))==0;
+		else if (strcmp(argv[a],"-f")==0&&a+1<argc) bad=(nfactor=ReplayList(argv[++a],factor,256))==0;
+		else if (strcmp(argv[a],"-j")==0&&a+1<argc) threads=atoi(argv[++a]);
+		else if (strcmp(argv[a],"-r")==0&&a+1<argc) run.repeat=atoi(argv[++a]);
+		else if (strcmp(argv[a],"-b")==0&&a+1<argc) years=atoi(argv[++a]);
+		else if (strcmp(argv[a],"-d")==0&&a+1<argc)
 		{
-			if (!initial) continue; // only load action scripts if not initial load
+			if (!ReplayAddJournal(run,argv[++a]))
+			{
+				printf("Unable to read journal %s\n",argv[a]);
+				return 1;
+			}
+		}
+		else if (argv[a][0]!='-')
+		{
+			if (!ReplayAddLog(run,argv[a]))
+			{
+				printf("Unable to read %s\n",argv[a]);
+				return 1;
+			}
+		}
+		else bad=true;
+	}
+	if (bad||(run.events==0&&years<=0))
+	{
+		printf("Usage: sumpalarm replay [-a amt] [-l limit] [-o threshold] [-q quantile] [-f factor] [-j threads]\n");
+		printf("                        [-r repeat] [-d journaldir ...] [-b years] [log or trace ...]\n");
+		printf("Each parameter takes a list of values and from:to:step ranges, e.g. -a 10,20:50:10\n");
+		return 1;
+	}
+	if (threads<1) threads=1;
+	if (run.repeat<1) run.repeat=1;
+
+	ReplayConfig(*base);
+	run.base=base;
+	if (years>0) BenchHistory(base->pit,years,ReplayBenchEdge,&run);
+	qsort(run.ev,run.events,sizeof(struct ReplayEvent),ReplayCompare);
+
+	// every combination of the values given, the configured one where none are
+	if (namt==0) amt[namt++]=base->ratechangeamt;
+	if (nlimit==0) limit[nlimit++]=base->ratechangelimit;
+	if (nthreshold==0) threshold[nthreshold++]=base->overduethreshold;
+	if (nquantile==0) quantile[nquantile++]=base->overduequantile;
+	if (nfactor==0) factor[nfactor++]=base->overduefactor;
+	run.sets=namt*nlimit*nthreshold*nquantile*nfactor;
+	run.set=(struct ReplayParams *)calloc(run.sets,sizeof(struct ReplayParams));
+	for (int i=0;i<run.sets;i++)
+	{
+		int k=i;
+		run.set[i].overduefactor=factor[k%nfactor];
+		k/=nfactor;
+		run.set[i].overduequantile=quantile[k%nquantile];
+		k/=nquantile;
+		run.set[i].overduethreshold=(int)threshold[k%nthreshold];
+		k/=nthreshold;
+		run.set[i].ratechangelimit=limit[k%nlimit];
+		k/=nlimit;
+		run.set[i].ratechangeamt=(int)amt[k];
+	}
 
-			// remove whitespace around '='
-			trim(cline+12);
-			trim(cline+13);
+	clock_gettime(CLOCK_MONOTONIC,&t0);
+	pthread_t *th=(pthread_t *)calloc(threads,sizeof(pthread_t));
+	for (int w=1;w<threads;w++)
+		if (pthread_create(&th[w],NULL,ReplayWorker,&run)!=0) th[w]=0;
+	ReplayWorker(&run);
+	for (int w=1;w<threads;w++)
+		if (th[w]!=0) pthread_join(th[w],NULL);
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+
+	double span=(run.ev[run.events-1].t-run.ev[0].t)/31557600000.0*run.repeat;
+	double sec=(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9;
+	printf("ratechangeamt,ratechangelimit,overduethreshold,overduequantile,overduefactor,ratechange,overdue,actions,ratechange per year,overdue per year\n");
+	for (int i=0;i<run.sets;i++)
+	{
+		struct ReplayParams &p=run.set[i];
+		printf("%d,%g,%d,%g,%g,%lld,%lld,%lld,%.2f,%.2f\n",p.ratechangeamt,p.ratechangelimit,p.overduethreshold,p.overduequantile,
+			p.overduefactor,(long long)p.tally.ratechanges,(long long)p.tally.overdues,(long long)p.tally.actions,
+			span>0?p.tally.ratechanges/span:0.0,span>0?p.tally.overdues/span:0.0);
+	}
+	fprintf(stderr,"%d sets x %.1f years (%lld edges) on %d threads in %.2f s, %.0f simulated years per minute\n",run.sets,span,
+		(long long)run.events*run.repeat,threads,sec,sec>0?run.sets*span*60/sec:0.0);
+
+	for (int ID=0;ID<100;ID++) free(base->switchlist[ID].freq.buf);
+	free(th);
+	free(run.set);
+	free(run.ev);
+	free(base);
+	return 0;
+}
 
-			cd.sumpdiameter=atoi(cline+13);
+// Sump pit physics for simulate. The pit is a cylinder of SumpDiameter and SumpDepth.
+// Water comes in at a rate that follows the seasons with storms on top, and the pump
+// empties it at a fixed rate from HighWater down to LowWater unless it has failed
+struct SumpModel
+{
+	double level;			// mm of water
+	bool pumping;
+	double inflow;			// L/h average over the year
+	double pumprate;		// L/h
+	double storm;			// L/h added by the current storm
+	msec_t stormend, nextstorm;
+	msec_t failend, nextfail;	// the pump is out of action until failend
+	uint64_t seed;
+	int64_t storms, failures;
+	msec_t flooded;			// time the pit was full
+	double peak;			// highest level of the day, mm
+	int sw[100];			// the initialized switches
+	int switches;
+};
 
-			snprintf(logme,939,"SumpDiameter set to %d",cd.sumpdiameter);
-			WriteLog(logme,3);
+// Exponentially distributed time with the given mean, ms
+static msec_t SumpWait(struct SumpModel &m, double mean)
+{
+	return (msec_t)(-log(BenchRandom(m.seed))*mean)+1;
+}
 
-			continue;
+// Run the physics from t to the next wake-up and set the switch pins to match
+static void SumpStep(struct SumpModel &m, struct ConfigData &cd, struct SimInput &sim, msec_t t, msec_t due)
+{
+	if (t>=m.nextstorm)
+	{
+		m.storm=-log(BenchRandom(m.seed))*300;
+		m.stormend=t+SumpWait(m,4*3600000.0);
+		m.nextstorm=t+SumpWait(m,5*86400000.0);
+		m.storms++;
+	}
+	if (t>=m.stormend) m.storm=0;
+	if (t>=m.nextfail)
+	{
+		m.failend=t+1800000+(msec_t)(BenchRandom(m.seed)*4*3600000);
+		m.nextfail=t+SumpWait(m,60*86400000.0);
+		m.failures++;
+	}
+
+	double q=m.inflow*(1+0.6*sin(2*M_PI*t/31557600000.0))+m.storm;
+	if (t<m.failend) m.pumping=false;
+	else if (m.level>=cd.highwater) m.pumping=true;
+	else if (m.level<=cd.lowwater) m.pumping=false;
+
+	// L/h over the step, to mm through the cross-section in mm^2
+	m.level+=(q-(m.pumping?m.pumprate:0))*(due-t)/3600000.0*1e6/cd.pit.area;
+	if (m.level<0) m.level=0;
+	if (m.level>=cd.sumpdepth)
+	{
+		m.level=cd.sumpdepth;
+		m.flooded+=due-t;
+	}
+	if (m.level>m.peak) m.peak=m.level;
+
+	for (int i=0;i<m.switches;i++)
+	{
+		struct FloatSwitch &s=cd.switchlist[m.sw[i]];
+		sim.SetPin(s.pin,m.level>=s.level?HIGH:LOW);
+	}
+}
+
+// Per-day totals of simulate
+struct SimulateDay
+{
+	double cpu;				// ms
+	int64_t allocs;
+	int64_t actions, ratechanges, overdues;
+	int64_t cycles;			// Switch0 On/Off cycles
+};
+
+static void SimulateRow(const char *name, struct SimulateDay *day, int days, size_t field, bool real)
+{
+	double sum=0, max=0;
+
+	for (int d=0;d<days;d++)
+	{
+		double x=real?*(double *)((char *)&day[d]+field):*(int64_t *)((char *)&day[d]+field);
+		sum+=x;
+		if (x>max) max=x;
+	}
+	printf("%-14s %12.3f %12.3f\n",name,sum/days,max);
+}
+
+// sumpalarm simulate [-d days] [-i inflow] [-p pumprate] [-s seed] [-c]
+// Run the daemon's main loop against the pit physics on a simulated clock: every wake-up
+// the main loop would have had advances the timers, scans the simulated pins through
+// ScanSwitches and sleeps until NextDeadline, at which point the physics catch up and set
+// the pins. Actions are counted rather than run and nothing is logged, but the action
+// environment is still built. Reports the CPU time, heap allocations (built with
+// -DCOUNT_ALLOCS) and actions per simulated day, and -c prints every day as CSV
+int Simulate(int argc, char **argv)
+{
+	struct ConfigData *cd=(struct ConfigData *)malloc(sizeof(struct ConfigData));
+	struct SumpModel m;
+	struct SimInput sim;
+	struct ReplayTally tally;
+	struct timespec c0, c1, w0, w1;
+	int days=365, a;
+	bool csv=false, pending=false;
+	msec_t clock=86400000;
+
+	memset(&m,0,sizeof(m));
+	m.inflow=60;
+	m.pumprate=3000;
+	m.seed=2017;
+	for (a=0;a<argc;a++)
+	{
+		if (strcmp(argv[a],"-d")==0&&a+1<argc) days=atoi(argv[++a]);
+		else if (strcmp(argv[a],"-i")==0&&a+1<argc) m.inflow=atof(argv[++a]);
+		else if (strcmp(argv[a],"-p")==0&&a+1<argc) m.pumprate=atof(argv[++a]);
+		else if (strcmp(argv[a],"-s")==0&&a+1<argc) m.seed=strtoull(argv[++a],NULL,10);
+		else if (strcmp(argv[a],"-c")==0) csv=true;
+		else
+		{
+			printf("Usage: sumpalarm simulate [-d days] [-i inflow L/h] [-p pump L/h] [-s seed] [-c]\n");
+			return 1;
 		}
-		if (sa_strcmp(cline,"LowWater")==0)
+	}
+	if (days<1) days=1;
+
+	ReplayConfig(*cd);
+	if (cd->pit.area==0||cd->highwater<=cd->lowwater)
+	{
+		printf("The config needs SumpDiameter, LowWater and HighWater to simulate the pit\n");
+		return 1;
+	}
+	memset(&tally,0,sizeof(tally));
+	tally.ratechange=cd->ratechange.line;
+	tally.overdue=cd->overdue.line;
+	tally.environment=true;
+	m.level=cd->lowwater;
+	for (int ID=0;ID<100;ID++)
+		if (cd->switchlist[ID].initialized) m.sw[m.switches++]=ID;
+	m.nextstorm=clock+SumpWait(m,5*86400000.0);
+	m.nextfail=clock+SumpWait(m,60*86400000.0);
+
+	VirtualClock=&clock;
+	Replaying=&tally;
+	WheelInit(cd->wheel,clock);
+	sim.Open(*cd);
+
+	struct SimulateDay *day=(struct SimulateDay *)calloc(days,sizeof(struct SimulateDay));
+	if (csv) printf("day,cpu ms,allocations,actions,ratechange,overdue,cycles,peak mm\n");
+	clock_gettime(CLOCK_MONOTONIC,&w0);
+	for (int d=0;d<days;d++)
+	{
+		msec_t dayend=clock+86400000;
+		struct ReplayTally before=tally;
+		int64_t cycles=cd->switchlist[0].cycles;
+		#ifdef COUNT_ALLOCS
+		int64_t allocs=AllocCount;
+		#endif
+
+		m.peak=m.level;
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&c0);
+		while (clock<dayend)
 		{
-			if (!initial) continue; // only load action scripts if not initial load
+			WheelAdvance(cd->wheel,*cd,clock);
+			pending=ScanSwitches(sim,*cd,clock);
+			msec_t due=NextDeadline(*cd,clock,pending,sim.Fd()<0);
+			if (due<=clock||due>dayend) due=dayend;
+			SumpStep(m,*cd,sim,clock,due);
+			clock=due;
+		}
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&c1);
+
+		struct SimulateDay &sd=day[d];
+		sd.cpu=(c1.tv_sec-c0.tv_sec)*1e3+(c1.tv_nsec-c0.tv_nsec)/1e6;
+		#ifdef COUNT_ALLOCS
+		sd.allocs=AllocCount-allocs;
+		#endif
+		sd.actions=tally.actions-before.actions;
+		sd.ratechanges=tally.ratechanges-before.ratechanges;
+		sd.overdues=tally.overdues-before.overdues;
+		sd.cycles=cd->switchlist[0].cycles-cycles;
+		if (csv) printf("%d,%.3f,%lld,%lld,%lld,%lld,%lld,%.0f\n",d+1,sd.cpu,(long long)sd.allocs,(long long)sd.actions,
+			(long long)sd.ratechanges,(long long)sd.overdues,(long long)sd.cycles,m.peak);
+	}
+	clock_gettime(CLOCK_MONOTONIC,&w1);
+	VirtualClock=NULL;
+	Replaying=NULL;
 
-			// remove whitespace around '='
-			trim(cline+8);
-			trim(cline+9);
+	double wall=(w1.tv_sec-w0.tv_sec)+(w1.tv_nsec-w0.tv_nsec)/1e9;
+	if (!csv)
+	{
+		printf("%d days simulated in %.2f s, %.0f times real time\n",days,wall,days*86400.0/wall);
+		printf("%d storms, %d pump failures, %.1f hours flooded\n",(int)m.storms,(int)m.failures,m.flooded/3600000.0);
+		printf("%-14s %12s %12s\n","per day","mean","max");
+		SimulateRow("cpu ms",day,days,offsetof(struct SimulateDay,cpu),true);
+		#ifdef COUNT_ALLOCS
+		SimulateRow("allocations",day,days,offsetof(struct SimulateDay,allocs),false);
+		#else
+		printf("%-14s %12s %12s   (build with -DCOUNT_ALLOCS)\n","allocations","-","-");
+		#endif
+		SimulateRow("actions",day,days,offsetof(struct SimulateDay,actions),false);
+		SimulateRow("RateChange",day,days,offsetof(struct SimulateDay,ratechanges),false);
+		SimulateRow("Overdue",day,days,offsetof(struct SimulateDay,overdues),false);
+		SimulateRow("Switch0 cycles",day,days,offsetof(struct SimulateDay,cycles),false);
+	}
 
-			cd.lowwater=atoi(cline+9);
-			snprintf(logme,939,"LowWater set to %d",cd.lowwater);
-			WriteLog(logme,3);
+	sim.Close();
+	for (int ID=0;ID<100;ID++) free(cd->switchlist[ID].freq.buf);
+	free(day);
+	free(cd);
+	return 0;
+}
+
+// sumpalarm spawnbench [-n count] [-m MB] [action ...]
+// Run each action count times, one at a time, the way the daemon used to (fork, then
+// system() in the child), through /bin/sh -c with posix_spawn, and compiled the way the
+// daemon runs it now, and report the microseconds the daemon spends in the call, until the action has
+// exited, and of CPU in the daemon and its children per action. -m grows the daemon
+// first, since fork() copies its page tables
+int SpawnBench(int argc, char **argv)
+{
+	int count=1000, mb=0, nact=0, a, n, r;
+	const char *deflt[]={"true","true >/dev/null","echo $SASWITCH >>/dev/null","file:/dev/null Switch$SASWITCH"};
+	const char **act=(const char **)malloc(sizeof(char *)*(argc+4));
+	const char *runner[]={"fork+system","spawn sh -c","compiled"};
+	struct ActionCmd cmd, sh;
+	struct ActionArgs *args=(struct ActionArgs *)malloc(sizeof(struct ActionArgs));
+	struct SinkCache sinks;
+
+	for (a=0;a<argc;a++)
+	{
+		if (strcmp(argv[a],"-n")==0&&a+1<argc) count=atoi(argv[++a])>0?atoi(argv[a]):1;
+		else if (strcmp(argv[a],"-m")==0&&a+1<argc) mb=atoi(argv[++a]);
+		else act[nact++]=argv[a];
+	}
+	if (nact==0) for (;nact<4;nact++) act[nact]=deflt[nact];
+
+	char *ballast=NULL;
+	if (mb>0)
+	{
+		ballast=(char *)malloc((size_t)mb<<20);
+		memset(ballast,1,(size_t)mb<<20);
+	}
+	sigemptyset(&OrigSigMask);
+	memset(&cmd,0,sizeof(cmd));
+	memset(&sh,0,sizeof(sh));
+	memset(&sinks,0,sizeof(sinks));
+
+	printf("%-24s %-12s %10s %10s %10s\n","action","runner","call us","exit us","cpu us");
+	for (a=0;a<nact;a++)
+	{
+		ActionSet(cmd,act[a]);
+		// the same line forced through the shell
+		ActionFree(sh);
+		ActionSet(sh,act[a]);
+		sh.shell=true;
+		sh.append=false;
+
+		// a sink has no shell line to compare with
+		for (r=cmd.sink!=SINK_NONE?2:0;r<3;r++)
+		{
+			struct timespec t0, t1, t2;
+			struct rusage s0, c0, s1, c1;
+			double call=0, done=0;
+			int failed=0;
+
+			fflush(stdout);
+			getrusage(RUSAGE_SELF,&s0);
+			getrusage(RUSAGE_CHILDREN,&c0);
+			for (n=0;n<count;n++)
+			{
+				pid_t pid;
+				int status;
+
+				clock_gettime(CLOCK_MONOTONIC,&t0);
+				if (r==0)
+				{
+					pid=fork();
+					if (pid==0)
+					{
+						system(cmd.line);
+						_exit(0);
+					}
+				}
+				else
+				{
+					struct ActionJob j;
+					struct ActionCmd &c=r==1?sh:cmd;
+					pid=ActionExpand(c,environ,*args,j)?ActionLaunch(sinks,c,j):-1;
+				}
+				clock_gettime(CLOCK_MONOTONIC,&t1);
+				// a webhook is done when it has answered
+				if (r==2&&pid==0&&cmd.sink==SINK_HTTP)
+					for (int s=0;s<sinks.count;s++)
+						if (sinks.fd[s].kind==SINK_HTTP&&strcmp(sinks.fd[s].path,cmd.sinkpath)==0)
+						{
+							struct pollfd pfd={sinks.fd[s].fd,POLLIN,0};
+							if (poll(&pfd,1,1000)!=1) failed++;
+						}
+				if (pid<0||(pid>0&&(waitpid(pid,&status,0)<0||!WIFEXITED(status)||WEXITSTATUS(status)!=0))) failed++;
+				clock_gettime(CLOCK_MONOTONIC,&t2);
+				call+=(t1.tv_sec-t0.tv_sec)*1e6+(t1.tv_nsec-t0.tv_nsec)/1e3;
+				done+=(t2.tv_sec-t0.tv_sec)*1e6+(t2.tv_nsec-t0.tv_nsec)/1e3;
+			}
+			getrusage(RUSAGE_SELF,&s1);
+			getrusage(RUSAGE_CHILDREN,&c1);
+
+			double cpu=(s1.ru_utime.tv_sec-s0.ru_utime.tv_sec+s1.ru_stime.tv_sec-s0.ru_stime.tv_sec
+				+c1.ru_utime.tv_sec-c0.ru_utime.tv_sec+c1.ru_stime.tv_sec-c0.ru_stime.tv_sec)*1e6
+				+(s1.ru_utime.tv_usec-s0.ru_utime.tv_usec+s1.ru_stime.tv_usec-s0.ru_stime.tv_usec
+				+c1.ru_utime.tv_usec-c0.ru_utime.tv_usec+c1.ru_stime.tv_usec-c0.ru_stime.tv_usec);
+			printf("%-24.24s %-12s %10.1f %10.1f %10.1f",r==0||cmd.sink!=SINK_NONE?act[a]:"",runner[r],
+				call/count,done/count,cpu/count);
+			if (r==2&&(cmd.shell||cmd.append||cmd.sink!=SINK_NONE)) printf("  %s",ActionHow(cmd));
+			if (failed) printf("   %d failed",failed);
+			printf("\n");
+		}
+	}
+
+	ActionFree(cmd);
+	ActionFree(sh);
+	SinksClose(sinks);
+	free(args);
+	if (ballast!=NULL) free(ballast);
+	free(act);
+	return 0;
+}
+
+static int TestFailures;
+
+// Report one case of a selftest
+static void TestCheck(bool ok, const char *what)
+{
+	printf("  %-4s %s\n",ok?"ok":"FAIL",what);
+	if (!ok) TestFailures++;
+}
+
+// A config with Switch0 on pin 14 and Switch1 on pin 15, no bounce delay, and actions
+// that are only counted, since the tests run with Replaying set
+static struct ConfigData *TestConfig()
+{
+	struct ConfigData *cd=(struct ConfigData *)malloc(sizeof(struct ConfigData));
+
+	ConfigInit(*cd);
+	cd->statefile[0]=0;
+	cd->journaldir[0]=0;
+	WheelInit(cd->wheel,0);
+	for (int ID=0;ID<2;ID++)
+	{
+		struct FloatSwitch &s=cd->switchlist[ID];
+		s.initialized=1;
+		s.level=ID==0?200:300;
+		s.pin=14+ID;
+		s.bouncedelay=0;
+		cd->pinmask|=(uint64_t)1<<s.pin;
+		cd->pinswitch[s.pin]=ID;
+		HistoryResize(s.freq,cd->freqhistory);
+		ActionSet(s.OnAction,"true");
+		ActionSet(s.OffAction,"true");
+	}
+	return cd;
+}
+
+static void TestConfigFree(struct ConfigData *cd)
+{
+	for (int ID=0;ID<100;ID++)
+	{
+		if (cd->switchlist[ID].freq.buf!=NULL) free(cd->switchlist[ID].freq.buf);
+		ActionFree(cd->switchlist[ID].OnAction);
+		ActionFree(cd->switchlist[ID].OffAction);
+	}
+	ActionFree(cd->ratechange);
+	ActionFree(cd->overdue);
+	free(cd);
+}
+
+// When each of the wheel test's timers fired, and how often
+static struct
+{
+	int count;
+	msec_t at;
+} TestFired[6];
+static msec_t TestWheelNow;
+
+static void TestFire(struct ConfigData &, struct Timer *tm)
+{
+	TestFired[tm->id].count++;
+	TestFired[tm->id].at=TestWheelNow;
+}
+
+// The timer wheel driven from one WheelNext to the next: timers armed, cancelled and
+// re-armed, on the boundaries where a level cascades, and parked beyond the top level
+static void TestWheel(struct ReplayTally &)
+{
+	struct ConfigData *cd=TestConfig();
+	struct TimerWheel &w=cd->wheel;
+	struct Timer tm[6];
+	msec_t top=(msec_t)1<<(WHEEL_BITS*WHEEL_LEVELS);	// ticks the wheel spans
+	msec_t expect[6]={-1,1300,64*WHEEL_TICK,64*64*WHEEL_TICK,(2*top+124)*WHEEL_TICK,7*WHEEL_TICK};
+	char what[100];
+	int steps=0;
+
+	memset(tm,0,sizeof(tm));
+	memset(TestFired,0,sizeof(TestFired));
+	WheelInit(w,0);
+	for (int i=0;i<6;i++)
+	{
+		tm[i].fire=TestFire;
+		tm[i].id=i;
+	}
+	TimerArm(w,&tm[0],5000);
+	TimerArm(w,&tm[1],3000);
+	TimerArm(w,&tm[2],expect[2]);
+	TimerArm(w,&tm[3],expect[3]);
+	TimerArm(w,&tm[4],expect[4]-WHEEL_TICK/2);
+	TimerArm(w,&tm[5],expect[5]);
+	TimerCancel(w,&tm[0]);
+	TimerArm(w,&tm[1],1250);
+	TestCheck(w.count==5&&tm[0].pprev==NULL,"a cancelled timer leaves the wheel");
+
+	while ((TestWheelNow=WheelNext(w))>=0&&steps++<10000)
+		WheelAdvance(w,*cd,TestWheelNow);
+	TestCheck(w.count==0&&steps<10000,"the wheel runs dry");
+	TestCheck(TestFired[0].count==0,"the cancelled timer never fires");
+	const char *name[6]={NULL,"a re-armed timer","a timer on a level 1 boundary","a timer on a level 2 boundary",
+		"a timer parked beyond the top level","a timer in level 0"};
+	for (int i=1;i<6;i++)
+	{
+		snprintf(what,sizeof(what),"%s fires once, at WheelNext's time %lld",name[i],(long long)expect[i]);
+		TestCheck(TestFired[i].count==1&&TestFired[i].at==expect[i],what);
+	}
+
+	// a timer that has fired can be armed again
+	TimerArm(w,&tm[1],expect[4]+WHEEL_TICK);
+	TestWheelNow=WheelNext(w);
+	WheelAdvance(w,*cd,TestWheelNow);
+	TestCheck(TestFired[1].count==2&&TestFired[1].at==expect[4]+WHEEL_TICK&&w.count==0,"a timer armed again after firing fires again");
+	TestConfigFree(cd);
+}
+
+// Levels handed to ScanSwitches, or a read that fails
+struct TestInput
+{
+	uint64_t levels;
+	uint64_t latched;
+	bool fail;
+
+	bool Levels(uint64_t &l)
+	{
+		if (fail) errno=EIO;
+		l=levels;
+		return !fail;
+	}
+	uint64_t Latched() { return latched; }
+};
+
+// ScanSwitches acting on the levels it reads, and on a read that fails
+static void TestScan(struct ReplayTally &tally)
+{
+	struct ConfigData *cd=TestConfig();
+	struct TestInput in;
+	int64_t actions=tally.actions;
+
+	memset(&in,0,sizeof(in));
+	in.levels=(uint64_t)1<<14;
+	TestCheck(!ScanSwitches(in,*cd,1000)&&cd->switchlist[0].state==HIGH&&cd->statebits==in.levels&&tally.actions==actions+1,
+		"a pin that reads high turns its switch On");
+	in.fail=true;
+	in.levels=0;
+	TestCheck(ScanSwitches(in,*cd,2000)&&cd->switchlist[0].state==HIGH&&tally.actions==actions+1,
+		"a scan that can't read the pins is retried without Off edges");
+	in.fail=false;
+	TestCheck(!ScanSwitches(in,*cd,3000)&&cd->switchlist[0].state==LOW&&tally.actions==actions+2,
+		"the Off is seen once the pins read again");
+	TestConfigFree(cd);
+}
+
+// Switch0 through n On/Off cycles a minute and a bit more each time apart, starting at t
+static msec_t TestCycles(struct ConfigData *cd, struct TestInput &in, msec_t t, int n)
+{
+	for (int i=0;i<n;i++,t+=60000+i*1000)
+	{
+		in.levels=(uint64_t)1<<14;
+		ScanSwitches(in,*cd,t);
+		in.levels=0;
+		ScanSwitches(in,*cd,t+20000);
+	}
+	return t;
+}
 
-			continue;
-		}
+// What of Switch0 the state file has to bring back
+struct TestState
+{
+	struct FreqHistory freq;
+	msec_t freqbuf[FREQ_HISTORY_MAX];
+	struct RunningStats interval;
+	struct RunningStats onduration;
+	int64_t cycles;
+	msec_t LastOn;
+};
 
-		if (sa_strcmp(cline,"HighWater")==0)
-		{
-			if (!initial) continue; // only load action scripts if not initial load
+static void TestStateTake(struct ConfigData *cd, struct TestState &ts)
+{
+	struct FloatSwitch &s=cd->switchlist[0];
+
+	memset(&ts,0,sizeof(ts));
+	ts.freq=s.freq;
+	memcpy(ts.freqbuf,s.freq.buf,s.freq.depth*sizeof(msec_t));
+	ts.interval=s.interval;
+	ts.onduration=s.onduration;
+	ts.cycles=s.cycles;
+	ts.LastOn=s.LastOn;
+}
 
-			// remove whitespace around '='
-			trim(cline+9);
-			trim(cline+10);
+static bool TestStateSame(struct ConfigData *cd, struct TestState &ts)
+{
+	struct TestState now;
 
-			cd.highwater=atoi(cline+10);
-			snprintf(logme,939,"HighWater set to %d",cd.lowwater);
-			WriteLog(logme,3);
+	TestStateTake(cd,now);
+	return now.freq.depth==ts.freq.depth&&now.freq.head==ts.freq.head&&now.freq.count==ts.freq.count&&now.freq.sum==ts.freq.sum&&
+		memcmp(now.freqbuf,ts.freqbuf,sizeof(now.freqbuf))==0&&memcmp(&now.interval,&ts.interval,sizeof(now.interval))==0&&
+		memcmp(&now.onduration,&ts.onduration,sizeof(now.onduration))==0&&now.cycles==ts.cycles&&now.LastOn==ts.LastOn;
+}
 
-			continue;
-		}
+// A config reading the state file at path. The mapping is dropped without the save
+// StateClose does, so the slots are left as the test wrote them
+static struct ConfigData *TestStateOpen(const char *path, bool &opened)
+{
+	struct ConfigData *cd=TestConfig();
 
-		if (sa_strcmp(cline,"RateChangeAmt")==0)
-		{
-			// remove whitespace around '='
-			trim(cline+13);
-			trim(cline+14);
+	snprintf(cd->statefile,sizeof(cd->statefile),"%s",path);
+	opened=StateOpen(*cd);
+	return cd;
+}
 
-			cd.ratechangeamt=atoi(cline+14);
-			snprintf(logme,939,"Rate Change percentage set to %d",cd.ratechangeamt);
-			WriteLog(logme,3);
+static void TestStateDrop(struct ConfigData *cd)
+{
+	if (cd->state!=NULL) munmap(cd->state,sizeof(struct StateFile));
+	cd->state=NULL;
+	TestConfigFree(cd);
+}
 
-			continue;
-		}
+// Flip a byte in the switches of slot i of the state file at path
+static void TestStateCorrupt(const char *path, int i)
+{
+	int fd=open(path,O_RDWR);
+	off_t off=offsetof(struct StateFile,slot)+i*sizeof(struct StateSlot)+offsetof(struct StateSlot,sw);
+	uint8_t b=0;
 
-		if (sa_strcmp(cline,"OverdueThreshold")==0)
-		{
-			// remove whitespace around '='
-			trim(cline+16);
-			trim(cline+17);
+	if (fd<0) return;
+	if (pread(fd,&b,1,off)==1)
+	{
+		b^=0xff;
+		if (pwrite(fd,&b,1,off)!=1) {}
+	}
+	close(fd);
+}
 
-			cd.overduethreshold=atoi(cline+17);
-			snprintf(logme,939,"Rate Change percentage set to %d",cd.overduethreshold);
-			WriteLog(logme,3);
+// The state file saved and reopened, and its older copy taken when the newer one is
+// corrupt
+static void TestState(struct ReplayTally &)
+{
+	char dir[]="/tmp/sumpalarm.XXXXXX", path[64];
+	struct TestState older, newer;
+	struct TestInput in;
+	struct StateFile sf;
+	msec_t offset=MonoOffset;
+	bool opened;
+
+	if (mkdtemp(dir)==NULL)
+	{
+		TestCheck(false,"a directory for the test files");
+		return;
+	}
+	snprintf(path,sizeof(path),"%s/state",dir);
+	memset(&in,0,sizeof(in));
+
+	// two saves, the second one by StateClose, a cycle apart
+	struct ConfigData *cd=TestStateOpen(path,opened);
+	TestCheck(opened&&cd->state!=NULL&&cd->switchlist[0].freq.count==0,"a new state file starts empty");
+	msec_t t=TestCycles(cd,in,1000,5);
+	StateSave(*cd);
+	TestStateTake(cd,older);
+	TestCycles(cd,in,t,1);
+	TestStateTake(cd,newer);
+	StateClose(*cd);
+	TestConfigFree(cd);
+	TestCheck(older.cycles==5&&newer.cycles==6&&older.freq.sum!=newer.freq.sum&&older.LastOn!=newer.LastOn,"the two saves differ");
+
+	cd=TestStateOpen(path,opened);
+	TestCheck(opened&&TestStateSame(cd,newer),"reopening restores the frequency ring, the statistics and LastOn");
+	TestCheck(cd->freq==newer.freq.sum/newer.freq.count,"and the average frequency");
+	TestStateDrop(cd);
+
+	// the slot with the higher generation is the newer one
+	int fd=open(path,O_RDONLY);
+	if (fd<0||read(fd,&sf,sizeof(sf))!=sizeof(sf)) memset(&sf,0,sizeof(sf));
+	if (fd>=0) close(fd);
+	TestStateCorrupt(path,sf.slot[0].generation>sf.slot[1].generation?0:1);
+	cd=TestStateOpen(path,opened);
+	TestCheck(opened&&TestStateSame(cd,older),"with the newer copy corrupt the older one is restored");
+	TestStateDrop(cd);
+
+	TestStateCorrupt(path,sf.slot[0].generation>sf.slot[1].generation?1:0);
+	cd=TestStateOpen(path,opened);
+	TestCheck(opened&&cd->switchlist[0].freq.count==0&&cd->switchlist[0].LastOn==0,"with both corrupt the history starts fresh");
+	TestStateDrop(cd);
+
+	MonoOffset=offset;
+	unlink(path);
+	rmdir(dir);
+}
 
-			continue;
-		}
+// Records a journal read hands back
+struct TestRecords
+{
+	struct JournalRecord rec[4096];
+	int count;
+};
 
-		if (sa_strcmp(cline,"RateChange")==0)
-		{
-			// remove whitespace around '='
-			trim(cline+10);
-			trim(cline+11);
+static void TestCollect(void *ctx, const struct JournalRecord &rec)
+{
+	struct TestRecords &tr=*(struct TestRecords *)ctx;
+	if (tr.count<4096) tr.rec[tr.count++]=rec;
+}
 
-			if (strlen(cline+11)<=0) continue;
+// A config with its journal in dir, in the smallest segments, with every record
+// written at once and fsyncs left to the timer
+static struct ConfigData *TestJournalConfig(const char *dir)
+{
+	struct ConfigData *cd=TestConfig();
+
+	snprintf(cd->journaldir,sizeof(cd->journaldir),"%s",dir);
+	cd->journalsegment=8;
+	cd->journalkeep=0;
+	cd->journalflush=0;
+	cd->journalsync=3600;
+	return cd;
+}
 
-			if (cd.ratechange!=NULL)
-			{
-				if (strcmp(cd.ratechange,cline+11)==0) continue;
-				else
-				{
-					free(cd.ratechange);
-					cd.ratechange=(char *)malloc(strlen(cline+11)+1);
-					strcpy(cd.ratechange,cline+11);
-				}
-			}
-			else
-			{
-				cd.ratechange=(char *)malloc(strlen(cline+11)+1);
-				strcpy(cd.ratechange,cline+11);
-			}
-			snprintf(logme,939,"Rate Change command string set: %s",cd.ratechange);
-			WriteLog(logme,3);
+// n records from record k on, alternately On and Off for switches 0 and 1, 7s apart
+static void TestJournalAdd(struct ConfigData *cd, int k, int n)
+{
+	for (int i=k;i<k+n;i++) JournalAdd(*cd,i/2%2,i%2==0,1000000+(msec_t)i*7000,i);
+}
 
-			continue;
-		}
+// true if tr holds records k to k+n-1 as TestJournalAdd wrote them
+static bool TestJournalSame(struct TestRecords &tr, int k, int n)
+{
+	if (tr.count!=n) return false;
+	for (int i=0;i<n;i++)
+	{
+		const struct JournalRecord &r=tr.rec[i];
+		if (r.mono!=1000000+(msec_t)(k+i)*7000||r.id!=(k+i)/2%2||r.edge!=((k+i)%2==0)||r.duration!=k+i) return false;
+	}
+	return true;
+}
 
-		if (sa_strcmp(cline,"Overdue")==0&&sa_strcmp(cline,"OverdueT")!=0)
-		{
-			// remove whitespace around '='
-			trim(cline+7);
-			trim(cline+8);
+// Journal records written, rolled over into new segments, and read back, and a torn
+// block at the end of the last segment cut off when the journal is reopened
+static void TestJournal(struct ReplayTally &)
+{
+	char dir[]="/tmp/sumpalarm.XXXXXX", path[64];
+	struct TestRecords *tr=(struct TestRecords *)malloc(sizeof(struct TestRecords));
+	uint32_t seq[16];
+	int64_t matched;
+	struct stat st;
 
-			if (strlen(cline+8)<=0) continue;
+	if (mkdtemp(dir)==NULL)
+	{
+		TestCheck(false,"a directory for the test files");
+		free(tr);
+		return;
+	}
+	struct ConfigData *cd=TestJournalConfig(dir);
+	TestCheck(JournalOpen(*cd)&&cd->journal.seq==1,"a new journal starts at segment 1");
+	TestJournalAdd(cd,0,500);
+	JournalClose(*cd);
+
+	int nseg=JournalSegments(dir,seq,16);
+	bool fits=nseg>=3;
+	for (int i=0;i<nseg;i++)
+	{
+		snprintf(path,sizeof(path),"%s/journal.%08u",dir,seq[i]);
+		if (stat(path,&st)<0||st.st_size>8*1024||seq[i]!=(uint32_t)i+1) fits=false;
+	}
+	TestCheck(fits,"full segments roll over into the next one");
+	tr->count=0;
+	JournalRead(dir,0,INT64_MAX,-1,false,TestCollect,tr,matched);
+	TestCheck(TestJournalSame(*tr,0,500),"every record reads back, in order");
+	bool stamped=tr->count>0;
+	int64_t offset=WallMs()-MonoMs();
+	for (int i=0;i<tr->count;i++)
+		if (llabs(tr->rec[i].wall-(tr->rec[i].mono+offset))>1000) stamped=false;
+	TestCheck(stamped,"records are stamped with the wall clock time of their edges");
+
+	// half of a block, as a power cut part way through a write leaves it
+	snprintf(path,sizeof(path),"%s/journal.%08u",dir,seq[nseg-1]);
+	stat(path,&st);
+	off_t size=st.st_size;
+	cd->journal.blk.magic=JOURNAL_BLOCK_MAGIC;
+	cd->journal.blk.count=10;
+	int fd=open(path,O_WRONLY|O_APPEND);
+	if (fd<0||write(fd,&cd->journal.blk,JournalBlockSize(5))<0) {}
+	if (fd>=0) close(fd);
+	cd->journal.blk.count=0;
+
+	TestCheck(JournalOpen(*cd)&&cd->journal.seq==seq[nseg-1]&&cd->journal.size==size,"reopening cuts the torn block off the last segment");
+	TestJournalAdd(cd,500,20);
+	JournalClose(*cd);
+	tr->count=0;
+	JournalRead(dir,0,INT64_MAX,-1,false,TestCollect,tr,matched);
+	TestCheck(TestJournalSame(*tr,0,520),"and carries on after the last intact record");
+
+	TestConfigFree(cd);
+	nseg=JournalSegments(dir,seq,16);
+	for (int i=0;i<nseg;i++)
+	{
+		snprintf(path,sizeof(path),"%s/journal.%08u",dir,seq[i]);
+		unlink(path);
+		snprintf(path,sizeof(path),"%s/journal.%08u.idx",dir,seq[i]);
+		unlink(path);
+	}
+	rmdir(dir);
+	free(tr);
+}
 
-			if (cd.overdue!=NULL)
-			{
-				if (strcmp(cd.overdue,cline+8)==0) continue;
-				else
-				{
-					free(cd.overdue);
-					cd.overdue=(char *)malloc(strlen(cline+8)+1);
-					strcpy(cd.overdue,cline+8);
-				}
-			}
-			else
-			{
-				cd.overdue=(char *)malloc(strlen(cline+8)+1);
-				strcpy(cd.overdue,cline+8);
-			}
-			snprintf(logme,939,"Overdue command string set: %s",cd.overdue);
-			WriteLog(logme,3);
+// true if reading from..to through the indexes gives the same n records as reading
+// every segment from the start
+static bool TestQuerySame(const char *dir, int64_t from, int64_t to, int sw, int n, struct TestRecords *a, struct TestRecords *b)
+{
+	int64_t matched;
 
-			continue;
-		}
+	a->count=b->count=0;
+	JournalRead(dir,from,to,sw,true,TestCollect,a,matched);
+	JournalRead(dir,from,to,sw,false,TestCollect,b,matched);
+	return a->count==n&&b->count==n&&memcmp(a->rec,b->rec,n*sizeof(struct JournalRecord))==0;
+}
 
-		if (sa_strcmp(cline,"Switch")==0)
-		{
-			// Determine ID of switch
-			if (cline[6]<'0'||cline[6]>'9')
-				continue; // Invalid (non numeric) switch ID
-			ID=cline[6]-'0';
-			if (cline[7]>='0'&&cline[7]<='9')
-				ID=ID*10+(cline[7]-'0'); // 2-digit switch ID
+// Ranges of a journal of many segments read through the indexes and by a full scan,
+// before and after old segments are pruned and with an index missing
+static void TestQuery(struct ReplayTally &)
+{
+	char dir[]="/tmp/sumpalarm.XXXXXX", path[64];
+	struct TestRecords *all=(struct TestRecords *)malloc(sizeof(struct TestRecords));
+	struct TestRecords *a=(struct TestRecords *)malloc(sizeof(struct TestRecords));
+	struct TestRecords *b=(struct TestRecords *)malloc(sizeof(struct TestRecords));
+	int range[][2]={{0,2999},{5,17},{230,250},{1000,1500},{1999,2000},{2990,2999}};
+	uint32_t seq[64];
+	int64_t matched, scanned;
+	bool same;
+
+	if (mkdtemp(dir)==NULL)
+	{
+		TestCheck(false,"a directory for the test files");
+		free(all);
+		free(a);
+		free(b);
+		return;
+	}
 
-			int digits=1; // note the number of digits in the Switch ID for parsing
-			if (ID>9)digits=2;
+	// blocks of 10 records, so each segment has a few index entries
+	struct ConfigData *cd=TestJournalConfig(dir);
+	cd->journalflush=3600;
+	JournalOpen(*cd);
+	for (int k=0;k<3000;k+=10)
+	{
+		TestJournalAdd(cd,k,10);
+		JournalFlush(*cd,false);
+	}
+	JournalClose(*cd);
+	all->count=0;
+	scanned=JournalRead(dir,0,INT64_MAX,-1,false,TestCollect,all,matched);
+	TestCheck(TestJournalSame(*all,0,3000)&&JournalSegments(dir,seq,64)>=8,"3000 records in 8 or more segments");
 
-			// determine which parameter of the switch is being set
-			if (sa_strcmp(cline+6+digits,"Level")==0)
+	same=true;
+	for (int i=0;i<6;i++)
+	{
+		int64_t from=all->rec[range[i][0]].wall, to=all->rec[range[i][1]].wall;
+		if (!TestQuerySame(dir,from,to,-1,range[i][1]-range[i][0]+1,a,b)||a->rec[0].duration!=range[i][0]) same=false;
+		if (!TestQuerySame(dir,from+1,to-1,-1,range[i][1]-range[i][0]-1,a,b)) same=false;
+	}
+	TestCheck(same,"ranges read through the index match a full scan");
+
+	// ranges starting either side of each index entry and of the record before it
+	int64_t near[]={-7001,-7000,-6999,-1,0,1};
+	same=true;
+	int nseg=JournalSegments(dir,seq,64), entries=0;
+	for (int i=0;i<nseg;i++)
+	{
+		struct JournalIndexEntry e[64];
+		snprintf(path,sizeof(path),"%s/journal.%08u.idx",dir,seq[i]);
+		int fd=open(path,O_RDONLY);
+		int n=fd>=0&&lseek(fd,sizeof(struct JournalIndexHeader),SEEK_SET)>=0?read(fd,e,sizeof(e))/(int)sizeof(e[0]):0;
+		if (fd>=0) close(fd);
+		for (int k=0;k<n;k++,entries++)
+			for (int d=0;d<6;d++)
 			{
-				trim(cline+11+digits);
-				trim(cline+12+digits);
-				cd.switchlist[ID].level=atoi(cline+12+digits);
-				snprintf(logme,939,"Switch %d Level set: %d",ID,cd.switchlist[ID].level);
-				WriteLog(logme,3);
-				continue;
+				int64_t from=e[k].wall+near[d];
+				int count=0;
+				for (int r=0;r<all->count;r++)
+					if (all->rec[r].wall>=from&&all->rec[r].wall<=from+70000) count++;
+				if (!TestQuerySame(dir,from,from+70000,-1,count,a,b)) same=false;
 			}
+	}
+	TestCheck(same&&entries>nseg,"so do ranges starting at an index entry");
+	TestCheck(TestQuerySame(dir,all->rec[100].wall,all->rec[2100].wall,1,1000,a,b),"and so does one switch");
+	TestCheck(TestQuerySame(dir,all->rec[2999].wall+1,INT64_MAX,-1,0,a,b)&&TestQuerySame(dir,0,all->rec[0].wall-1,-1,0,a,b),
+		"ranges outside the journal are empty");
+	TestCheck(JournalRead(dir,all->rec[2500].wall,all->rec[2510].wall,-1,true,TestCollect,a,matched)<scanned/10,
+		"the index skips what comes before the range");
+
+	// keep 4 segments, reopening the journal first so the last one's index is rebuilt
+	cd->journalkeep=4;
+	JournalOpen(*cd);
+	TestJournalAdd(cd,3000,1000);
+	JournalClose(*cd);
+	nseg=JournalSegments(dir,seq,64);
+	bool pruned=nseg==4;
+	for (int i=0;i<nseg;i++)
+	{
+		snprintf(path,sizeof(path),"%s/journal.%08u.idx",dir,seq[i]);
+		if (access(path,F_OK)<0) pruned=false;
+	}
+	snprintf(path,sizeof(path),"%s/journal.%08u.idx",dir,seq[0]-1);
+	TestCheck(pruned&&access(path,F_OK)<0,"pruning leaves the newest segments, each with its index");
+
+	all->count=0;
+	JournalRead(dir,0,INT64_MAX,-1,false,TestCollect,all,matched);
+	int first=all->count>0?all->rec[0].duration:0;
+	TestCheck(TestJournalSame(*all,first,4000-first),"the records left run on to the last one");
+	same=all->count>100;
+	for (int i=0;same&&i+50<all->count;i+=37)
+		if (!TestQuerySame(dir,all->rec[i].wall,all->rec[i+50].wall,-1,51,a,b)) same=false;
+	TestCheck(same,"ranges read through the index still match a full scan");
+
+	// a segment without its index is scanned, and an index without its segment is ignored
+	snprintf(path,sizeof(path),"%s/journal.%08u.idx",dir,seq[1]);
+	unlink(path);
+	snprintf(path,sizeof(path),"%s/journal.%08u",dir,seq[0]);
+	unlink(path);
+	a->count=0;
+	JournalRead(dir,0,INT64_MAX,-1,false,TestCollect,a,matched);
+	same=a->count>0;
+	for (int i=0;same&&i+50<a->count;i+=37)
+		if (!TestQuerySame(dir,a->rec[i].wall,a->rec[i+50].wall,-1,51,b,all)) same=false;
+	TestCheck(same,"with an index or a segment missing the ranges still match");
+
+	// the next segment clears the index left behind
+	JournalOpen(*cd);
+	TestJournalAdd(cd,4000,300);
+	JournalClose(*cd);
+	snprintf(path,sizeof(path),"%s/journal.%08u.idx",dir,seq[0]);
+	TestCheck(access(path,F_OK)<0,"an index whose segment is gone is pruned");
+
+	TestConfigFree(cd);
+	DIR *d=opendir(dir);
+	struct dirent *de;
+	while (d!=NULL&&(de=readdir(d))!=NULL)
+		if (de->d_name[0]!='.') unlinkat(dirfd(d),de->d_name,0);
+	if (d!=NULL) closedir(d);
+	rmdir(dir);
+	free(all);
+	free(a);
+	free(b);
+}
 
-			if (sa_strcmp(cline+6+digits,"Pin")==0)
-			{
-				if (!initial) continue;
-				trim(cline+9+digits);
-				trim(cline+10+digits);
-				cd.switchlist[ID].pin=atoi(cline+10+digits);
+// The register block backend on the simulated block in private memory: levels and
+// latched edges driven through GPLEV and GPEDS the way the SoC sets them, and the edges
+// ScanSwitches reports for them
+static void TestRegisters(struct ReplayTally &tally)
+{
+	struct ConfigData *cd=TestConfig();
+	struct SimInput sim;
+	uint64_t levels;
+
+	cd->edgelatch=1;
+	sim.Open(*cd);
+	TestCheck((sim.regs[BCM2835_GPREN0/4]&sim.regs[BCM2835_GPFEN0/4])==(3u<<14)&&sim.regs[BCM2835_GPREN1/4]==0,
+		"edge detect is armed for the switch pins only");
+
+	int64_t actions=tally.actions;
+	sim.SetPin(15,HIGH);
+	sim.SetPin(40,HIGH);
+	TestCheck(sim.Levels(levels)&&levels==((uint64_t)1<<15|(uint64_t)1<<40),"GPLEV0 and GPLEV1 read as one bitmap");
+	ScanSwitches(sim,*cd,1000);
+	TestCheck(cd->switchlist[1].state==HIGH&&cd->switchlist[0].state==LOW&&tally.actions==actions+1,
+		"a level change is reported once, for its switch only");
+	TestCheck(sim.regs[BCM2835_GPEDS0/4]==0,"reading the latched edges clears them");
+	ScanSwitches(sim,*cd,2000);
+	TestCheck(tally.actions==actions+1,"an edge already seen isn't reported again");
+
+	// Switch0 on and off again between two scans
+	sim.SetPin(14,HIGH);
+	sim.SetPin(14,LOW);
+	ScanSwitches(sim,*cd,3000);
+	TestCheck(cd->switchlist[0].state==LOW&&cd->switchlist[0].LastOn==3000&&cd->switchlist[0].LastOff==3000&&tally.actions==actions+3,
+		"a pulse between scans is reported as On then Off");
+	ScanSwitches(sim,*cd,4000);
+	TestCheck(tally.actions==actions+3,"and only once");
+
+	// the same pulse with edge detection off is missed, as it was before
+	sim.Close();
+	cd->edgelatch=0;
+	sim.Open(*cd);
+	sim.SetPin(15,HIGH);
+	ScanSwitches(sim,*cd,5000);
+	sim.SetPin(14,HIGH);
+	sim.SetPin(14,LOW);
+	actions=tally.actions;
+	ScanSwitches(sim,*cd,6000);
+	TestCheck(tally.actions==actions&&sim.regs[BCM2835_GPEDS0/4]==0,"without EdgeLatch nothing is latched");
+	sim.Close();
+	TestConfigFree(cd);
+}
 
-				// validate value
-				if (cd.switchlist[ID].pin!=0)
-				{
-					// a switch is only considered initialized when a Pin number has been set
-					cd.switchlist[ID].initialized=1;
-					snprintf(logme,939,"Switch %d Pin set: %d",ID,cd.switchlist[ID].pin);
-					WriteLog(logme,3);
-					continue;
-				}
-				else
-				{
-					snprintf(logme,939,"Switch%d GPIO PIN invalid");
-					WriteLog(logme,1);
-					exit(1);
-				}
-			}
+// true if s is pat, where a * in pat stands for any run of characters but |
+static bool TestMatch(const char *pat, const char *s)
+{
+	if (*pat=='*')
+	{
+		for (;;s++)
+		{
+			if (TestMatch(pat+1,s)) return true;
+			if (*s==0||*s=='|') return false;
+		}
+	}
+	if (*pat!=*s) return false;
+	return *s==0||TestMatch(pat+1,s+1);
+}
 
-			if (sa_strcmp(cline+6+digits,"Bounce")==0)
-			{
-				trim(cline+12+digits);
-				trim(cline+13+digits);
-				cd.switchlist[ID].bouncedelay=atoi(cline+13+digits);
-				snprintf(logme,939,"Switch %d Bounce Delay set: %d",ID,cd.switchlist[ID].bouncedelay);
-				continue;
-			}
+// Action lines compiled and filled in from an event's environment. The result is the
+// words joined by |, then the > or >> file, with "append" in front for an echo the daemon
+// writes itself and "sh -c" for a line that is left to the shell
+static void TestTemplates(struct ReplayTally &)
+{
+	struct
+	{
+		const char *line;
+		const char *expect;
+	} t[]=
+	{
+		{"logger -t sump  hello","logger|-t|sump|hello"},
+		{"logger 'a  b' \"c d\" 'it''s'","logger|a  b|c d|its"},
+		{"logger \"rate $SARATE L/h\"","logger|rate 120 L/h"},
+		{"logger $SARATE$NAME","logger|120pump|one"},
+		{"logger ${NAME}x","logger|pump|onex"},
+		{"logger \"${NAME}x\"","logger|pump onex"},
+		{"logger $EMPTY end","logger|end"},
+		{"logger \"$EMPTY\" '' end","logger|||end"},
+		{"logger $UNSET$SARATE","logger|120"},
+		{"logger at $(date)","logger|at|*|*|*|*|*|*"},
+		{"logger \"at $(date)\"","logger|at *"},
+		{"echo $SARATE L/h > /tmp/rate","append echo|120|L/h > /tmp/rate"},
+		{"echo \"$NAME\" >>'/tmp/my log'","append echo|pump one >> /tmp/my log"},
+		{"echo -n $SARATE >/tmp/rate","echo|-n|120 > /tmp/rate"},
+		{"cat /proc/loadavg >> /tmp/load","cat|/proc/loadavg >> /tmp/load"},
+		{"ls | wc -l","sh -c"},
+		{"true; false","sh -c"},
+		{"true && false","sh -c"},
+		{"echo `date`","sh -c"},
+		{"echo \"`date`\"","sh -c"},
+		{"echo $((1+2))","sh -c"},
+		{"echo $(hostname)","sh -c"},
+		{"echo $1 $?","sh -c"},
+		{"echo ${NAME:-x}","sh -c"},
+		{"echo \"a\\\"b\"","sh -c"},
+		{"echo 'open","sh -c"},
+		{"ls *.log","sh -c"},
+		{"echo ~","sh -c"},
+		{"echo a > b c","sh -c"},
+		{"echo a >","sh -c"},
+		{"echo a > b > c","sh -c"},
+		{"> /tmp/x","sh -c"},
+		{"cd /tmp","sh -c"},
+		{"RATE=1 logger x","sh -c"},
+		{NULL,NULL}
+	};
+	char *envp[]={(char *)"NAME=pump one",(char *)"EMPTY=",(char *)"SARATE=120",NULL};
+	struct ActionArgs *x=(struct ActionArgs *)malloc(sizeof(struct ActionArgs));
+	struct ActionCmd a;
+	struct ActionJob j;
+	char got[600], what[1400];
+
+	ActionInit(a,"Test",0);
+	for (int i=0;t[i].line!=NULL;i++)
+	{
+		int n=0;
 
-			if (sa_strcmp(cline+6+digits,"On")==0)
-			{
-				trim(cline+8+digits);
-				trim(cline+9+digits);
+		ActionSet(a,t[i].line);
+		if (!ActionExpand(a,envp,*x,j)) snprintf(got,sizeof(got),"(does not fit)");
+		else if (a.shell)
+			snprintf(got,sizeof(got),"%s",strcmp(j.argv[0],"/bin/sh")==0&&strcmp(j.argv[1],"-c")==0&&j.argv[2]==a.line&&j.argv[3]==NULL?"sh -c":"(bad sh -c)");
+		else
+		{
+			if (a.append) n+=snprintf(got+n,sizeof(got)-n,"append ");
+			for (int w=0;j.argv[w]!=NULL&&n<(int)sizeof(got);w++) n+=snprintf(got+n,sizeof(got)-n,"%s%s",w>0?"|":"",j.argv[w]);
+			if (j.target!=NULL&&n<(int)sizeof(got)) snprintf(got+n,sizeof(got)-n," %s %s",j.redirect==O_APPEND?">>":">",j.target);
+		}
+		if (TestMatch(t[i].expect,got)) snprintf(what,sizeof(what),"%s  =>  %s",t[i].line,got);
+		else snprintf(what,sizeof(what),"%s  =>  %s, expected %s",t[i].line,got,t[i].expect);
+		TestCheck(TestMatch(t[i].expect,got),what);
+	}
+	ActionFree(a);
+	free(x);
+}
 
-				if (strlen(cline+9)<=0) continue;
+// Read a request a sink sent to the test webhook on fd, up to the end of its body, into
+// buf. Gives up after a second without any of it
+static void TestRequest(int fd, char *buf, int size)
+{
+	struct pollfd p;
+	int len=0;
 
-				if (cd.switchlist[ID].OnAction!=NULL)
-				{
-					if (strcmp(cd.switchlist[ID].OnAction,cline+9)==0) continue;
-					else
-					{
-						free(cd.switchlist[ID].OnAction);
-						cd.switchlist[ID].OnAction=(char *)malloc(strlen(cline+9+digits)+1);
-						strcpy(cd.switchlist[ID].OnAction,cline+9+digits);
-					}
-				}
-				else
-				{
-					cd.switchlist[ID].OnAction=(char *)malloc(strlen(cline+9+digits)+1);
-					strcpy(cd.switchlist[ID].OnAction,cline+9+digits);
-				}
-				snprintf(logme,939,"Switch %d On Action set: %s",ID,cd.switchlist[ID].OnAction);
-				WriteLog(logme,3);
+	buf[0]=0;
+	p.fd=fd;
+	p.events=POLLIN;
+	while (len<size-1&&poll(&p,1,1000)==1)
+	{
+		ssize_t n=recv(fd,buf+len,size-1-len,0);
+		if (n<=0) break;
+		len+=n;
+		buf[len]=0;
+		char *end=strstr(buf,"\r\n\r\n"), *cl=strstr(buf,"Content-Length:");
+		if (end!=NULL&&cl!=NULL&&cl<end&&buf+len>=end+4+atoi(cl+15)) break;
+	}
+}
 
-				continue;
-			}
+// A test webhook listening on 127.0.0.1:port, any free port if port is 0
+static int TestListen(int &port)
+{
+	struct sockaddr_in sin;
+	socklen_t len=sizeof(sin);
+	int fd=socket(AF_INET,SOCK_STREAM|SOCK_CLOEXEC,0), on=1;
+
+	memset(&sin,0,sizeof(sin));
+	sin.sin_family=AF_INET;
+	sin.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	sin.sin_port=htons(port);
+	setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+	if (bind(fd,(struct sockaddr *)&sin,sizeof(sin))<0||listen(fd,4)<0||getsockname(fd,(struct sockaddr *)&sin,&len)<0)
+	{
+		close(fd);
+		return -1;
+	}
+	port=ntohs(sin.sin_port);
+	return fd;
+}
 
-			if (sa_strcmp(cline+6+digits,"Off")==0)
-			{
-				trim(cline+9+digits);
-				trim(cline+10+digits);
+// The next connection to the test webhook on lfd, -1 if none comes within a second
+static int TestAccept(int lfd)
+{
+	struct pollfd p;
 
-				if (strlen(cline+10)<=0) continue;
+	p.fd=lfd;
+	p.events=POLLIN;
+	if (lfd<0||poll(&p,1,1000)!=1) return -1;
+	return accept4(lfd,NULL,NULL,SOCK_CLOEXEC);
+}
 
-				if (cd.switchlist[ID].OffAction!=NULL)
-				{
-					if (strcmp(cd.switchlist[ID].OffAction,cline+10)==0) continue;
-					else
-					{
-						free(cd.switchlist[ID].OffAction);
-						cd.switchlist[ID].OffAction=(char *)malloc(strlen(cline+10+digits)+1);
-						strcpy(cd.switchlist[ID].OffAction,cline+10+digits);
-					}
-				}
-				else
-				{
-					cd.switchlist[ID].OffAction=(char *)malloc(strlen(cline+10+digits)+1);
-					strcpy(cd.switchlist[ID].OffAction,cline+10+digits);
-				}
-				snprintf(logme,939,"Switch %d Off Action set: %s",ID,cd.switchlist[ID].OffAction);
-				WriteLog(logme,3);
-				continue;
-			}
-		}
+// A test socket for unix: sinks bound at path
+static int TestDatagram(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd=socket(AF_UNIX,SOCK_DGRAM|SOCK_CLOEXEC,0);
+
+	memset(&sun,0,sizeof(sun));
+	sun.sun_family=AF_UNIX;
+	snprintf(sun.sun_path,sizeof(sun.sun_path),"%s",path);
+	unlink(path);
+	if (bind(fd,(struct sockaddr *)&sun,sizeof(sun))<0)
+	{
+		close(fd);
+		return -1;
 	}
+	return fd;
+}
 
-	fclose(conf);
+// Compile line, fill it in and write it as the daemon would
+static bool TestSink(struct SinkCache &sc, struct ActionCmd &a, const char *line)
+{
+	char *envp[]={(char *)"NAME=pump one",(char *)"SARATE=120",NULL};
+	struct ActionArgs x;
+	struct ActionJob j;
 
-	cd.capacity=(3.14159265*(cd.sumpdiameter/20.0)*(cd.sumpdiameter/20.0)*(cd.sumpdepth/10.0))/1000.0;
-	snprintf(logme,939,"Capacity set to %d Litres",cd.capacity);
-	WriteLog(logme,3);
+	ActionSet(a,line);
+	return ActionExpand(a,envp,x,j)&&SinkWrite(sc,a,j);
 }
 
-// Write a log entry to file or to the console if running verbose
-void WriteLog(const char *entry,int level)
+// The file:, unix: and http:// sinks against a file, a datagram socket and a webhook on
+// loopback, all in this process, including the sockets being restarted under them
+static void TestSinks(struct ReplayTally &)
 {
-	time_t lt;
-	time(&lt);
-	char logtime[40],logentry[1000];
-	strftime(logtime, 39, "%Y-%m-%d %T", localtime(&lt));
-	snprintf(logentry,999,"%s,\"%s\"\n",logtime,entry);
+	struct SinkCache sc;
+	struct ActionCmd a;
+	char dir[]="/tmp/sumpalarm.XXXXXX", path[600], sock[600], line[700], buf[2048];
+	const char *reply;
+	int fd, lfd, cfd, port=0;
+	ssize_t n;
+
+	if (mkdtemp(dir)==NULL)
+	{
+		TestCheck(false,"a directory for the test files");
+		return;
+	}
+	memset(&sc,0,sizeof(sc));
+	ActionInit(a,"Test",0);
+
+	// file:
+	snprintf(path,sizeof(path),"%s/log",dir);
+	snprintf(line,sizeof(line),"file:%s rate $SARATE",path);
+	TestCheck(TestSink(sc,a,line)&&TestSink(sc,a,line),"file: appends each message");
+	fd=open(path,O_RDONLY);
+	n=fd>=0?read(fd,buf,sizeof(buf)-1):-1;
+	buf[n>0?n:0]=0;
+	if (fd>=0) close(fd);
+	TestCheck(strcmp(buf,"rate 120\nrate 120\n")==0,"as one line each, with its variables filled in");
+
+	// unix:, with the reader restarted between messages
+	snprintf(sock,sizeof(sock),"%s/sock",dir);
+	snprintf(line,sizeof(line),"unix:%s $NAME",sock);
+	fd=TestDatagram(sock);
+	n=TestSink(sc,a,line)?recv(fd,buf,sizeof(buf)-1,MSG_DONTWAIT):-1;
+	buf[n>0?n:0]=0;
+	TestCheck(strcmp(buf,"pump one")==0,"unix: sends the message as one datagram");
+	close(fd);
+	unlink(sock);
+	TestCheck(!TestSink(sc,a,line),"unix: fails while nothing is listening");
+	fd=TestDatagram(sock);
+	n=TestSink(sc,a,line)?recv(fd,buf,sizeof(buf)-1,MSG_DONTWAIT):-1;
+	buf[n>0?n:0]=0;
+	TestCheck(strcmp(buf,"pump one")==0,"unix: reconnects once the reader is back");
+	close(fd);
+
+	// http://, answered in pieces, with an answer's body that looks like a status line
+	lfd=TestListen(port);
+	snprintf(line,sizeof(line),"http://127.0.0.1:%d/hook $NAME",port);
+	cfd=TestSink(sc,a,line)?TestAccept(lfd):-1;
+	TestRequest(cfd,buf,sizeof(buf));
+	TestCheck(strncmp(buf,"POST /hook HTTP/1.1\r\n",21)==0&&strstr(buf,"\r\n\r\npump one")!=NULL,"http:// posts the message to the webhook");
+	struct SinkFd &f=sc.fd[sc.count-1];
+	reply="HTTP/1.1 200 OK\r\nContent-";
+	send(cfd,reply,strlen(reply),MSG_NOSIGNAL);
+	TestCheck(SinkAnswers(f)&&f.status==0,"half an answer is held until the rest comes");
+	reply="Length: 12\r\n\r\nHTTP/1.1 500";
+	send(cfd,reply,strlen(reply),MSG_NOSIGNAL);
+	TestCheck(SinkAnswers(f)&&f.status==200&&f.body==0&&f.answerlen==0,"a status line in the body isn't taken for an answer");
+
+	TestSink(sc,a,line);
+	TestRequest(cfd,buf,sizeof(buf));
+	reply="HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+	send(cfd,reply,strlen(reply),MSG_NOSIGNAL);
+	TestCheck(SinkAnswers(f)&&f.status==503,"an answer other than 2xx is seen");
+
+	TestSink(sc,a,line);
+	TestRequest(cfd,buf,sizeof(buf));
+	reply="HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n";
+	send(cfd,reply,strlen(reply),MSG_NOSIGNAL);
+	TestCheck(!SinkAnswers(f),"a chunked answer can't be followed");
+	fd=TestSink(sc,a,line)?TestAccept(lfd):-1;
+	TestRequest(fd,buf,sizeof(buf));
+	TestCheck(strstr(buf,"\r\n\r\npump one")!=NULL,"so the next message goes on a new connection");
+	if (fd>=0) close(fd);
+	if (cfd>=0) close(cfd);
+
+	// the webhook restarted on the same port
+	close(lfd);
+	TestCheck(!TestSink(sc,a,line),"http:// fails while the webhook is down");
+	lfd=TestListen(port);
+	cfd=TestSink(sc,a,line)?TestAccept(lfd):-1;
+	TestRequest(cfd,buf,sizeof(buf));
+	TestCheck(strstr(buf,"\r\n\r\npump one")!=NULL,"http:// reconnects once the webhook is back");
+	if (cfd>=0) close(cfd);
+	close(lfd);
+
+	SinksClose(sc);
+	ActionFree(a);
+	unlink(path);
+	unlink(sock);
+	rmdir(dir);
+}
 
-	if (!verbose&&level<=LogLevel)
+#ifdef INPUT_GPIOCHIP
+// The gpiochip backend with a pipe in place of its line request. Edges are written to
+// the pipe as the kernel queues them, and reading the levels fails the way it does on a
+// request the kernel has taken back
+static void TestGpioChip(struct ReplayTally &tally)
+{
+	struct ConfigData *cd=TestConfig();
+	struct gpio_v2_line_event ev[4];
+	GpioChipInput in;
+	uint64_t levels;
+	int p[2];
+
+	if (pipe2(p,O_NONBLOCK|O_CLOEXEC)<0) return TestCheck(false,"pipe for the line request");
+	in.fd=p[0];
+	in.numlines=2;
+	in.linepin[0]=14;
+	in.linepin[1]=15;
+
+	TestCheck(!in.Levels(levels),"a level read that fails is reported");
+	cd->switchlist[0].state=HIGH;
+	cd->statebits=(uint64_t)1<<14;
+	int64_t actions=tally.actions;
+	TestCheck(ScanSwitches(in,*cd,1000)&&cd->switchlist[0].state==HIGH&&tally.actions==actions,
+		"so the scan is retried without Off edges");
+
+	// Switch1 on at 2s and off at 3s, an edge on a pin with no switch, and a repeat of
+	// the Off, all stamped by the kernel
+	memset(ev,0,sizeof(ev));
+	ev[0].offset=15;
+	ev[0].id=GPIO_V2_LINE_EVENT_RISING_EDGE;
+	ev[0].timestamp_ns=2000000000ULL;
+	ev[1].offset=20;
+	ev[1].id=GPIO_V2_LINE_EVENT_RISING_EDGE;
+	ev[1].timestamp_ns=2500000000ULL;
+	ev[2].offset=15;
+	ev[2].id=GPIO_V2_LINE_EVENT_FALLING_EDGE;
+	ev[2].timestamp_ns=3000000000ULL;
+	ev[3]=ev[2];
+	ev[3].timestamp_ns=3500000000ULL;
+
+	if (write(p[1],ev,sizeof(ev[0]))!=sizeof(ev[0])) TestCheck(false,"write to the line request");
+	in.Events(*cd);
+	TestCheck(cd->switchlist[1].state==HIGH&&cd->switchlist[1].LastOn==2000+MonoOffset&&tally.actions==actions+1,
+		"a rising edge turns the switch On at the kernel's timestamp");
+	if (write(p[1],ev+1,sizeof(ev[0])*3)!=sizeof(ev[0])*3) TestCheck(false,"write to the line request");
+	in.Events(*cd);
+	TestCheck(cd->switchlist[1].state==LOW&&cd->switchlist[1].LastOff==3000+MonoOffset&&tally.actions==actions+2,
+		"a falling edge turns it Off, and edges of other pins and repeats are ignored");
+	TestCheck(cd->switchlist[0].state==HIGH,"the other switch is left alone");
+
+	close(p[0]);
+	close(p[1]);
+	TestConfigFree(cd);
+}
+#endif
+
+// sumpalarm selftest [test ...]
+// Built-in tests of the parts of the daemon that don't need the hardware. They run with
+// Replaying set, so nothing is logged and actions are counted rather than run. Returns
+// the number of failed cases
+int SelfTest(int argc, char **argv)
+{
+	struct ReplayTally tally;
+	struct
 	{
-		FILE *logfile=fopen(LogFileName,"a");
-		if (logfile==NULL) return;
-		fputs(logentry,logfile);
-		fclose(logfile);
+		const char *name;
+		void (*run)(struct ReplayTally &tally);
+	} test[]=
+	{
+		{"scan",TestScan},
+		{"state",TestState},
+		{"journal",TestJournal},
+		{"query",TestQuery},
+		{"wheel",TestWheel},
+		{"registers",TestRegisters},
+		{"templates",TestTemplates},
+		{"sinks",TestSinks},
+		#ifdef INPUT_GPIOCHIP
+		{"gpiochip",TestGpioChip},
+		#endif
+		{NULL,NULL}
+	};
+
+	memset(&tally,0,sizeof(tally));
+	Replaying=&tally;
+	for (int a=0;a<argc;a++)
+	{
+		int i;
+		for (i=0;test[i].name!=NULL&&strcmp(test[i].name,argv[a])!=0;i++);
+		if (test[i].name!=NULL) continue;
+		printf("No test %s in this build. Tests:",argv[a]);
+		for (i=0;test[i].name!=NULL;i++) printf(" %s",test[i].name);
+		printf("\n");
+		return 1;
 	}
-	else fputs(logentry,stdout);
-}
\ No newline at end of file
+	for (int i=0;test[i].name!=NULL;i++)
+	{
+		bool wanted=argc==0;
+		for (int a=0;a<argc;a++)
+			if (strcmp(test[i].name,argv[a])==0) wanted=true;
+		if (!wanted) continue;
+		printf("%s\n",test[i].name);
+		test[i].run(tally);
+	}
+	Replaying=NULL;
+	printf("%d failed\n",TestFailures);
+	return TestFailures;
+}